@@ -0,0 +1,96 @@
+#ifndef MPRIS_STATUS_H
+#define MPRIS_STATUS_H
+
+// Layout of the status page that mpv-mpris keeps up to date when
+// mpris-status-page is set, and a reader for it. Map the file once and
+// read it as often as needed, without any D-Bus traffic:
+//
+//     int fd = open(path, O_RDONLY | O_CLOEXEC);
+//     const MprisStatusPage *page = mmap(NULL, sizeof(*page), PROT_READ,
+//                                        MAP_SHARED, fd, 0);
+//     MprisStatus status;
+//     if (mpris_status_read(page, &status)) {
+//         printf("%s - %s\n", status.artist, status.title);
+//     }
+//
+// The page is only written by the plugin. Its sequence number is odd while
+// an update is in progress, readers retry until they got a consistent copy.
+// The page is for display only, control still goes through MPRIS.
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#define MPRIS_STATUS_MAGIC 0x6d707273u
+#define MPRIS_STATUS_VERSION 1
+#define MPRIS_STATUS_TEXT_SIZE 512
+
+enum {
+    MPRIS_STATUS_STOPPED,
+    MPRIS_STATUS_PAUSED,
+    MPRIS_STATUS_PLAYING,
+};
+
+typedef struct MprisStatus
+{
+    uint32_t playback_status;
+    uint32_t reserved;
+    // Position at position_time_us, a CLOCK_MONOTONIC time
+    int64_t position_us;
+    int64_t position_time_us;
+    double rate;
+    // Like the MPRIS Volume property, 1.0 is 100%
+    double volume;
+    // UTF-8, shortened to fit if needed
+    char title[MPRIS_STATUS_TEXT_SIZE];
+    char artist[MPRIS_STATUS_TEXT_SIZE];
+} MprisStatus;
+
+typedef struct MprisStatusPage
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t sequence;
+    uint32_t reserved;
+    MprisStatus status;
+} MprisStatusPage;
+
+// Returns 0 if the page is not valid, or not anymore because mpv exited
+static inline int mpris_status_read(const MprisStatusPage *page, MprisStatus *status)
+{
+    uint32_t begin;
+    uint32_t end;
+
+    do {
+        if (__atomic_load_n(&page->magic, __ATOMIC_RELAXED) != MPRIS_STATUS_MAGIC ||
+            page->version != MPRIS_STATUS_VERSION) {
+            return 0;
+        }
+        begin = __atomic_load_n(&page->sequence, __ATOMIC_ACQUIRE);
+        memcpy(status, &page->status, sizeof(*status));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        end = __atomic_load_n(&page->sequence, __ATOMIC_RELAXED);
+    } while ((begin & 1) || begin != end);
+
+    status->title[MPRIS_STATUS_TEXT_SIZE - 1] = '\0';
+    status->artist[MPRIS_STATUS_TEXT_SIZE - 1] = '\0';
+    return 1;
+}
+
+// The current position, moved on from the last update while playing
+static inline int64_t mpris_status_position(const MprisStatus *status)
+{
+    struct timespec now;
+    int64_t elapsed_us;
+
+    if (status->playback_status != MPRIS_STATUS_PLAYING) {
+        return status->position_us;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed_us = (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000 -
+                 status->position_time_us;
+    return status->position_us + (int64_t)(elapsed_us * status->rate);
+}
+
+#endif
@@ -1,9 +1,27 @@
+// For memfd_create
+#define _GNU_SOURCE
+
 #include <gio/gio.h>
+#include <gio/gunixfdlist.h>
 #include <glib-unix.h>
+#include <glib/gstdio.h>
 #include <mpv/client.h>
 #include <libavformat/avformat.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
+#include <stdio.h>
 #include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/un.h>
+#include <sys/vfs.h>
+#include <unistd.h>
+
+#include "mpris-status.h"
 
 static const char *introspection_xml =
     "<node>\n"
@@ -64,34 +82,289 @@ static const char *introspection_xml =
     "    <property name=\"CanSeek\" type=\"b\" access=\"read\"/>\n"
     "    <property name=\"CanControl\" type=\"b\" access=\"read\"/>\n"
     "  </interface>\n"
+    "  <interface name=\"io.mpv.Mpris\">\n"
+    "    <method name=\"GetStats\">\n"
+    "      <arg type=\"a{sv}\" name=\"Stats\" direction=\"out\"/>\n"
+    "    </method>\n"
+    "    <method name=\"GetArt\">\n"
+    "      <arg type=\"h\" name=\"Fd\" direction=\"out\"/>\n"
+    "      <arg type=\"s\" name=\"MimeType\" direction=\"out\"/>\n"
+    "      <arg type=\"t\" name=\"Size\" direction=\"out\"/>\n"
+    "      <arg type=\"t\" name=\"Generation\" direction=\"out\"/>\n"
+    "    </method>\n"
+    "    <method name=\"Enqueue\">\n"
+    "      <arg type=\"s\" name=\"Uri\" direction=\"in\"/>\n"
+    "      <arg type=\"o\" name=\"TrackId\" direction=\"out\"/>\n"
+    "    </method>\n"
+    "    <method name=\"Batch\">\n"
+    "      <arg type=\"a(sv)\" name=\"Operations\" direction=\"in\"/>\n"
+    "      <arg type=\"a(bs)\" name=\"Results\" direction=\"out\"/>\n"
+    "    </method>\n"
+    "    <signal name=\"ArtChanged\">\n"
+    "      <arg type=\"t\" name=\"Generation\"/>\n"
+    "    </signal>\n"
+    "    <signal name=\"Heartbeat\">\n"
+    "      <arg type=\"x\" name=\"Position\"/>\n"
+    "      <arg type=\"d\" name=\"Rate\"/>\n"
+    "      <arg type=\"x\" name=\"MonotonicTime\"/>\n"
+    "    </signal>\n"
+    "  </interface>\n"
     "</node>\n";
 
+typedef enum ArtSource
+{
+    ART_SOURCE_COVER_ART_FILES,
+    ART_SOURCE_YOUTUBE,
+    ART_SOURCE_EMBEDDED,
+    ART_SOURCE_FOLDER,
+    ART_SOURCE_COUNT,
+} ArtSource;
+
+typedef struct ArtPolicy
+{
+    ArtSource sources[ART_SOURCE_COUNT];
+    int num_sources;
+    // Used instead of sources for files on network filesystems, if set
+    gboolean has_network_sources;
+    ArtSource network_sources[ART_SOURCE_COUNT];
+    int num_network_sources;
+    gint64 timeout_us; // per source, 0 for no limit
+} ArtPolicy;
+
+typedef struct ArtBlob
+{
+    gchar *hash;
+    gchar *url;
+    gsize size;
+    guint refcount;
+    int memfd; // sealed copy of embedded art for GetArt, -1 if none
+    const char *mime;
+} ArtBlob;
+
+typedef struct ArtCacheEntry
+{
+    gchar *path;
+    ArtBlob *blob; // NULL if the track has no art
+    GList *link;
+    gboolean thumbnail_tried;
+    gboolean albumart_pending; // waiting for a frame of mpv's albumart track
+    gint64 retry_at; // when to look again after a source timed out, 0 if never
+    guint retry_delay_ms;
+} ArtCacheEntry;
+
+typedef struct ArtCache
+{
+    GHashTable *entries; // path -> ArtCacheEntry
+    GHashTable *blobs; // content hash -> ArtBlob
+    GQueue lru; // most recently used entry first
+    gsize size;
+    gsize budget;
+    guint64 hits;
+    guint64 misses;
+    gboolean memfds; // keep embedded art in memfds
+} ArtCache;
+
+typedef enum ThumbnailState
+{
+    THUMBNAIL_IDLE,
+    THUMBNAIL_LOOKUP, // checking the disk cache
+    THUMBNAIL_WAIT_FRAME, // waiting for mpv to show a frame
+    THUMBNAIL_CAPTURE, // screenshot-raw in flight
+    THUMBNAIL_ENCODE,
+} ThumbnailState;
+
+// Jobs may finish after the plugin has stopped, they only reach it through
+// this while it is attached
+typedef struct ThumbnailerHandle
+{
+    gint refcount;
+    struct UserData *ud; // NULL after shutdown
+} ThumbnailerHandle;
+
+// Video frames are grabbed and encoded in the background for files without
+// cover art, only for the file currently playing. Embedded cover art that
+// mpv has demuxed is grabbed the same way.
+typedef struct Thumbnailer
+{
+    gboolean enabled;
+    guint size; // longest edge in pixels
+    gchar *dir;
+    guint64 cache_max_bytes; // of dir, 0 for no limit
+    gchar *path;
+    gboolean albumart;
+    gchar *cache_file;
+    ThumbnailState state;
+    guint generation; // bumped whenever path changes
+    guint attempts;
+    gboolean frame_shown; // mpv has shown a frame of the current file
+    gboolean capture_in_flight;
+    guint capture_generation;
+    GSource *retry;
+    ThumbnailerHandle *handle;
+    GCancellable *cancellable;
+} Thumbnailer;
+
+typedef struct ThumbnailJob
+{
+    guint generation;
+    ThumbnailerHandle *handle;
+    gchar *path;
+    gchar *dir;
+    guint64 cache_max_bytes;
+    gchar *cache_file;
+    guint size;
+    gboolean accept_dark;
+    gboolean albumart; // encode to png instead of the disk cache
+    GBytes *png;
+    GBytes *frame; // bgr0, NULL to only check the disk cache
+    int width;
+    int height;
+    int stride;
+} ThumbnailJob;
+
+// Writes to a property are rate limited, only the newest value is kept
+// while waiting for the next write
+typedef struct PropertyWrite
+{
+    struct UserData *ud;
+    const char *name;
+    uint64_t reply_id;
+    double value;
+    gboolean pending;
+    gboolean window_open;
+} PropertyWrite;
+
+typedef struct PeerConnection
+{
+    GDBusConnection *connection;
+    guint interface_ids[3];
+    gulong closed_id;
+} PeerConnection;
+
+// A Batch call waiting for mpv to reply to its commands
+typedef struct Batch
+{
+    GDBusMethodInvocation *invocation;
+    uint64_t first_reply;
+    guint count;
+    guint waiting;
+    GVariant **results;
+    gboolean *merged; // answered by the command of the operation before it
+} Batch;
+
+// Property reads a client may make, refilled at read_rate per second
+typedef struct ReadBucket
+{
+    double tokens;
+    gint64 updated;
+    guint64 throttled;
+    gboolean throttling;
+} ReadBucket;
+
+// A NULL value is sent as an invalidated property
+typedef struct ChangedProperty
+{
+    const char *name;
+    GVariant *value;
+} ChangedProperty;
+
 typedef struct UserData
 {
     mpv_handle *mpv;
     GMainLoop *loop;
     GMainContext *ctx;
-    int wakeup_pipe[2];
+    int wakeup_fd;
+    guint event_batch_size;
+    guint64 event_batches;
+    guint64 event_batches_full;
+    guint64 events_handled;
+    guint event_batch_max;
     gint bus_id;
+    gchar *bus_address;
     GDBusConnection *connection;
+    gulong closed_id;
+    GCancellable *connect_cancellable;
+    GSource *reconnect;
+    guint reconnect_delay_ms;
+    guint connect_failures;
+    gint64 disconnected_at;
+    guint64 reconnects;
+    GDBusServer *peer_server;
+    GPtrArray *peers;
+    // Used from the GDBus worker thread, under read_buckets_lock
+    GMutex read_buckets_lock;
+    GHashTable *read_buckets; // sender -> ReadBucket
+    double read_rate;
+    double read_burst;
+    guint64 reads_throttled;
+    // Player property -> last value sent or read, NULL unless reads over the
+    // limit are answered from it
+    GHashTable *read_snapshot;
     GDBusInterfaceInfo *root_interface_info;
     GDBusInterfaceInfo *player_interface_info;
+    GDBusInterfaceInfo *ext_interface_info;
     guint root_interface_id;
     guint player_interface_id;
+    guint ext_interface_id;
+    gboolean extensions;
     char *client_name;
     const char *status;
     const char *loop_status;
     gboolean shuffle;
-    GHashTable *changed_properties;
-    GVariant *metadata;
+    // As last reported by mpv, so reading them doesn't wait for mpv
+    double rate;
+    double volume;
+    // In the order they first changed. Slots are kept between signals, so
+    // steady state changes don't allocate.
+    GArray *changed_properties; // ChangedProperty
+    GVariant *metadata; // NULL until someone asks for it
+    gboolean lazy_metadata;
     gboolean seek_expected;
+    gboolean seeked_deferred;
+    // Seeks sent that mpv hasn't replied to yet. A playback restart before
+    // the reply to the last one is for an earlier seek, which is superseded.
+    guint seeks_in_flight;
+    GSource *seek_window;
+    guint seek_window_ms;
+    const char *seek_burst_flag;
+    guint seek_burst;
+    int64_t pending_seek_us;
+    gboolean has_pending_position;
+    double pending_position_s;
     gboolean idle;
     gboolean paused;
     gboolean events_setup;
     int64_t playlist_count;
     int64_t playlist_pos;
-    gchar *cached_path;
-    gchar *cached_art_url;
+    GString *metadata_scratch;
+    ArtCache art_cache;
+    ArtPolicy art_policy;
+    ArtBlob *current_art;
+    guint64 art_generation;
+    Thumbnailer thumbnailer;
+    guint write_interval_ms;
+    gsize signal_queue_bytes;
+    guint signal_queue_count;
+    gsize signal_queue_max_bytes;
+    guint signal_queue_max_count;
+    gsize signal_flush_bytes;
+    guint signal_flush_count;
+    gboolean seeked_pending;
+    guint64 signals_coalesced;
+    guint heartbeat_ms;
+    GSource *heartbeat;
+    FILE *trace;
+    gint64 trace_start;
+    PropertyWrite volume_write;
+    PropertyWrite rate_write;
+    GHashTable *batches; // reply id -> Batch
+    GHashTable *enqueues; // reply id -> GDBusMethodInvocation
+    MprisStatusPage *status_page;
+    gchar *status_page_path;
+    dev_t status_page_dev;
+    ino_t status_page_ino;
+    uint64_t next_batch_reply;
+    gboolean open_uri_append;
 } UserData;
 
 static const char *STATUS_PLAYING = "Playing";
@@ -100,70 +373,388 @@ static const char *STATUS_STOPPED = "Stopped";
 static const char *LOOP_NONE = "None";
 static const char *LOOP_TRACK = "Track";
 static const char *LOOP_PLAYLIST = "Playlist";
+enum {
+    REPLY_NONE,
+    REPLY_VOLUME,
+    REPLY_RATE,
+    REPLY_THUMBNAIL,
+    REPLY_SEEK,
+    REPLY_BATCH, // and up, one per operation of a Batch call or Enqueue
+};
+
+static const char *art_source_names[ART_SOURCE_COUNT] = {
+    "cover-art-files",
+    "youtube",
+    "embedded",
+    "folder",
+};
+
+static const char *SEEK_KEYFRAMES = "keyframes";
+static const char *SEEK_EXACT = "exact";
+static const guint THUMBNAIL_ATTEMPTS = 3;
+static const guint THUMBNAIL_MIN_LUMA = 32;
+static const guint THUMBNAIL_RETRY_MS = 1000;
+static const guint ALBUMART_SIZE = 512;
+static const guint ART_RETRY_MIN_MS = 10000;
+static const guint ART_RETRY_MAX_MS = 300000;
+static const guint RECONNECT_MIN_MS = 50;
+static const guint RECONNECT_MAX_MS = 2000;
+static const guint READ_BUCKETS_MAX = 256;
 static const char *TRACK_PATH_PREFIX = "/mpv/mpris/Track/";
 static const char *NO_TRACK_ID = "/org/mpris/MediaPlayer2/TrackList/NoTrack";
 
 static void setup_mpv_event_sources(UserData *ud);
+static void emit_seeked_signal(UserData *ud);
+static void emit_signal(UserData *ud, const char *interface_name,
+                        const char *signal_name, GVariant *params);
+static void thumbnail_job_done(GObject *source, GAsyncResult *res, gpointer data);
+static void thumbnail_capture(UserData *ud);
 static gboolean can_go_next(UserData *ud);
 static gboolean can_go_previous(UserData *ud);
 static gboolean can_play_pause(UserData *ud);
 
-static gchar *string_to_utf8(gchar *maybe_utf8)
+// Returns a new reference to a variant that is made once, shared by all
+// instances and never freed, so nothing is allocated
+static GVariant *variant_boolean(gboolean value)
+{
+    static GVariant *true_value;
+    static GVariant *false_value;
+    GVariant **slot = value ? &true_value : &false_value;
+
+    if (g_once_init_enter(slot)) {
+        g_once_init_leave(slot, g_variant_ref_sink(g_variant_new_boolean(value)));
+    }
+    return g_variant_ref(*slot);
+}
+
+// Same for the STATUS_ and LOOP_ constants
+static GVariant *variant_constant_string(const char *value)
+{
+    const char *constants[] = {
+        STATUS_PLAYING, STATUS_PAUSED, STATUS_STOPPED,
+        LOOP_NONE, LOOP_TRACK, LOOP_PLAYLIST,
+    };
+    static GVariant *values[G_N_ELEMENTS(constants)];
+
+    for (guint i = 0; i < G_N_ELEMENTS(constants); i++) {
+        if (value == constants[i]) {
+            if (g_once_init_enter(&values[i])) {
+                g_once_init_leave(&values[i], g_variant_ref_sink(g_variant_new_string(value)));
+            }
+            return g_variant_ref(values[i]);
+        }
+    }
+    return g_variant_ref_sink(g_variant_new_string(value));
+}
+
+// Takes the reference to value
+static void set_changed_property(UserData *ud, const char *name, GVariant *value)
+{
+    ChangedProperty *changed;
+
+    for (guint i = 0; i < ud->changed_properties->len; i++) {
+        changed = &g_array_index(ud->changed_properties, ChangedProperty, i);
+        if (changed->name == name || strcmp(changed->name, name) == 0) {
+            if (changed->value) {
+                g_variant_unref(changed->value);
+            }
+            changed->value = value;
+            return;
+        }
+    }
+
+    g_array_append_vals(ud->changed_properties, &(ChangedProperty){name, value}, 1);
+}
+
+static void clear_changed_properties(UserData *ud)
+{
+    for (guint i = 0; i < ud->changed_properties->len; i++) {
+        ChangedProperty *changed = &g_array_index(ud->changed_properties, ChangedProperty, i);
+        if (changed->value) {
+            g_variant_unref(changed->value);
+        }
+    }
+    // Keeps the allocation
+    g_array_set_size(ud->changed_properties, 0);
+}
+
+// Options are read from mpv's script-opts, e.g. --script-opts=mpris-foo=bar
+static char *get_script_opt(mpv_handle *mpv, const char *name)
+{
+    mpv_node opts;
+    char *value = NULL;
+    gchar *key = g_strconcat("mpris-", name, NULL);
+
+    if (mpv_get_property(mpv, "options/script-opts", MPV_FORMAT_NODE, &opts) >= 0) {
+        if (opts.format == MPV_FORMAT_NODE_MAP) {
+            mpv_node_list *list = opts.u.list;
+            for (int i = 0; i < list->num; i++) {
+                if (strcmp(list->keys[i], key) == 0 &&
+                    list->values[i].format == MPV_FORMAT_STRING) {
+                    value = g_strdup(list->values[i].u.string);
+                    break;
+                }
+            }
+        }
+        mpv_free_node_contents(&opts);
+    }
+
+    g_free(key);
+    return value;
+}
+
+static gint64 get_script_opt_int(mpv_handle *mpv, const char *name, gint64 def)
+{
+    gint64 value = def;
+    char *str = get_script_opt(mpv, name);
+
+    if (str && !g_ascii_string_to_signed(str, 10, 0, G_MAXINT64, &value, NULL)) {
+        g_printerr("Invalid value for mpris-%s: %s\n", name, str);
+        value = def;
+    }
+
+    g_free(str);
+    return value;
+}
+
+static gboolean get_script_opt_bool(mpv_handle *mpv, const char *name, gboolean def)
+{
+    gboolean value = def;
+    char *str = get_script_opt(mpv, name);
+
+    if (g_strcmp0(str, "yes") == 0) {
+        value = TRUE;
+    } else if (g_strcmp0(str, "no") == 0) {
+        value = FALSE;
+    } else if (str) {
+        g_printerr("Invalid value for mpris-%s: %s\n", name, str);
+    }
+
+    g_free(str);
+    return value;
+}
+
+// A trace is a header followed by records, each a little-endian 32-bit
+// size and a serialized GVariant of type TRACE_RECORD_TYPE: microseconds
+// since the trace started, the kind of record, a name and a payload.
+//   'e' mpv event: mpv_event_name(), (event id, reply_userdata, error)
+//   'p' mpv property change: property name, its value or ()
+//   'c' D-Bus method call: method name, (interface, parameters)
+//   'g' D-Bus property get: property name, (interface, ())
+//   's' D-Bus property set: property name, (interface, value)
+//   'r' mpv property read: property name, the value mpv returned or ()
+// GVariant data is in host byte order, the header says which.
+static const char TRACE_MAGIC[8] = {'M', 'P', 'R', 'I', 'S', 'T', 'R', 'C'};
+static const guint8 TRACE_VERSION = 2;
+static const char *TRACE_RECORD_TYPE = "(xysv)";
+
+static void trace_open(UserData *ud)
+{
+    guint8 header[10];
+    char *path = get_script_opt(ud->mpv, "trace-file");
+
+    if (!path) {
+        return;
+    }
+
+    ud->trace = fopen(path, "wb");
+    if (!ud->trace) {
+        g_printerr("Failed to open trace file %s: %s\n", path, g_strerror(errno));
+        g_free(path);
+        return;
+    }
+
+    memcpy(header, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+    header[8] = TRACE_VERSION;
+    header[9] = G_BYTE_ORDER == G_LITTLE_ENDIAN ? 'l' : 'B';
+    fwrite(header, 1, sizeof(header), ud->trace);
+    ud->trace_start = g_get_monotonic_time();
+    g_free(path);
+}
+
+static void trace_write(UserData *ud, char kind, const char *name, GVariant *payload)
+{
+    GVariant *record = g_variant_ref_sink(
+        g_variant_new(TRACE_RECORD_TYPE,
+                      g_get_monotonic_time() - ud->trace_start,
+                      kind, name, payload));
+    guint32 size = GUINT32_TO_LE(g_variant_get_size(record));
+
+    fwrite(&size, 1, sizeof(size), ud->trace);
+    fwrite(g_variant_get_data(record), 1, g_variant_get_size(record), ud->trace);
+    g_variant_unref(record);
+}
+
+static GVariant *trace_value(mpv_format format, void *data)
+{
+    switch (format) {
+    case MPV_FORMAT_FLAG:
+        return g_variant_new_boolean(*(int*)data);
+    case MPV_FORMAT_INT64:
+        return g_variant_new_int64(*(int64_t*)data);
+    case MPV_FORMAT_DOUBLE:
+        return g_variant_new_double(*(double*)data);
+    case MPV_FORMAT_STRING:
+        // Not necessarily UTF-8
+        return g_variant_new_bytestring(*(char**)data);
+    default:
+        return g_variant_new("()");
+    }
+}
+
+static void trace_mpv_event(UserData *ud, mpv_event *event)
 {
-    gchar *attempted_validation;
-    attempted_validation = g_utf8_make_valid(maybe_utf8, -1);
+    if (!ud->trace) {
+        return;
+    }
 
-    if (g_utf8_validate(attempted_validation, -1, NULL)) {
-        return attempted_validation;
+    if (event->event_id == MPV_EVENT_PROPERTY_CHANGE) {
+        mpv_event_property *prop = event->data;
+        trace_write(ud, 'p', prop->name, trace_value(prop->format, prop->data));
     } else {
-        g_free(attempted_validation);
-        return g_strdup("<invalid utf8>");
+        const char *name = mpv_event_name(event->event_id);
+        trace_write(ud, 'e', name ? name : "unknown",
+                    g_variant_new("(uti)", event->event_id,
+                                  event->reply_userdata, event->error));
+    }
+}
+
+// payload may be NULL
+static void trace_dbus(UserData *ud, char kind, const char *interface_name,
+                       const char *name, GVariant *payload)
+{
+    if (!ud->trace) {
+        return;
+    }
+
+    trace_write(ud, kind, name,
+                g_variant_new("(sv)", interface_name,
+                              payload ? payload : g_variant_new("()")));
+}
+
+// Properties the plugin reads instead of observing are traced as well, so
+// that replay answers them with what mpv returned at the time
+static int read_property(UserData *ud, const char *name,
+                         mpv_format format, void *data)
+{
+    int res = mpv_get_property(ud->mpv, name, format, data);
+
+    if (ud->trace) {
+        trace_write(ud, 'r', name,
+                    res >= 0 ? trace_value(format, data) : g_variant_new("()"));
+    }
+    return res;
+}
+
+static char *read_property_string(UserData *ud, const char *name)
+{
+    char *value = mpv_get_property_string(ud->mpv, name);
+
+    if (ud->trace) {
+        trace_write(ud, 'r', name,
+                    value ? trace_value(MPV_FORMAT_STRING, &value) : g_variant_new("()"));
+    }
+    return value;
+}
+
+// Scan a word at a time for bytes with the high bit set. Plain ASCII is
+// always valid UTF-8 and is what most tags are.
+static gboolean is_ascii(const char *str, gsize len)
+{
+    gsize i = 0;
+
+    for (; i + sizeof(guint64) <= len; i += sizeof(guint64)) {
+        guint64 word;
+        memcpy(&word, str + i, sizeof(word));
+        if (word & G_GUINT64_CONSTANT(0x8080808080808080)) {
+            return FALSE;
+        }
+    }
+
+    for (; i < len; i++) {
+        if ((guchar)str[i] & 0x80) {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+// Returns maybe_utf8 itself if it is valid. Otherwise each invalid byte is
+// replaced with U+FFFD, like g_utf8_make_valid() does, into the scratch
+// buffer which is only valid until the next call.
+static const gchar *string_to_utf8(GString *scratch, const gchar *maybe_utf8)
+{
+    gsize remaining = strlen(maybe_utf8);
+    const gchar *end;
+
+    if (is_ascii(maybe_utf8, remaining) ||
+        g_utf8_validate(maybe_utf8, remaining, NULL)) {
+        return maybe_utf8;
+    }
+
+    g_string_truncate(scratch, 0);
+    while (!g_utf8_validate(maybe_utf8, remaining, &end)) {
+        gsize valid = end - maybe_utf8;
+        g_string_append_len(scratch, maybe_utf8, valid);
+        g_string_append(scratch, "\357\277\275");
+        maybe_utf8 = end + 1;
+        remaining -= valid + 1;
     }
+    g_string_append_len(scratch, maybe_utf8, remaining);
+
+    return scratch->str;
 }
 
-static void add_metadata_item_string(mpv_handle *mpv, GVariantDict *dict,
+static void add_metadata_item_string(UserData *ud, GVariantDict *dict,
                                      const char *property, const char *tag)
 {
-    char *temp = mpv_get_property_string(mpv, property);
+    char *temp = read_property_string(ud, property);
     if (temp) {
-        char *utf8 = string_to_utf8(temp);
+        const gchar *utf8 = string_to_utf8(ud->metadata_scratch, temp);
         g_variant_dict_insert(dict, tag, "s", utf8);
-        g_free(utf8);
         mpv_free(temp);
     }
 }
 
-static void add_metadata_item_int(mpv_handle *mpv, GVariantDict *dict,
+static void add_metadata_item_int(UserData *ud, GVariantDict *dict,
                                   const char *property, const char *tag)
 {
     int64_t value;
-    int res = mpv_get_property(mpv, property, MPV_FORMAT_INT64, &value);
+    int res = read_property(ud, property, MPV_FORMAT_INT64, &value);
     if (res >= 0) {
         g_variant_dict_insert(dict, tag, "x", value);
     }
 }
 
-static void add_metadata_item_string_list(mpv_handle *mpv, GVariantDict *dict,
+static void add_metadata_item_string_list(UserData *ud, GVariantDict *dict,
                                           const char *property, const char *tag)
 {
-    char *temp = mpv_get_property_string(mpv, property);
+    char *temp = read_property_string(ud, property);
 
     if (temp) {
         GVariantBuilder builder;
-        char **list = g_strsplit(temp, ", ", 0);
-        char **iter = list;
+        char *item = temp;
         g_variant_builder_init(&builder, G_VARIANT_TYPE("as"));
 
-        for (; *iter; iter++) {
-            char *item = *iter;
-            char *utf8 = string_to_utf8(item);
-            g_variant_builder_add(&builder, "s", utf8);
-            g_free(utf8);
+        // Split in place, the string is ours to modify
+        while (*item) {
+            char *sep = strstr(item, ", ");
+            if (sep) {
+                *sep = '\0';
+            }
+
+            g_variant_builder_add(&builder, "s",
+                                  string_to_utf8(ud->metadata_scratch, item));
+
+            if (!sep) {
+                break;
+            }
+            item = sep + 2;
         }
 
         g_variant_dict_insert(dict, tag, "as", &builder);
 
-        g_strfreev(list);
         mpv_free(temp);
     }
 }
@@ -184,12 +775,12 @@ static gchar *path_to_uri(mpv_handle *mpv, char *path)
     return uri;
 }
 
-static void add_metadata_uri(mpv_handle *mpv, GVariantDict *dict)
+static void add_metadata_uri(UserData *ud, GVariantDict *dict)
 {
     char *path;
     char *uri;
 
-    path = mpv_get_property_string(mpv, "path");
+    path = read_property_string(ud, "path");
     if (!path) {
         return;
     }
@@ -199,7 +790,7 @@ static void add_metadata_uri(mpv_handle *mpv, GVariantDict *dict)
         g_variant_dict_insert(dict, "xesam:url", "s", path);
         g_free(uri);
     } else {
-        gchar *converted = path_to_uri(mpv, path);
+        gchar *converted = path_to_uri(ud->mpv, path);
         g_variant_dict_insert(dict, "xesam:url", "s", converted);
         g_free(converted);
     }
@@ -228,7 +819,9 @@ static gchar* try_get_cover_art_file(mpv_handle *mpv)
     return out;
 }
 
-static gchar* try_get_folder_art(mpv_handle *mpv, char *path)
+// timed_out, if not NULL, is set when the deadline stopped the search
+static gchar* try_get_folder_art(mpv_handle *mpv, char *path, gint64 deadline,
+                                 gboolean *timed_out)
 {
     gchar *out = NULL;
     gchar *dirname = g_path_get_dirname(path);
@@ -250,6 +843,16 @@ static gchar* try_get_folder_art(mpv_handle *mpv, char *path)
 
     for (gchar **name = names; *name; ++name) {
         for (gchar **ext = exts; *ext; ++ext) {
+            // A stat() blocked on a stalled mount cannot be interrupted,
+            // but stop probing further names once out of time
+            if (g_get_monotonic_time() >= deadline) {
+                g_printerr("Timed out looking for folder art for %s\n", path);
+                if (timed_out) {
+                    *timed_out = TRUE;
+                }
+                goto done;
+            }
+
             gchar *filename = g_strdup_printf("%s/%s.%s", dirname, *name, *ext);
             if (g_file_test(filename, G_FILE_TEST_EXISTS)) {
                 out = path_to_uri(mpv, filename);
@@ -293,7 +896,8 @@ static gchar* try_get_youtube_thumbnail(char *path)
     return out;
 }
 
-static gchar* extract_embedded_art(AVFormatContext *context) {
+static GBytes* extract_embedded_art(AVFormatContext *context, const char **mime)
+{
     AVPacket *packet = NULL;
     enum AVCodecID codec_id = AV_CODEC_ID_NONE;
     for (unsigned int i = 0; i < context->nb_streams; i++) {
@@ -312,35 +916,37 @@ static gchar* extract_embedded_art(AVFormatContext *context) {
         return NULL;
     }
 
-    const char *mime;
     switch (codec_id) {
     case AV_CODEC_ID_PNG:
-        mime = "image/png";
+        *mime = "image/png";
         break;
     case AV_CODEC_ID_GIF:
-        mime = "image/gif";
+        *mime = "image/gif";
         break;
     case AV_CODEC_ID_WEBP:
-        mime = "image/webp";
+        *mime = "image/webp";
         break;
     case AV_CODEC_ID_BMP:
-        mime = "image/bmp";
+        *mime = "image/bmp";
         break;
     default:
-        mime = "image/jpeg";
+        *mime = "image/jpeg";
         break;
     }
 
-    gchar *data = g_base64_encode(packet->data, packet->size);
-    gchar *img = g_strconcat("data:", mime, ";base64,", data, NULL);
+    return g_bytes_new(packet->data, packet->size);
+}
 
-    g_free(data);
-    return img;
+static int art_deadline_reached(void *deadline)
+{
+    return g_get_monotonic_time() >= *(gint64*)deadline;
 }
 
-static gchar* try_get_embedded_art(char *path)
+// timed_out, if not NULL, is set when the deadline aborted reading the file
+static GBytes* try_get_embedded_art(char *path, const char **mime, gint64 deadline,
+                                    gboolean *timed_out)
 {
-    gchar *out = NULL;
+    GBytes *out = NULL;
     AVFormatContext *context = NULL;
 
     // Do not let FFmpeg open pipes/devices/fd aliases: that can consume mpv's input.
@@ -348,230 +954,1642 @@ static gchar* try_get_embedded_art(char *path)
         return NULL;
     }
 
+    // Abort blocking reads, e.g. on a stalled network mount
+    context = avformat_alloc_context();
+    if (!context) {
+        return NULL;
+    }
+    context->interrupt_callback.callback = art_deadline_reached;
+    context->interrupt_callback.opaque = &deadline;
+
     if (!avformat_open_input(&context, path, NULL, NULL)) {
-        out = extract_embedded_art(context);
+        out = extract_embedded_art(context, mime);
         avformat_close_input(&context);
+    } else if (art_deadline_reached(&deadline)) {
+        g_printerr("Timed out reading embedded art from %s\n", path);
+        if (timed_out) {
+            *timed_out = TRUE;
+        }
     }
 
     return out;
 }
 
-static gchar* get_art_url(mpv_handle *mpv, char *path)
+static void art_blob_release(ArtCache *cache, ArtBlob *blob)
 {
-    gchar *url;
-    gboolean is_remote = g_str_has_prefix(path, "http");
-
-    if ((url = try_get_cover_art_file(mpv)))
-        return url;
-    if (is_remote && (url = try_get_youtube_thumbnail(path)))
-        return url;
-    if (!is_remote && (url = try_get_embedded_art(path)))
-        return url;
-    if (!is_remote && (url = try_get_folder_art(mpv, path)))
-        return url;
+    if (!blob || --blob->refcount > 0) {
+        return;
+    }
 
-    return NULL;
+    g_hash_table_remove(cache->blobs, blob->hash);
+    cache->size -= blob->size;
+    if (blob->memfd >= 0) {
+        close(blob->memfd);
+    }
+    g_free(blob->hash);
+    g_free(blob->url);
+    g_free(blob);
 }
 
-static void add_metadata_art(UserData *ud, GVariantDict *dict)
+// Sealed so that one copy can be handed to any number of clients
+static int art_memfd_new(GBytes *data)
 {
-    mpv_handle *mpv = ud->mpv;
-    char *path = mpv_get_property_string(mpv, "path");
+    gsize size;
+    const guchar *bytes = g_bytes_get_data(data, &size);
+    int fd = memfd_create("mpris-art", MFD_CLOEXEC | MFD_ALLOW_SEALING);
 
-    if (!path) {
-        return;
+    if (fd < 0) {
+        return -1;
     }
 
-    // mpv may call create_metadata multiple times, so cache to save CPU
-    if (!ud->cached_path || strcmp(path, ud->cached_path)) {
-        g_free(ud->cached_path);
-        g_free(ud->cached_art_url);
-        ud->cached_path = g_strdup(path);
-        ud->cached_art_url = get_art_url(mpv, path);
+    while (size > 0) {
+        ssize_t written = write(fd, bytes, size);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            close(fd);
+            return -1;
+        }
+        bytes += written;
+        size -= written;
     }
 
-    mpv_free(path);
-
-    if (ud->cached_art_url) {
-        g_variant_dict_insert(dict, "mpris:artUrl", "s", ud->cached_art_url);
+    if (fcntl(fd, F_ADD_SEALS,
+              F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0) {
+        close(fd);
+        return -1;
     }
+
+    return fd;
 }
 
-static void add_metadata_content_created(mpv_handle *mpv, GVariantDict *dict)
+// Identical images (e.g. the same cover embedded in every track of an album)
+// are stored once, keyed by a hash of their content
+static ArtBlob* art_blob_intern(ArtCache *cache, gchar *url,
+                                GBytes *data, const char *mime)
 {
-    char *date_str = mpv_get_property_string(mpv, "metadata/by-key/Date");
+    gchar *hash;
+    ArtBlob *blob;
 
-    if (!date_str) {
-        return;
+    if (data) {
+        hash = g_compute_checksum_for_bytes(G_CHECKSUM_SHA1, data);
+    } else {
+        hash = g_compute_checksum_for_string(G_CHECKSUM_SHA1, url, -1);
     }
 
-    GDate* date = g_date_new();
-    if (strlen(date_str) == 4) {
-        gint64 year = g_ascii_strtoll(date_str, NULL, 10);
-        if (year != 0) {
-            g_date_set_dmy(date, 1, 1, year);
+    blob = g_hash_table_lookup(cache->blobs, hash);
+    if (blob) {
+        blob->refcount++;
+        g_free(hash);
+        g_free(url);
+        if (data) {
+            g_bytes_unref(data);
         }
-    } else {
-        g_date_set_parse(date, date_str);
+        return blob;
     }
 
-    if (g_date_valid(date)) {
-        gchar iso8601[21];
-        g_date_strftime(iso8601, 21, "%Y-%m-%dT00:00:00Z", date);
-        g_variant_dict_insert(dict, "xesam:contentCreated", "s", iso8601);
+    blob = g_new0(ArtBlob, 1);
+    blob->memfd = -1;
+
+    if (data) {
+        gsize size;
+        const guchar *bytes = g_bytes_get_data(data, &size);
+        gchar *encoded = g_base64_encode(bytes, size);
+        url = g_strconcat("data:", mime, ";base64,", encoded, NULL);
+        g_free(encoded);
+        if (cache->memfds) {
+            blob->memfd = art_memfd_new(data);
+            blob->mime = mime;
+        }
+        if (blob->memfd >= 0) {
+            blob->size += size;
+        }
+        g_bytes_unref(data);
     }
 
-    g_date_free(date);
-    mpv_free(date_str);
+    blob->hash = hash;
+    blob->url = url;
+    blob->size += sizeof(ArtBlob) + strlen(url) + 1;
+    blob->refcount = 1;
+    g_hash_table_insert(cache->blobs, blob->hash, blob);
+    cache->size += blob->size;
+
+    return blob;
 }
 
-static GVariant *create_metadata(UserData *ud)
+// FUSE is also used for local filesystems, only these are known to be
+// remote
+static const char *remote_fuse_types[] = {
+    "fuse.sshfs",
+    "fuse.rclone",
+    "fuse.s3fs",
+    "fuse.gcsfuse",
+    "fuse.curlftpfs",
+    "fuse.httpdirfs",
+    "fuse.smbnetfs",
+    "fuse.glusterfs",
+    "fuse.juicefs",
+    NULL,
+};
+
+// Looks up the type of the FUSE mount the directory is on by its device
+// number in mountinfo, e.g. "36 35 0:52 / /mnt rw - fuse.sshfs host:/ rw"
+static gboolean is_remote_fuse(const char *dirname)
 {
-    GVariantDict dict;
-    double duration;
-    char *temp_str;
-    int res;
+    GStatBuf st;
+    gchar *contents;
+    gchar **lines;
+    gboolean remote = FALSE;
 
-    g_variant_dict_init(&dict, NULL);
+    if (g_stat(dirname, &st) != 0 ||
+        !g_file_get_contents("/proc/self/mountinfo", &contents, NULL, NULL)) {
+        return FALSE;
+    }
 
-    // mpris:trackid
-    // playlist_pos < 0 if there is no playlist or current track
-    if (ud->playlist_pos < 0) {
-        temp_str = g_strdup(NO_TRACK_ID);
-    } else {
-        temp_str = g_strdup_printf("%s%" PRId64, TRACK_PATH_PREFIX, ud->playlist_pos);
+    lines = g_strsplit(contents, "\n", -1);
+    for (gchar **line = lines; *line; line++) {
+        unsigned int dev_major;
+        unsigned int dev_minor;
+        const char *separator;
+        gsize type_len;
+
+        if (sscanf(*line, "%*u %*u %u:%u", &dev_major, &dev_minor) != 2 ||
+            dev_major != major(st.st_dev) || dev_minor != minor(st.st_dev) ||
+            !(separator = strstr(*line, " - "))) {
+            continue;
+        }
+
+        separator += 3;
+        type_len = strcspn(separator, " ");
+        for (const char **type = remote_fuse_types; *type; type++) {
+            if (strlen(*type) == type_len && strncmp(separator, *type, type_len) == 0) {
+                remote = TRUE;
+            }
+        }
+        break;
     }
-    g_variant_dict_insert(&dict, "mpris:trackid", "o", temp_str);
-    g_free(temp_str);
 
-    // mpris:length
-    res = mpv_get_property(ud->mpv, "duration", MPV_FORMAT_DOUBLE, &duration);
-    if (res == MPV_ERROR_SUCCESS) {
-        g_variant_dict_insert(&dict, "mpris:length", "x", (int64_t)(duration * 1000000.0));
+    g_strfreev(lines);
+    g_free(contents);
+    return remote;
+}
+
+static gboolean is_network_filesystem(char *path)
+{
+    struct statfs buf;
+    gchar *dirname = g_path_get_dirname(path);
+    gboolean network = FALSE;
+
+    if (statfs(dirname, &buf) == 0) {
+        switch ((unsigned long)buf.f_type) {
+        case 0x6969: // NFS
+        case 0x517b: // SMB
+        case 0xff534d42: // CIFS
+        case 0xfe534d42: // SMB2
+        case 0x01021997: // 9P
+        case 0x00c36400: // Ceph
+        case 0x5346414f: // AFS
+        case 0x6b414653: // kAFS
+        case 0x73757245: // Coda
+            network = TRUE;
+            break;
+        case 0x65735546: // FUSE
+            network = is_remote_fuse(dirname);
+            break;
+        default:
+            break;
+        }
     }
 
-    add_metadata_item_string(ud->mpv, &dict, "media-title", "xesam:title");
-    add_metadata_item_string(ud->mpv, &dict, "metadata/by-key/Album", "xesam:album");
-    add_metadata_item_string(ud->mpv, &dict, "metadata/by-key/Genre", "xesam:genre");
+    g_free(dirname);
+    return network;
+}
 
-    /* Musicbrainz metadata mappings
-       (https://picard-docs.musicbrainz.org/en/appendices/tag_mapping.html) */
+static int parse_art_sources(mpv_handle *mpv, const char *option,
+                             const char *def, ArtSource *sources)
+{
+    int num_sources = 0;
+    char *value = get_script_opt(mpv, option);
+    gchar **names = g_strsplit(value ? value : def, ",", -1);
 
-    // IDv3 metadata format
-    add_metadata_item_string(ud->mpv, &dict, "metadata/by-key/MusicBrainz Artist Id", "mb:artistId");
-    add_metadata_item_string(ud->mpv, &dict, "metadata/by-key/MusicBrainz Track Id", "mb:trackId");
-    add_metadata_item_string(ud->mpv, &dict, "metadata/by-key/MusicBrainz Album Artist Id", "mb:albumArtistId");
-    add_metadata_item_string(ud->mpv, &dict, "metadata/by-key/MusicBrainz Album Id", "mb:albumId");
-    add_metadata_item_string(ud->mpv, &dict, "metadata/by-key/MusicBrainz Release Track Id", "mb:releaseTrackId");
-    add_metadata_item_string(ud->mpv, &dict, "metadata/by-key/MusicBrainz Work Id", "mb:workId");
+    for (gchar **name = names; *name; ++name) {
+        int source;
+        for (source = 0; source < ART_SOURCE_COUNT; source++) {
+            if (g_strcmp0(*name, art_source_names[source]) == 0) {
+                break;
+            }
+        }
 
-    // Vorbis & APEv2 metadata format
-    add_metadata_item_string(ud->mpv, &dict, "metadata/by-key/MUSICBRAINZ_ARTISTID", "mb:artistId");
-    add_metadata_item_string(ud->mpv, &dict, "metadata/by-key/MUSICBRAINZ_TRACKID", "mb:trackId");
-    add_metadata_item_string(ud->mpv, &dict, "metadata/by-key/MUSICBRAINZ_ALBUMARTISTID", "mb:albumArtistId");
-    add_metadata_item_string(ud->mpv, &dict, "metadata/by-key/MUSICBRAINZ_ALBUMID", "mb:albumId");
-    add_metadata_item_string(ud->mpv, &dict, "metadata/by-key/MUSICBRAINZ_RELEASETRACKID", "mb:releaseTrackId");
-    add_metadata_item_string(ud->mpv, &dict, "metadata/by-key/MUSICBRAINZ_WORKID", "mb:workId");
-
-    add_metadata_item_string_list(ud->mpv, &dict, "metadata/by-key/uploader", "xesam:artist");
-    add_metadata_item_string_list(ud->mpv, &dict, "metadata/by-key/Artist", "xesam:artist");
-    add_metadata_item_string_list(ud->mpv, &dict, "metadata/by-key/Album_Artist", "xesam:albumArtist");
-    add_metadata_item_string_list(ud->mpv, &dict, "metadata/by-key/Composer", "xesam:composer");
-
-    add_metadata_item_int(ud->mpv, &dict, "metadata/by-key/Track", "xesam:trackNumber");
-    add_metadata_item_int(ud->mpv, &dict, "metadata/by-key/Disc", "xesam:discNumber");
-
-    add_metadata_uri(ud->mpv, &dict);
-    add_metadata_art(ud, &dict);
-    add_metadata_content_created(ud->mpv, &dict);
+        if (source == ART_SOURCE_COUNT) {
+            g_printerr("Unknown art source in mpris-%s: %s\n", option, *name);
+        } else if (num_sources < ART_SOURCE_COUNT) {
+            sources[num_sources++] = source;
+        }
+    }
 
-    return g_variant_dict_end(&dict);
+    g_strfreev(names);
+    g_free(value);
+    return num_sources;
 }
 
-static void method_call_root(G_GNUC_UNUSED GDBusConnection *connection,
-                             G_GNUC_UNUSED const char *sender,
-                             G_GNUC_UNUSED const char *object_path,
-                             G_GNUC_UNUSED const char *interface_name,
-                             const char *method_name,
-                             G_GNUC_UNUSED GVariant *parameters,
-                             GDBusMethodInvocation *invocation,
-                             gpointer user_data)
+static void art_policy_init(ArtPolicy *policy, mpv_handle *mpv)
 {
-    UserData *ud = (UserData*)user_data;
-    if (g_strcmp0(method_name, "Quit") == 0) {
-        const char *cmd[] = {"quit", NULL};
-        mpv_command_async(ud->mpv, 0, cmd);
-        g_dbus_method_invocation_return_value(invocation, NULL);
-
-    } else if (g_strcmp0(method_name, "Raise") == 0) {
-        // Can't raise
-        g_dbus_method_invocation_return_value(invocation, NULL);
-
-    } else {
-        g_dbus_method_invocation_return_error(invocation, G_DBUS_ERROR,
-                                              G_DBUS_ERROR_UNKNOWN_METHOD,
-                                              "Unknown method");
+    policy->num_sources =
+        parse_art_sources(mpv, "art-sources",
+                          "cover-art-files,youtube,embedded,folder",
+                          policy->sources);
+    // Files on network filesystems are only treated differently if asked to
+    char *network_sources = get_script_opt(mpv, "art-network-sources");
+    policy->has_network_sources = network_sources != NULL;
+    if (policy->has_network_sources) {
+        policy->num_network_sources =
+            parse_art_sources(mpv, "art-network-sources", network_sources,
+                              policy->network_sources);
     }
+    g_free(network_sources);
+    policy->timeout_us = get_script_opt_int(mpv, "art-timeout-ms", 2000) * 1000;
 }
 
-static GVariant *get_property_root(G_GNUC_UNUSED GDBusConnection *connection,
-                                   G_GNUC_UNUSED const char *sender,
-                                   G_GNUC_UNUSED const char *object_path,
-                                   G_GNUC_UNUSED const char *interface_name,
-                                   const char *property_name,
-                                   G_GNUC_UNUSED GError **error,
-                                   gpointer user_data)
+// mpv has already demuxed the cover and shows it as the video track
+static gboolean mpv_shows_albumart(mpv_handle *mpv)
+{
+    int albumart = 0;
+    return mpv_get_property(mpv, "current-tracks/video/albumart",
+                            MPV_FORMAT_FLAG, &albumart) >= 0 && albumart;
+}
+
+// mpv loaded the cover from a separate file, e.g. a cover.jpg found by
+// cover-art-auto, which clients can read themselves
+static gchar* try_get_external_albumart(mpv_handle *mpv)
+{
+    int external = 0;
+    char *filename;
+    gchar *scheme;
+    gchar *out;
+
+    if (mpv_get_property(mpv, "current-tracks/video/external",
+                         MPV_FORMAT_FLAG, &external) < 0 || !external) {
+        return NULL;
+    }
+
+    filename = mpv_get_property_string(mpv, "current-tracks/video/external-filename");
+    if (!filename) {
+        return NULL;
+    }
+
+    scheme = g_uri_parse_scheme(filename);
+    out = scheme ? g_strdup(filename) : path_to_uri(mpv, filename);
+    g_free(scheme);
+    mpv_free(filename);
+    return out;
+}
+
+// Sets albumart instead of returning art if it is to be taken from mpv, and
+// timed_out if a source ran out of time, so no art may not be final
+static ArtBlob* get_art_url(ArtCache *cache, const ArtPolicy *policy,
+                            mpv_handle *mpv, char *path, gboolean *albumart,
+                            gboolean *timed_out)
+{
+    gboolean is_remote = g_str_has_prefix(path, "http");
+    const ArtSource *sources = policy->sources;
+    int num_sources = policy->num_sources;
+
+    // Sources like folder need many stat() calls, which can be slow on
+    // network filesystems
+    if (!is_remote && policy->has_network_sources && is_network_filesystem(path)) {
+        sources = policy->network_sources;
+        num_sources = policy->num_network_sources;
+    }
+
+    for (int i = 0; i < num_sources; i++) {
+        gchar *url = NULL;
+        GBytes *data = NULL;
+        const char *mime = NULL;
+        gint64 deadline = G_MAXINT64;
+
+        if (policy->timeout_us > 0) {
+            deadline = g_get_monotonic_time() + policy->timeout_us;
+        }
+
+        switch (sources[i]) {
+        case ART_SOURCE_COVER_ART_FILES:
+            url = try_get_cover_art_file(mpv);
+            break;
+        case ART_SOURCE_YOUTUBE:
+            if (is_remote)
+                url = try_get_youtube_thumbnail(path);
+            break;
+        case ART_SOURCE_EMBEDDED:
+            // The original bytes, not a frame mpv decoded and scaled
+            if (!is_remote)
+                data = try_get_embedded_art(path, &mime, deadline, timed_out);
+            if (!data && mpv_shows_albumart(mpv)) {
+                url = try_get_external_albumart(mpv);
+                if (!url) {
+                    // Streams, archives and other files only mpv can read
+                    *albumart = TRUE;
+                    return NULL;
+                }
+            }
+            break;
+        case ART_SOURCE_FOLDER:
+            if (!is_remote)
+                url = try_get_folder_art(mpv, path, deadline, timed_out);
+            break;
+        default:
+            break;
+        }
+
+        if (url || data) {
+            return art_blob_intern(cache, url, data, mime);
+        }
+    }
+
+    return NULL;
+}
+
+static gsize art_cache_entry_size(ArtCacheEntry *entry)
+{
+    return sizeof(ArtCacheEntry) + strlen(entry->path) + 1;
+}
+
+static void art_cache_remove(ArtCache *cache, ArtCacheEntry *entry)
+{
+    g_queue_delete_link(&cache->lru, entry->link);
+    g_hash_table_remove(cache->entries, entry->path);
+    cache->size -= art_cache_entry_size(entry);
+    art_blob_release(cache, entry->blob);
+    g_free(entry->path);
+    g_free(entry);
+}
+
+static void art_cache_evict(ArtCache *cache)
+{
+    // Never evict the most recently used entry, it belongs to the current track
+    while (cache->size > cache->budget && cache->lru.length > 1) {
+        art_cache_remove(cache, g_queue_peek_tail(&cache->lru));
+    }
+}
+
+static void art_cache_init(ArtCache *cache, gsize budget, gboolean memfds)
+{
+    cache->entries = g_hash_table_new(g_str_hash, g_str_equal);
+    cache->blobs = g_hash_table_new(g_str_hash, g_str_equal);
+    g_queue_init(&cache->lru);
+    cache->size = 0;
+    cache->budget = budget;
+    cache->hits = 0;
+    cache->misses = 0;
+    cache->memfds = memfds;
+}
+
+static void art_cache_clear(ArtCache *cache)
+{
+    while (!g_queue_is_empty(&cache->lru)) {
+        art_cache_remove(cache, g_queue_peek_head(&cache->lru));
+    }
+    g_hash_table_unref(cache->entries);
+    g_hash_table_unref(cache->blobs);
+}
+
+static void art_cache_entry_fill(ArtCache *cache, const ArtPolicy *policy,
+                                 mpv_handle *mpv, ArtCacheEntry *entry)
+{
+    gboolean timed_out = FALSE;
+
+    entry->blob = get_art_url(cache, policy, mpv, entry->path,
+                              &entry->albumart_pending, &timed_out);
+
+    // A stalled mount may answer later, don't give up on the track for the
+    // whole session, but don't stall every Metadata build on it either
+    if (!entry->blob && !entry->albumart_pending && timed_out) {
+        entry->retry_delay_ms = entry->retry_delay_ms == 0 ? ART_RETRY_MIN_MS :
+                                MIN(entry->retry_delay_ms * 2, ART_RETRY_MAX_MS);
+        entry->retry_at = g_get_monotonic_time() + entry->retry_delay_ms * (gint64)1000;
+    } else {
+        entry->retry_at = 0;
+        entry->retry_delay_ms = 0;
+    }
+}
+
+static ArtCacheEntry* art_cache_lookup(ArtCache *cache, const ArtPolicy *policy,
+                                        mpv_handle *mpv, char *path)
+{
+    ArtCacheEntry *entry = g_hash_table_lookup(cache->entries, path);
+
+    if (entry) {
+        cache->hits++;
+        g_queue_unlink(&cache->lru, entry->link);
+        g_queue_push_head_link(&cache->lru, entry->link);
+        if (entry->retry_at != 0 && g_get_monotonic_time() >= entry->retry_at) {
+            art_cache_entry_fill(cache, policy, mpv, entry);
+            art_cache_evict(cache);
+        }
+    } else {
+        cache->misses++;
+        entry = g_new0(ArtCacheEntry, 1);
+        entry->path = g_strdup(path);
+        art_cache_entry_fill(cache, policy, mpv, entry);
+        g_queue_push_head(&cache->lru, entry);
+        entry->link = cache->lru.head;
+        g_hash_table_insert(cache->entries, entry->path, entry);
+        cache->size += art_cache_entry_size(entry);
+        art_cache_evict(cache);
+    }
+
+    return entry;
+}
+
+static gchar *thumbnail_cache_file(const gchar *dir, const gchar *path)
+{
+    GString *key = g_string_new(path);
+    GStatBuf buf;
+    gchar *hash;
+    gchar *name;
+    gchar *file;
+
+    // Regenerate when the file changes
+    if (!g_str_has_prefix(path, "http") && g_stat(path, &buf) == 0) {
+        g_string_append_printf(key, "\n%" G_GINT64_FORMAT, (gint64)buf.st_mtime);
+    }
+
+    hash = g_compute_checksum_for_string(G_CHECKSUM_SHA1, key->str, key->len);
+    name = g_strconcat(hash, ".png", NULL);
+    file = g_build_filename(dir, name, NULL);
+    g_free(name);
+    g_free(hash);
+    g_string_free(key, TRUE);
+    return file;
+}
+
+// Shrinks the frame to fit in size x size, each pixel is the average of
+// the pixels it covers in the frame
+static guchar *scale_frame(const ThumbnailJob *job, int *width, int *height,
+                           guint *max_luma)
+{
+    const guchar *src = g_bytes_get_data(job->frame, NULL);
+    int w = job->width;
+    int h = job->height;
+    int dw = w;
+    int dh = h;
+    guchar *rgb;
+    guchar *out;
+
+    if (w >= h && (guint)w > job->size) {
+        dw = job->size;
+        dh = MAX((gint64)h * dw / w, 1);
+    } else if (h > w && (guint)h > job->size) {
+        dh = job->size;
+        dw = MAX((gint64)w * dh / h, 1);
+    }
+
+    rgb = g_malloc((gsize)dw * dh * 3);
+    out = rgb;
+    *max_luma = 0;
+
+    for (int dy = 0; dy < dh; dy++) {
+        int y0 = (gint64)dy * h / dh;
+        int y1 = MAX((gint64)(dy + 1) * h / dh, y0 + 1);
+        for (int dx = 0; dx < dw; dx++) {
+            int x0 = (gint64)dx * w / dw;
+            int x1 = MAX((gint64)(dx + 1) * w / dw, x0 + 1);
+            guint64 b = 0, g = 0, r = 0;
+            guint64 n = (guint64)(y1 - y0) * (x1 - x0);
+            guint luma;
+
+            for (int y = y0; y < y1; y++) {
+                const guchar *p = src + (gsize)y * job->stride + (gsize)x0 * 4;
+                for (int x = x0; x < x1; x++, p += 4) {
+                    b += p[0];
+                    g += p[1];
+                    r += p[2];
+                }
+            }
+
+            out[0] = r / n;
+            out[1] = g / n;
+            out[2] = b / n;
+            luma = (out[0] * 54 + out[1] * 183 + out[2] * 19) >> 8;
+            *max_luma = MAX(*max_luma, luma);
+            out += 3;
+        }
+    }
+
+    *width = dw;
+    *height = dh;
+    return rgb;
+}
+
+static guint32 png_crc(guint32 crc, const guchar *data, gsize len)
+{
+    for (gsize i = 0; i < len; i++) {
+        crc ^= data[i];
+        for (int k = 0; k < 8; k++) {
+            crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+        }
+    }
+    return crc;
+}
+
+static void png_append_chunk(GByteArray *png, const char *type,
+                             const guchar *data, gsize len)
+{
+    guint32 be = GUINT32_TO_BE(len);
+    guint32 crc = 0xffffffff;
+
+    g_byte_array_append(png, (const guint8*)&be, 4);
+    g_byte_array_append(png, (const guint8*)type, 4);
+    if (len > 0) {
+        g_byte_array_append(png, data, len);
+    }
+
+    crc = png_crc(crc, (const guchar*)type, 4);
+    crc = png_crc(crc, data, len);
+    be = GUINT32_TO_BE(~crc);
+    g_byte_array_append(png, (const guint8*)&be, 4);
+}
+
+static GBytes *zlib_compress(const guchar *data, gsize len, GError **error)
+{
+    GZlibCompressor *compressor =
+        g_zlib_compressor_new(G_ZLIB_COMPRESSOR_FORMAT_ZLIB, -1);
+    GOutputStream *memory = g_memory_output_stream_new_resizable();
+    GOutputStream *stream =
+        g_converter_output_stream_new(memory, G_CONVERTER(compressor));
+    GBytes *compressed = NULL;
+
+    if (g_output_stream_write_all(stream, data, len, NULL, NULL, error) &&
+        g_output_stream_close(stream, NULL, error)) {
+        compressed =
+            g_memory_output_stream_steal_as_bytes(G_MEMORY_OUTPUT_STREAM(memory));
+    }
+
+    g_object_unref(stream);
+    g_object_unref(memory);
+    g_object_unref(compressor);
+    return compressed;
+}
+
+// 8-bit RGB, unfiltered rows
+static GByteArray *encode_png(const guchar *rgb, int width, int height,
+                              GError **error)
+{
+    static const guchar signature[] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    gsize row_size = (gsize)width * 3;
+    guchar *rows = g_malloc((row_size + 1) * height);
+    guchar header[13];
+    guint32 be;
+    GBytes *compressed;
+    GByteArray *png;
+    gsize compressed_size;
+    const guchar *compressed_data;
+
+    for (int y = 0; y < height; y++) {
+        rows[y * (row_size + 1)] = 0;
+        memcpy(rows + y * (row_size + 1) + 1, rgb + y * row_size, row_size);
+    }
+    compressed = zlib_compress(rows, (row_size + 1) * height, error);
+    g_free(rows);
+    if (!compressed) {
+        return NULL;
+    }
+
+    be = GUINT32_TO_BE(width);
+    memcpy(header, &be, 4);
+    be = GUINT32_TO_BE(height);
+    memcpy(header + 4, &be, 4);
+    header[8] = 8; // bit depth
+    header[9] = 2; // RGB
+    header[10] = 0; // deflate
+    header[11] = 0; // adaptive filtering
+    header[12] = 0; // not interlaced
+
+    compressed_data = g_bytes_get_data(compressed, &compressed_size);
+    png = g_byte_array_sized_new(sizeof(signature) + compressed_size + 64);
+    g_byte_array_append(png, signature, sizeof(signature));
+    png_append_chunk(png, "IHDR", header, sizeof(header));
+    png_append_chunk(png, "IDAT", compressed_data, compressed_size);
+    png_append_chunk(png, "IEND", NULL, 0);
+
+    g_bytes_unref(compressed);
+    return png;
+}
+
+// Returns NULL without setting error if the frame is too dark to be useful
+static GByteArray *render_thumbnail(const ThumbnailJob *job, GError **error)
+{
+    int width;
+    int height;
+    guint max_luma;
+    guchar *rgb = scale_frame(job, &width, &height, &max_luma);
+    GByteArray *png;
+
+    // Videos often fade in from black, a later frame is more recognisable
+    if (max_luma < THUMBNAIL_MIN_LUMA && !job->accept_dark) {
+        g_free(rgb);
+        return NULL;
+    }
+
+    png = encode_png(rgb, width, height, error);
+    g_free(rgb);
+    return png;
+}
+
+typedef struct ThumbnailFile
+{
+    gchar *name;
+    gint64 mtime;
+    guint64 size;
+} ThumbnailFile;
+
+static gint thumbnail_file_compare_mtime(gconstpointer a, gconstpointer b)
+{
+    const ThumbnailFile *file_a = a;
+    const ThumbnailFile *file_b = b;
+    return (file_a->mtime > file_b->mtime) - (file_a->mtime < file_b->mtime);
+}
+
+// Removes the least recently used thumbnails until the cache fits in its
+// budget again, lookups touch the files they find
+static void prune_thumbnails(const ThumbnailJob *job)
+{
+    GDir *dir;
+    GArray *files;
+    const gchar *name;
+    guint64 total = 0;
+
+    if (job->cache_max_bytes == 0 || !(dir = g_dir_open(job->dir, 0, NULL))) {
+        return;
+    }
+
+    files = g_array_new(FALSE, FALSE, sizeof(ThumbnailFile));
+    while ((name = g_dir_read_name(dir))) {
+        gchar *file = g_build_filename(job->dir, name, NULL);
+        GStatBuf buf;
+
+        // Skips the temporary files of writes in progress
+        if (g_str_has_suffix(name, ".png") && g_stat(file, &buf) == 0 &&
+            S_ISREG(buf.st_mode)) {
+            ThumbnailFile entry = {file, (gint64)buf.st_mtime, (guint64)buf.st_size};
+            g_array_append_val(files, entry);
+            total += entry.size;
+        } else {
+            g_free(file);
+        }
+    }
+    g_dir_close(dir);
+
+    if (total > job->cache_max_bytes) {
+        g_array_sort(files, thumbnail_file_compare_mtime);
+        for (guint i = 0; i < files->len && total > job->cache_max_bytes; i++) {
+            ThumbnailFile *file = &g_array_index(files, ThumbnailFile, i);
+            // The one just written is about to be used
+            if (g_strcmp0(file->name, job->cache_file) != 0 && g_unlink(file->name) == 0) {
+                total -= file->size;
+            }
+        }
+    }
+
+    for (guint i = 0; i < files->len; i++) {
+        g_free(g_array_index(files, ThumbnailFile, i).name);
+    }
+    g_array_free(files, TRUE);
+}
+
+static gboolean write_thumbnail(const ThumbnailJob *job, GByteArray *png,
+                                GError **error)
+{
+    gboolean written = FALSE;
+
+    if (g_mkdir_with_parents(job->dir, 0700) != 0) {
+        int saved_errno = errno;
+        g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(saved_errno),
+                    "Failed to create %s: %s", job->dir, g_strerror(saved_errno));
+    } else {
+        written = g_file_set_contents(job->cache_file, (const gchar*)png->data,
+                                      png->len, error);
+    }
+
+    if (written) {
+        prune_thumbnails(job);
+    }
+
+    return written;
+}
+
+// Runs in a worker thread
+static void thumbnail_job_run(GTask *task, G_GNUC_UNUSED gpointer source,
+                              gpointer data, GCancellable *cancellable)
+{
+    ThumbnailJob *job = data;
+    GError *error = NULL;
+    GByteArray *png = NULL;
+    gboolean ready = FALSE;
+
+    if (!job->frame) {
+        job->cache_file = thumbnail_cache_file(job->dir, job->path);
+        ready = g_file_test(job->cache_file, G_FILE_TEST_IS_REGULAR);
+        if (ready) {
+            // Keeps it from being pruned as if it was unused
+            g_utime(job->cache_file, NULL);
+        }
+    } else if (!g_cancellable_set_error_if_cancelled(cancellable, &error)) {
+        png = render_thumbnail(job, &error);
+    }
+
+    if (png && job->albumart) {
+        job->png = g_byte_array_free_to_bytes(png);
+        ready = TRUE;
+    } else if (png) {
+        ready = write_thumbnail(job, png, &error);
+        g_byte_array_unref(png);
+    }
+
+    if (error) {
+        g_task_return_error(task, error);
+    } else {
+        g_task_return_boolean(task, ready);
+    }
+}
+
+static ThumbnailerHandle *thumbnailer_handle_ref(ThumbnailerHandle *handle)
+{
+    g_atomic_int_inc(&handle->refcount);
+    return handle;
+}
+
+// A job can be freed in its worker thread if its callback never runs
+static void thumbnailer_handle_unref(ThumbnailerHandle *handle)
+{
+    if (g_atomic_int_dec_and_test(&handle->refcount)) {
+        g_free(handle);
+    }
+}
+
+static void thumbnail_job_free(gpointer data)
+{
+    ThumbnailJob *job = data;
+
+    thumbnailer_handle_unref(job->handle);
+    g_free(job->path);
+    g_free(job->dir);
+    g_free(job->cache_file);
+    if (job->frame) {
+        g_bytes_unref(job->frame);
+    }
+    if (job->png) {
+        g_bytes_unref(job->png);
+    }
+    g_free(job);
+}
+
+// frame is NULL to check the disk cache
+static void thumbnail_start_job(UserData *ud, GBytes *frame,
+                                int width, int height, int stride)
+{
+    Thumbnailer *thumbnailer = &ud->thumbnailer;
+    ThumbnailJob *job = g_new0(ThumbnailJob, 1);
+    GTask *task;
+
+    job->handle = thumbnailer_handle_ref(thumbnailer->handle);
+    job->generation = thumbnailer->generation;
+    job->path = g_strdup(thumbnailer->path);
+    job->dir = g_strdup(thumbnailer->dir);
+    job->cache_max_bytes = thumbnailer->cache_max_bytes;
+    job->cache_file = g_strdup(thumbnailer->cache_file);
+    job->size = thumbnailer->albumart ? ALBUMART_SIZE : thumbnailer->size;
+    job->accept_dark = thumbnailer->albumart ||
+                       thumbnailer->attempts >= THUMBNAIL_ATTEMPTS;
+    job->albumart = thumbnailer->albumart;
+    job->frame = frame;
+    job->width = width;
+    job->height = height;
+    job->stride = stride;
+
+    task = g_task_new(NULL, thumbnailer->cancellable, thumbnail_job_done, NULL);
+    g_task_set_task_data(task, job, thumbnail_job_free);
+    g_task_run_in_thread(task, thumbnail_job_run);
+    g_object_unref(task);
+}
+
+static void thumbnail_reset(Thumbnailer *thumbnailer)
+{
+    g_clear_pointer(&thumbnailer->path, g_free);
+    g_clear_pointer(&thumbnailer->cache_file, g_free);
+    if (thumbnailer->retry) {
+        g_source_destroy(thumbnailer->retry);
+        g_clear_pointer(&thumbnailer->retry, g_source_unref);
+    }
+    thumbnailer->state = THUMBNAIL_IDLE;
+    thumbnailer->generation++;
+    thumbnailer->attempts = 0;
+    thumbnailer->albumart = FALSE;
+}
+
+static void thumbnail_request(UserData *ud, ArtCacheEntry *entry)
+{
+    Thumbnailer *thumbnailer = &ud->thumbnailer;
+    int64_t video_id;
+
+    if (g_strcmp0(thumbnailer->path, entry->path) == 0) {
+        return;
+    }
+
+    thumbnail_reset(thumbnailer);
+
+    // Album art is not cached on disk, it only needs a frame
+    if (entry->albumart_pending) {
+        thumbnailer->path = g_strdup(entry->path);
+        thumbnailer->albumart = TRUE;
+        thumbnailer->state = THUMBNAIL_WAIT_FRAME;
+        thumbnail_capture(ud);
+        return;
+    }
+
+    // Audio files have no frames to grab
+    if (read_property(ud, "current-tracks/video/id",
+                      MPV_FORMAT_INT64, &video_id) < 0) {
+        entry->thumbnail_tried = TRUE;
+        return;
+    }
+
+    thumbnailer->path = g_strdup(entry->path);
+    thumbnailer->state = THUMBNAIL_LOOKUP;
+    thumbnail_start_job(ud, NULL, 0, 0, 0);
+}
+
+static void thumbnailer_init(Thumbnailer *thumbnailer, UserData *ud)
+{
+    mpv_handle *mpv = ud->mpv;
+
+    thumbnailer->enabled = get_script_opt_bool(mpv, "video-thumbnails", FALSE);
+    thumbnailer->size = CLAMP(get_script_opt_int(mpv, "thumbnail-size", 256), 16, 4096);
+    thumbnailer->dir = g_build_filename(g_get_user_cache_dir(),
+                                        "mpv-mpris", "thumbnails", NULL);
+    thumbnailer->cache_max_bytes = MAX(get_script_opt_int(mpv, "thumbnail-cache-size",
+                                                          67108864), 0);
+    thumbnailer->cancellable = g_cancellable_new();
+    thumbnailer->handle = g_new0(ThumbnailerHandle, 1);
+    thumbnailer->handle->refcount = 1;
+    thumbnailer->handle->ud = ud;
+}
+
+static void thumbnailer_clear(Thumbnailer *thumbnailer)
+{
+    // Running jobs stop at their next check and find the handle detached,
+    // nothing waits for them
+    g_cancellable_cancel(thumbnailer->cancellable);
+    thumbnailer->handle->ud = NULL;
+    thumbnailer_handle_unref(thumbnailer->handle);
+    thumbnailer->handle = NULL;
+
+    thumbnail_reset(thumbnailer);
+    g_free(thumbnailer->dir);
+    g_object_unref(thumbnailer->cancellable);
+}
+
+// Clients of GetArt are told when the art of the current track changes
+static void set_current_art(UserData *ud, ArtBlob *blob)
+{
+    if (blob == ud->current_art) {
+        return;
+    }
+
+    if (blob) {
+        blob->refcount++;
+    }
+    art_blob_release(&ud->art_cache, ud->current_art);
+    ud->current_art = blob;
+    ud->art_generation++;
+
+    if (ud->ext_interface_id) {
+        emit_signal(ud, "io.mpv.Mpris", "ArtChanged",
+                    g_variant_new("(t)", ud->art_generation));
+    }
+}
+
+static void add_metadata_art(UserData *ud, GVariantDict *dict)
+{
+    ArtCacheEntry *entry;
+    char *path = read_property_string(ud, "path");
+
+    if (!path) {
+        set_current_art(ud, NULL);
+        return;
+    }
+
+    // mpv may call create_metadata multiple times and tracks are often
+    // revisited, so cache to save CPU and I/O
+    entry = art_cache_lookup(&ud->art_cache, &ud->art_policy, ud->mpv, path);
+    mpv_free(path);
+    set_current_art(ud, entry->blob);
+
+    if (entry->blob) {
+        g_variant_dict_insert(dict, "mpris:artUrl", "s", entry->blob->url);
+    } else if (entry->albumart_pending ||
+               (ud->thumbnailer.enabled && !entry->thumbnail_tried)) {
+        thumbnail_request(ud, entry);
+    }
+}
+
+static void add_metadata_content_created(UserData *ud, GVariantDict *dict)
+{
+    char *date_str = read_property_string(ud, "metadata/by-key/Date");
+
+    if (!date_str) {
+        return;
+    }
+
+    GDate* date = g_date_new();
+    if (strlen(date_str) == 4) {
+        gint64 year = g_ascii_strtoll(date_str, NULL, 10);
+        if (year != 0) {
+            g_date_set_dmy(date, 1, 1, year);
+        }
+    } else {
+        g_date_set_parse(date, date_str);
+    }
+
+    if (g_date_valid(date)) {
+        gchar iso8601[21];
+        g_date_strftime(iso8601, 21, "%Y-%m-%dT00:00:00Z", date);
+        g_variant_dict_insert(dict, "xesam:contentCreated", "s", iso8601);
+    }
+
+    g_date_free(date);
+    mpv_free(date_str);
+}
+
+static GVariant *create_metadata(UserData *ud)
+{
+    GVariantDict dict;
+    double duration;
+    char trackid[64];
+    int res;
+
+    g_variant_dict_init(&dict, NULL);
+
+    // mpris:trackid
+    // playlist_pos < 0 if there is no playlist or current track
+    if (ud->playlist_pos < 0) {
+        g_variant_dict_insert(&dict, "mpris:trackid", "o", NO_TRACK_ID);
+    } else {
+        g_snprintf(trackid, sizeof(trackid), "%s%" PRId64,
+                   TRACK_PATH_PREFIX, ud->playlist_pos);
+        g_variant_dict_insert(&dict, "mpris:trackid", "o", trackid);
+    }
+
+    // mpris:length
+    res = read_property(ud, "duration", MPV_FORMAT_DOUBLE, &duration);
+    if (res == MPV_ERROR_SUCCESS) {
+        g_variant_dict_insert(&dict, "mpris:length", "x", (int64_t)(duration * 1000000.0));
+    }
+
+    add_metadata_item_string(ud, &dict, "media-title", "xesam:title");
+    add_metadata_item_string(ud, &dict, "metadata/by-key/Album", "xesam:album");
+    add_metadata_item_string(ud, &dict, "metadata/by-key/Genre", "xesam:genre");
+
+    /* Musicbrainz metadata mappings
+       (https://picard-docs.musicbrainz.org/en/appendices/tag_mapping.html) */
+
+    // IDv3 metadata format
+    add_metadata_item_string(ud, &dict, "metadata/by-key/MusicBrainz Artist Id", "mb:artistId");
+    add_metadata_item_string(ud, &dict, "metadata/by-key/MusicBrainz Track Id", "mb:trackId");
+    add_metadata_item_string(ud, &dict, "metadata/by-key/MusicBrainz Album Artist Id", "mb:albumArtistId");
+    add_metadata_item_string(ud, &dict, "metadata/by-key/MusicBrainz Album Id", "mb:albumId");
+    add_metadata_item_string(ud, &dict, "metadata/by-key/MusicBrainz Release Track Id", "mb:releaseTrackId");
+    add_metadata_item_string(ud, &dict, "metadata/by-key/MusicBrainz Work Id", "mb:workId");
+
+    // Vorbis & APEv2 metadata format
+    add_metadata_item_string(ud, &dict, "metadata/by-key/MUSICBRAINZ_ARTISTID", "mb:artistId");
+    add_metadata_item_string(ud, &dict, "metadata/by-key/MUSICBRAINZ_TRACKID", "mb:trackId");
+    add_metadata_item_string(ud, &dict, "metadata/by-key/MUSICBRAINZ_ALBUMARTISTID", "mb:albumArtistId");
+    add_metadata_item_string(ud, &dict, "metadata/by-key/MUSICBRAINZ_ALBUMID", "mb:albumId");
+    add_metadata_item_string(ud, &dict, "metadata/by-key/MUSICBRAINZ_RELEASETRACKID", "mb:releaseTrackId");
+    add_metadata_item_string(ud, &dict, "metadata/by-key/MUSICBRAINZ_WORKID", "mb:workId");
+
+    add_metadata_item_string_list(ud, &dict, "metadata/by-key/uploader", "xesam:artist");
+    add_metadata_item_string_list(ud, &dict, "metadata/by-key/Artist", "xesam:artist");
+    add_metadata_item_string_list(ud, &dict, "metadata/by-key/Album_Artist", "xesam:albumArtist");
+    add_metadata_item_string_list(ud, &dict, "metadata/by-key/Composer", "xesam:composer");
+
+    add_metadata_item_int(ud, &dict, "metadata/by-key/Track", "xesam:trackNumber");
+    add_metadata_item_int(ud, &dict, "metadata/by-key/Disc", "xesam:discNumber");
+
+    add_metadata_uri(ud, &dict);
+    add_metadata_art(ud, &dict);
+    add_metadata_content_created(ud, &dict);
+
+    return g_variant_dict_end(&dict);
+}
+
+static GVariant *get_metadata(UserData *ud)
+{
+    if (!ud->metadata) {
+        ud->metadata = g_variant_ref_sink(create_metadata(ud));
+    }
+    return ud->metadata;
+}
+
+// In lazy mode clients are only told that Metadata changed, it is built on
+// the next Get so nothing is done for players that nobody is watching
+static void update_metadata(UserData *ud)
+{
+    g_clear_pointer(&ud->metadata, g_variant_unref);
+
+    if (ud->lazy_metadata) {
+        set_changed_property(ud, "Metadata", NULL);
+    } else {
+        set_changed_property(ud, "Metadata", g_variant_ref(get_metadata(ud)));
+    }
+}
+
+// Only used if mpv could not provide the cover it demuxed
+static ArtBlob *embedded_art_fallback(UserData *ud, char *path)
+{
+    const char *mime = NULL;
+    gint64 deadline = G_MAXINT64;
+    GBytes *data;
+
+    if (g_str_has_prefix(path, "http")) {
+        return NULL;
+    }
+
+    if (ud->art_policy.timeout_us > 0) {
+        deadline = g_get_monotonic_time() + ud->art_policy.timeout_us;
+    }
+
+    data = try_get_embedded_art(path, &mime, deadline, NULL);
+    return data ? art_blob_intern(&ud->art_cache, NULL, data, mime) : NULL;
+}
+
+// Takes the reference to blob
+static void thumbnail_finish(UserData *ud, const gchar *path, ArtBlob *blob,
+                             gboolean current)
+{
+    ArtCacheEntry *entry = g_hash_table_lookup(ud->art_cache.entries, path);
+    gboolean published = FALSE;
+
+    if (entry) {
+        entry->thumbnail_tried = TRUE;
+        entry->albumart_pending = FALSE;
+        if (blob && !entry->blob) {
+            entry->blob = blob;
+            blob = NULL;
+            published = TRUE;
+            art_cache_evict(&ud->art_cache);
+        }
+    }
+    art_blob_release(&ud->art_cache, blob);
+
+    if (!current) {
+        return;
+    }
+
+    ud->thumbnailer.state = THUMBNAIL_IDLE;
+    if (published) {
+        update_metadata(ud);
+    }
+}
+
+static void thumbnail_capture(UserData *ud)
+{
+    Thumbnailer *thumbnailer = &ud->thumbnailer;
+    const char *cmd[] = {"screenshot-raw", "video", NULL};
+
+    // Only one frame is requested at a time, the reply says which file it
+    // was for by its generation
+    if (thumbnailer->state != THUMBNAIL_WAIT_FRAME || !thumbnailer->frame_shown ||
+        thumbnailer->capture_in_flight) {
+        return;
+    }
+
+    thumbnailer->state = THUMBNAIL_CAPTURE;
+    thumbnailer->capture_in_flight = TRUE;
+    thumbnailer->capture_generation = thumbnailer->generation;
+    thumbnailer->attempts++;
+    mpv_command_async(ud->mpv, REPLY_THUMBNAIL, cmd);
+}
+
+static gboolean thumbnail_retry(gpointer data)
+{
+    UserData *ud = data;
+
+    g_clear_pointer(&ud->thumbnailer.retry, g_source_unref);
+    thumbnail_capture(ud);
+    return G_SOURCE_REMOVE;
+}
+
+static void thumbnail_job_done(G_GNUC_UNUSED GObject *source, GAsyncResult *res,
+                               G_GNUC_UNUSED gpointer data)
+{
+    ThumbnailJob *job = g_task_get_task_data(G_TASK(res));
+    UserData *ud = job->handle->ud;
+    Thumbnailer *thumbnailer;
+    gboolean current;
+    GError *error = NULL;
+    gboolean ready = g_task_propagate_boolean(G_TASK(res), &error);
+
+    if (!ud || g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+        g_clear_error(&error);
+        return;
+    }
+
+    thumbnailer = &ud->thumbnailer;
+    current = job->generation == thumbnailer->generation;
+    if (ready && job->albumart) {
+        thumbnail_finish(ud, job->path,
+                         art_blob_intern(&ud->art_cache, NULL,
+                                         g_bytes_ref(job->png), "image/png"),
+                         current);
+    } else if (ready) {
+        thumbnail_finish(ud, job->path,
+                         art_blob_intern(&ud->art_cache,
+                                         g_filename_to_uri(job->cache_file, NULL, NULL),
+                                         NULL, NULL),
+                         current);
+    } else if (error) {
+        g_printerr("Failed to create thumbnail for %s: %s\n",
+                   job->path, error->message);
+        g_error_free(error);
+        if (!job->albumart) {
+            thumbnail_finish(ud, job->path, NULL, current);
+        } else if (current) {
+            thumbnail_finish(ud, job->path,
+                             embedded_art_fallback(ud, job->path), current);
+        }
+    } else if (!current) {
+        return;
+    } else if (!job->frame) {
+        // Not cached yet, wait for a frame
+        thumbnailer->cache_file = g_strdup(job->cache_file);
+        thumbnailer->state = THUMBNAIL_WAIT_FRAME;
+        thumbnail_capture(ud);
+    } else {
+        // Frame was too dark, try again a bit later
+        thumbnailer->state = THUMBNAIL_WAIT_FRAME;
+        thumbnailer->retry = g_timeout_source_new(THUMBNAIL_RETRY_MS);
+        g_source_set_callback(thumbnailer->retry, thumbnail_retry, ud, NULL);
+        g_source_attach(thumbnailer->retry, ud->ctx);
+    }
+}
+
+static GBytes *frame_from_node(mpv_node *node, int *width, int *height, int *stride)
+{
+    mpv_byte_array *data = NULL;
+    const char *format = NULL;
+    int64_t w = 0;
+    int64_t h = 0;
+    int64_t s = 0;
+
+    if (node->format != MPV_FORMAT_NODE_MAP) {
+        return NULL;
+    }
+
+    for (int i = 0; i < node->u.list->num; i++) {
+        const char *key = node->u.list->keys[i];
+        mpv_node *value = &node->u.list->values[i];
+
+        if (value->format == MPV_FORMAT_INT64) {
+            if (g_strcmp0(key, "w") == 0) {
+                w = value->u.int64;
+            } else if (g_strcmp0(key, "h") == 0) {
+                h = value->u.int64;
+            } else if (g_strcmp0(key, "stride") == 0) {
+                s = value->u.int64;
+            }
+        } else if (value->format == MPV_FORMAT_STRING && g_strcmp0(key, "format") == 0) {
+            format = value->u.string;
+        } else if (value->format == MPV_FORMAT_BYTE_ARRAY && g_strcmp0(key, "data") == 0) {
+            data = value->u.ba;
+        }
+    }
+
+    // bgr0 is the default format of screenshot-raw
+    if (!data || g_strcmp0(format, "bgr0") != 0 || w <= 0 || h <= 0 ||
+        w > G_MAXINT / 4 || h > G_MAXINT || s < w * 4 || s > G_MAXINT ||
+        data->size < (size_t)(s * (h - 1) + w * 4)) {
+        return NULL;
+    }
+
+    *width = w;
+    *height = h;
+    *stride = s;
+    return g_bytes_new(data->data, data->size);
+}
+
+static void handle_thumbnail_frame(mpv_event *event, UserData *ud)
+{
+    Thumbnailer *thumbnailer = &ud->thumbnailer;
+    mpv_event_command *reply = event->data;
+    GBytes *frame = NULL;
+    int width;
+    int height;
+    int stride;
+
+    thumbnailer->capture_in_flight = FALSE;
+
+    if (thumbnailer->capture_generation != thumbnailer->generation ||
+        thumbnailer->state != THUMBNAIL_CAPTURE) {
+        // The frame belongs to a previous file, the current one may be
+        // waiting for its own
+        thumbnail_capture(ud);
+        return;
+    }
+
+    if (event->error >= 0) {
+        frame = frame_from_node(&reply->result, &width, &height, &stride);
+    }
+    if (!frame) {
+        thumbnail_finish(ud, thumbnailer->path,
+                         thumbnailer->albumart ?
+                         embedded_art_fallback(ud, thumbnailer->path) : NULL,
+                         TRUE);
+        return;
+    }
+
+    thumbnailer->state = THUMBNAIL_ENCODE;
+    thumbnail_start_job(ud, frame, width, height, stride);
+}
+
+static void method_call_root(G_GNUC_UNUSED GDBusConnection *connection,
+                             G_GNUC_UNUSED const char *sender,
+                             G_GNUC_UNUSED const char *object_path,
+                             const char *interface_name,
+                             const char *method_name,
+                             GVariant *parameters,
+                             GDBusMethodInvocation *invocation,
+                             gpointer user_data)
+{
+    UserData *ud = (UserData*)user_data;
+    trace_dbus(ud, 'c', interface_name, method_name, parameters);
+    if (g_strcmp0(method_name, "Quit") == 0) {
+        const char *cmd[] = {"quit", NULL};
+        mpv_command_async(ud->mpv, 0, cmd);
+        g_dbus_method_invocation_return_value(invocation, NULL);
+
+    } else if (g_strcmp0(method_name, "Raise") == 0) {
+        // Can't raise
+        g_dbus_method_invocation_return_value(invocation, NULL);
+
+    } else {
+        g_dbus_method_invocation_return_error(invocation, G_DBUS_ERROR,
+                                              G_DBUS_ERROR_UNKNOWN_METHOD,
+                                              "Unknown method");
+    }
+}
+
+static GVariant *get_property_root(G_GNUC_UNUSED GDBusConnection *connection,
+                                   G_GNUC_UNUSED const char *sender,
+                                   G_GNUC_UNUSED const char *object_path,
+                                   const char *interface_name,
+                                   const char *property_name,
+                                   G_GNUC_UNUSED GError **error,
+                                   gpointer user_data)
+{
+    UserData *ud = (UserData*)user_data;
+    GVariant *ret;
+
+    trace_dbus(ud, 'g', interface_name, property_name, NULL);
+
+    if (g_strcmp0(property_name, "CanQuit") == 0) {
+        ret = variant_boolean(TRUE);
+
+    } else if (g_strcmp0(property_name, "Fullscreen") == 0) {
+        int fullscreen = 0;
+        read_property(ud, "fullscreen", MPV_FORMAT_FLAG, &fullscreen);
+        ret = g_variant_new_boolean(fullscreen);
+
+    } else if (g_strcmp0(property_name, "CanSetFullscreen") == 0) {
+        int can_fullscreen = 0;
+        read_property(ud, "vo-configured", MPV_FORMAT_FLAG, &can_fullscreen);
+        ret = g_variant_new_boolean(can_fullscreen);
+
+    } else if (g_strcmp0(property_name, "CanRaise") == 0) {
+        ret = g_variant_new_boolean(FALSE);
+
+    } else if (g_strcmp0(property_name, "HasTrackList") == 0) {
+        ret = g_variant_new_boolean(FALSE);
+
+    } else if (g_strcmp0(property_name, "Identity") == 0) {
+        char *client_name = read_property_string(ud, "audio-client-name");
+        ret = g_variant_new_string(client_name);
+        mpv_free(client_name);
+
+    } else if (g_strcmp0(property_name, "DesktopEntry") == 0) {
+        ret = g_variant_new_string("mpv");
+
+    } else if (g_strcmp0(property_name, "SupportedUriSchemes") == 0) {
+        GVariantBuilder builder;
+        g_variant_builder_init(&builder, G_VARIANT_TYPE("as"));
+        g_variant_builder_add(&builder, "s", "ftp");
+        g_variant_builder_add(&builder, "s", "http");
+        g_variant_builder_add(&builder, "s", "https");
+        g_variant_builder_add(&builder, "s", "mms");
+        g_variant_builder_add(&builder, "s", "rtmp");
+        g_variant_builder_add(&builder, "s", "rtsp");
+        g_variant_builder_add(&builder, "s", "sftp");
+        g_variant_builder_add(&builder, "s", "smb");
+        ret = g_variant_builder_end(&builder);
+
+    } else if (g_strcmp0(property_name, "SupportedMimeTypes") == 0) {
+        GVariantBuilder builder;
+        g_variant_builder_init(&builder, G_VARIANT_TYPE("as"));
+        g_variant_builder_add(&builder, "s", "application/ogg");
+        g_variant_builder_add(&builder, "s", "audio/mpeg");
+        // TODO add the rest
+        ret = g_variant_builder_end(&builder);
+
+    } else {
+        ret = NULL;
+        g_set_error(error, G_DBUS_ERROR,
+                    G_DBUS_ERROR_UNKNOWN_PROPERTY,
+                    "Unknown property %s", property_name);
+    }
+
+    return ret;
+}
+
+static gboolean set_property_root(G_GNUC_UNUSED GDBusConnection *connection,
+                                  G_GNUC_UNUSED const char *sender,
+                                  G_GNUC_UNUSED const char *object_path,
+                                  const char *interface_name,
+                                  const char *property_name,
+                                  GVariant *value,
+                                  G_GNUC_UNUSED GError **error,
+                                  gpointer user_data)
+{
+    UserData *ud = (UserData*)user_data;
+    trace_dbus(ud, 's', interface_name, property_name, value);
+    if (g_strcmp0(property_name, "Fullscreen") == 0) {
+        int fullscreen;
+        g_variant_get(value, "b", &fullscreen);
+        mpv_set_property(ud->mpv, "fullscreen", MPV_FORMAT_FLAG, &fullscreen);
+
+    } else {
+        g_set_error(error, G_DBUS_ERROR,
+                    G_DBUS_ERROR_UNKNOWN_PROPERTY,
+                    "Cannot set property %s", property_name);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static GDBusInterfaceVTable vtable_root = {
+    method_call_root, get_property_root, set_property_root, {0}
+};
+
+static void send_pending_seek(UserData *ud, gboolean burst)
+{
+    char target_str[G_ASCII_DTOSTR_BUF_SIZE];
+    double target_s = ud->pending_seek_us / 1000000.0;
+    gboolean exact = ud->seek_burst_flag == SEEK_EXACT;
+    const char *flags;
+
+    if (ud->has_pending_position) {
+        target_s += ud->pending_position_s;
+        if (burst) {
+            flags = exact ? "absolute+exact" : "absolute+keyframes";
+        } else {
+            flags = "absolute";
+        }
+    } else {
+        if (burst) {
+            flags = exact ? "relative+exact" : "relative+keyframes";
+        } else {
+            flags = "relative";
+        }
+    }
+
+    g_ascii_dtostr(target_str, G_ASCII_DTOSTR_BUF_SIZE, target_s);
+    const char *cmd[] = {"seek", target_str, flags, NULL};
+    mpv_command_async(ud->mpv, REPLY_SEEK, cmd);
+
+    ud->seeks_in_flight++;
+    ud->seeked_deferred = FALSE;
+    ud->pending_seek_us = 0;
+    ud->has_pending_position = FALSE;
+    ud->seek_burst = 0;
+}
+
+// Reported once mpv restarted playback after the last seek that was sent
+static void seek_done(UserData *ud)
+{
+    if (ud->seeks_in_flight > 0) {
+        return;
+    }
+
+    if (ud->seek_window) {
+        ud->seeked_deferred = TRUE;
+    } else {
+        emit_seeked_signal(ud);
+    }
+}
+
+static void handle_seek_reply(mpv_event *event, UserData *ud)
+{
+    if (ud->seeks_in_flight > 0) {
+        ud->seeks_in_flight--;
+    }
+
+    // No restart follows a seek that failed, but one before it may have
+    // been dropped for it
+    if (event->error < 0) {
+        seek_done(ud);
+    }
+}
+
+static gboolean seek_window_elapsed(gpointer data)
+{
+    UserData *ud = (UserData*)data;
+
+    if (ud->seek_burst > 0) {
+        // Still receiving seeks, send what was merged and keep the window open
+        send_pending_seek(ud, TRUE);
+        return G_SOURCE_CONTINUE;
+    }
+
+    g_clear_pointer(&ud->seek_window, g_source_unref);
+    if (ud->seeked_deferred) {
+        emit_seeked_signal(ud);
+        ud->seeked_deferred = FALSE;
+    }
+    return G_SOURCE_REMOVE;
+}
+
+// For seeks sent right away, merged seeks and the Seeked signal of earlier
+// ones are superseded by them
+static void cancel_seek_window(UserData *ud)
+{
+    if (ud->seek_window) {
+        g_source_destroy(ud->seek_window);
+        g_clear_pointer(&ud->seek_window, g_source_unref);
+    }
+    ud->pending_seek_us = 0;
+    ud->has_pending_position = FALSE;
+    ud->seek_burst = 0;
+    ud->seeked_deferred = FALSE;
+}
+
+// The first seek is sent immediately, further seeks arriving within the
+// window are merged into one which is sent when the window closes
+static void queue_seek(UserData *ud)
+{
+    if (ud->seek_window) {
+        ud->seek_burst++;
+        return;
+    }
+
+    send_pending_seek(ud, FALSE);
+
+    if (ud->seek_window_ms == 0) {
+        return;
+    }
+
+    ud->seek_window = g_timeout_source_new(ud->seek_window_ms);
+    g_source_set_callback(ud->seek_window, seek_window_elapsed, ud, NULL);
+    g_source_attach(ud->seek_window, ud->ctx);
+}
+
+static void method_call_player(G_GNUC_UNUSED GDBusConnection *connection,
+                               G_GNUC_UNUSED const char *sender,
+                               G_GNUC_UNUSED const char *_object_path,
+                               const char *interface_name,
+                               const char *method_name,
+                               GVariant *parameters,
+                               GDBusMethodInvocation *invocation,
+                               gpointer user_data)
 {
     UserData *ud = (UserData*)user_data;
+    trace_dbus(ud, 'c', interface_name, method_name, parameters);
+    if (g_strcmp0(method_name, "Pause") == 0) {
+        int paused = TRUE;
+        mpv_set_property(ud->mpv, "pause", MPV_FORMAT_FLAG, &paused);
+        g_dbus_method_invocation_return_value(invocation, NULL);
+
+    } else if (g_strcmp0(method_name, "PlayPause") == 0) {
+        const char *cmd[] = {"cycle", "pause", NULL};
+        mpv_command_async(ud->mpv, 0, cmd);
+        g_dbus_method_invocation_return_value(invocation, NULL);
+
+    } else if (g_strcmp0(method_name, "Play") == 0) {
+        int paused = FALSE;
+        mpv_set_property(ud->mpv, "pause", MPV_FORMAT_FLAG, &paused);
+        g_dbus_method_invocation_return_value(invocation, NULL);
+
+    } else if (g_strcmp0(method_name, "Stop") == 0) {
+        const char *cmd[] = {"stop", NULL};
+        mpv_command_async(ud->mpv, 0, cmd);
+        g_dbus_method_invocation_return_value(invocation, NULL);
+
+    } else if (g_strcmp0(method_name, "Next") == 0) {
+        const char *cmd[] = {"playlist_next", NULL};
+        mpv_command_async(ud->mpv, 0, cmd);
+        g_dbus_method_invocation_return_value(invocation, NULL);
+
+    } else if (g_strcmp0(method_name, "Previous") == 0) {
+        const char *cmd[] = {"playlist_prev", NULL};
+        mpv_command_async(ud->mpv, 0, cmd);
+        g_dbus_method_invocation_return_value(invocation, NULL);
+
+    } else if (g_strcmp0(method_name, "Seek") == 0) {
+        int64_t offset_us; // in microseconds
+        g_variant_get(parameters, "(x)", &offset_us);
+
+        ud->pending_seek_us += offset_us;
+        queue_seek(ud);
+        g_dbus_method_invocation_return_value(invocation, NULL);
+
+    } else if (g_strcmp0(method_name, "SetPosition") == 0) {
+        char *object_path;
+        double new_position_s;
+        int64_t new_position_us;
+
+        g_variant_get(parameters, "(&ox)", &object_path, &new_position_us);
+        new_position_s = ((double)new_position_us) / 1000000.0; // us -> s
+
+        if (g_str_has_prefix(object_path, TRACK_PATH_PREFIX) &&
+            ud->playlist_pos == g_ascii_strtoll(object_path + strlen(TRACK_PATH_PREFIX),
+                                                NULL, 10)) {
+            // Supersedes any seeks that have not been sent yet
+            ud->pending_seek_us = 0;
+            ud->has_pending_position = TRUE;
+            ud->pending_position_s = new_position_s;
+            queue_seek(ud);
+        }
+
+        g_dbus_method_invocation_return_value(invocation, NULL);
+
+    } else if (g_strcmp0(method_name, "OpenUri") == 0) {
+        char *uri;
+        g_variant_get(parameters, "(&s)", &uri);
+        // Appending lets mpv prefetch the file while the current one plays
+        const char *cmd[] = {"loadfile", uri,
+                             ud->open_uri_append ? "append-play" : "replace", NULL};
+        mpv_command_async(ud->mpv, 0, cmd);
+        g_dbus_method_invocation_return_value(invocation, NULL);
+
+    } else {
+        g_dbus_method_invocation_return_error(invocation, G_DBUS_ERROR,
+                                              G_DBUS_ERROR_UNKNOWN_METHOD,
+                                              "Unknown method");
+    }
+}
+
+static GVariant *player_property(UserData *ud, const char *property_name, GError **error)
+{
     GVariant *ret;
 
-    if (g_strcmp0(property_name, "CanQuit") == 0) {
-        ret = g_variant_new_boolean(TRUE);
+    if (g_strcmp0(property_name, "PlaybackStatus") == 0) {
+        ret = variant_constant_string(ud->status);
+
+    } else if (g_strcmp0(property_name, "LoopStatus") == 0) {
+        ret = variant_constant_string(ud->loop_status);
+
+    } else if (g_strcmp0(property_name, "Rate") == 0) {
+        ret = g_variant_new_double(ud->rate);
+
+    } else if (g_strcmp0(property_name, "Shuffle") == 0) {
+        ret = variant_boolean(ud->shuffle);
+
+    } else if (g_strcmp0(property_name, "Metadata") == 0) {
+        // Increase reference count to prevent it from being freed after returning
+        ret = g_variant_ref(get_metadata(ud));
+
+    } else if (g_strcmp0(property_name, "Volume") == 0) {
+        ret = g_variant_new_double(ud->volume);
+
+    } else if (g_strcmp0(property_name, "Position") == 0) {
+        double position_s = 0;
+        int64_t position_us;
+        read_property(ud, "time-pos", MPV_FORMAT_DOUBLE, &position_s);
+        position_us = position_s * 1000000.0; // s -> us
+        ret = g_variant_new_int64(position_us);
 
-    } else if (g_strcmp0(property_name, "Fullscreen") == 0) {
-        int fullscreen = 0;
-        mpv_get_property(ud->mpv, "fullscreen", MPV_FORMAT_FLAG, &fullscreen);
-        ret = g_variant_new_boolean(fullscreen);
+    } else if (g_strcmp0(property_name, "MinimumRate") == 0) {
+        ret = g_variant_new_double(0.01);
 
-    } else if (g_strcmp0(property_name, "CanSetFullscreen") == 0) {
-        int can_fullscreen = 0;
-        mpv_get_property(ud->mpv, "vo-configured", MPV_FORMAT_FLAG, &can_fullscreen);
-        ret = g_variant_new_boolean(can_fullscreen);
+    } else if (g_strcmp0(property_name, "MaximumRate") == 0) {
+        ret = g_variant_new_double(100);
 
-    } else if (g_strcmp0(property_name, "CanRaise") == 0) {
-        ret = g_variant_new_boolean(FALSE);
+    } else if (g_strcmp0(property_name, "CanGoNext") == 0) {
+        ret = variant_boolean(can_go_next(ud));
 
-    } else if (g_strcmp0(property_name, "HasTrackList") == 0) {
-        ret = g_variant_new_boolean(FALSE);
+    } else if (g_strcmp0(property_name, "CanGoPrevious") == 0) {
+        ret = variant_boolean(can_go_previous(ud));
 
-    } else if (g_strcmp0(property_name, "Identity") == 0) {
-        char *client_name = mpv_get_property_string(ud->mpv, "audio-client-name");
-        ret = g_variant_new_string(client_name);
-        mpv_free(client_name);
+    } else if (g_strcmp0(property_name, "CanPlay") == 0) {
+        ret = variant_boolean(can_play_pause(ud));
 
-    } else if (g_strcmp0(property_name, "DesktopEntry") == 0) {
-        ret = g_variant_new_string("mpv");
+    } else if (g_strcmp0(property_name, "CanPause") == 0) {
+        ret = variant_boolean(can_play_pause(ud));
 
-    } else if (g_strcmp0(property_name, "SupportedUriSchemes") == 0) {
-        GVariantBuilder builder;
-        g_variant_builder_init(&builder, G_VARIANT_TYPE("as"));
-        g_variant_builder_add(&builder, "s", "ftp");
-        g_variant_builder_add(&builder, "s", "http");
-        g_variant_builder_add(&builder, "s", "https");
-        g_variant_builder_add(&builder, "s", "mms");
-        g_variant_builder_add(&builder, "s", "rtmp");
-        g_variant_builder_add(&builder, "s", "rtsp");
-        g_variant_builder_add(&builder, "s", "sftp");
-        g_variant_builder_add(&builder, "s", "smb");
-        ret = g_variant_builder_end(&builder);
+    } else if (g_strcmp0(property_name, "CanSeek") == 0) {
+        ret = variant_boolean(TRUE);
 
-    } else if (g_strcmp0(property_name, "SupportedMimeTypes") == 0) {
-        GVariantBuilder builder;
-        g_variant_builder_init(&builder, G_VARIANT_TYPE("as"));
-        g_variant_builder_add(&builder, "s", "application/ogg");
-        g_variant_builder_add(&builder, "s", "audio/mpeg");
-        // TODO add the rest
-        ret = g_variant_builder_end(&builder);
+    } else if (g_strcmp0(property_name, "CanControl") == 0) {
+        ret = variant_boolean(TRUE);
 
     } else {
         ret = NULL;
@@ -583,20 +2601,112 @@ static GVariant *get_property_root(G_GNUC_UNUSED GDBusConnection *connection,
     return ret;
 }
 
-static gboolean set_property_root(G_GNUC_UNUSED GDBusConnection *connection,
-                                  G_GNUC_UNUSED const char *sender,
-                                  G_GNUC_UNUSED const char *object_path,
-                                  G_GNUC_UNUSED const char *interface_name,
-                                  const char *property_name,
-                                  GVariant *value,
-                                  G_GNUC_UNUSED GError **error,
-                                  gpointer user_data)
+static GVariant *get_property_player(G_GNUC_UNUSED GDBusConnection *connection,
+                                     G_GNUC_UNUSED const char *sender,
+                                     G_GNUC_UNUSED const char *object_path,
+                                     const char *interface_name,
+                                     const char *property_name,
+                                     GError **error,
+                                     gpointer user_data)
 {
     UserData *ud = (UserData*)user_data;
-    if (g_strcmp0(property_name, "Fullscreen") == 0) {
-        int fullscreen;
-        g_variant_get(value, "b", &fullscreen);
-        mpv_set_property(ud->mpv, "fullscreen", MPV_FORMAT_FLAG, &fullscreen);
+    GVariant *value;
+
+    trace_dbus(ud, 'g', interface_name, property_name, NULL);
+    value = player_property(ud, property_name, error);
+    if (value) {
+        update_read_snapshot(ud, property_name, g_variant_take_ref(value));
+    }
+    return value;
+}
+
+static void send_property_write(PropertyWrite *write)
+{
+    mpv_set_property_async(write->ud->mpv, write->reply_id, write->name,
+                           MPV_FORMAT_DOUBLE, &write->value);
+    write->pending = FALSE;
+}
+
+static gboolean write_window_elapsed(gpointer data)
+{
+    PropertyWrite *write = data;
+
+    if (write->pending) {
+        send_property_write(write);
+        return G_SOURCE_CONTINUE;
+    }
+
+    write->window_open = FALSE;
+    return G_SOURCE_REMOVE;
+}
+
+static void queue_property_write(PropertyWrite *write, double value)
+{
+    GSource *source;
+
+    write->value = value;
+    write->pending = TRUE;
+
+    if (write->window_open) {
+        return;
+    }
+
+    send_property_write(write);
+
+    if (write->ud->write_interval_ms == 0) {
+        return;
+    }
+
+    source = g_timeout_source_new(write->ud->write_interval_ms);
+    g_source_set_callback(source, write_window_elapsed, write, NULL);
+    g_source_attach(source, write->ud->ctx);
+    g_source_unref(source);
+    write->window_open = TRUE;
+}
+
+static gboolean set_property_player(G_GNUC_UNUSED GDBusConnection *connection,
+                                    G_GNUC_UNUSED const char *sender,
+                                    G_GNUC_UNUSED const char *object_path,
+                                    const char *interface_name,
+                                    const char *property_name,
+                                    GVariant *value,
+                                    G_GNUC_UNUSED GError **error,
+                                    gpointer user_data)
+{
+    UserData *ud = (UserData*)user_data;
+    trace_dbus(ud, 's', interface_name, property_name, value);
+    if (g_strcmp0(property_name, "LoopStatus") == 0) {
+        const char *status;
+        int t = TRUE;
+        int f = FALSE;
+        status = g_variant_get_string(value, NULL);
+        if (g_strcmp0(status, "Track") == 0) {
+            mpv_set_property(ud->mpv, "loop-file", MPV_FORMAT_FLAG, &t);
+            mpv_set_property(ud->mpv, "loop-playlist", MPV_FORMAT_FLAG, &f);
+        } else if (g_strcmp0(status, "Playlist") == 0) {
+            mpv_set_property(ud->mpv, "loop-file", MPV_FORMAT_FLAG, &f);
+            mpv_set_property(ud->mpv, "loop-playlist", MPV_FORMAT_FLAG, &t);
+        } else {
+            mpv_set_property(ud->mpv, "loop-file", MPV_FORMAT_FLAG, &f);
+            mpv_set_property(ud->mpv, "loop-playlist", MPV_FORMAT_FLAG, &f);
+        }
+
+    } else if (g_strcmp0(property_name, "Rate") == 0) {
+        queue_property_write(&ud->rate_write, g_variant_get_double(value));
+
+    } else if (g_strcmp0(property_name, "Shuffle") == 0) {
+        int shuffle = g_variant_get_boolean(value);
+        if (shuffle && !ud->shuffle) {
+            const char *cmd[] = {"playlist-shuffle", NULL};
+            mpv_command_async(ud->mpv, 0, cmd);
+        } else if (!shuffle && ud->shuffle) {
+            const char *cmd[] = {"playlist-unshuffle", NULL};
+            mpv_command_async(ud->mpv, 0, cmd);
+        }
+        mpv_set_property(ud->mpv, "shuffle", MPV_FORMAT_FLAG, &shuffle);
+
+    } else if (g_strcmp0(property_name, "Volume") == 0) {
+        queue_property_write(&ud->volume_write, g_variant_get_double(value) * 100);
 
     } else {
         g_set_error(error, G_DBUS_ERROR,
@@ -604,86 +2714,410 @@ static gboolean set_property_root(G_GNUC_UNUSED GDBusConnection *connection,
                     "Cannot set property %s", property_name);
         return FALSE;
     }
+
     return TRUE;
 }
 
-static GDBusInterfaceVTable vtable_root = {
-    method_call_root, get_property_root, set_property_root, {0}
+static GDBusInterfaceVTable vtable_player = {
+    method_call_player, get_property_player, set_property_player, {0}
 };
 
-static void method_call_player(G_GNUC_UNUSED GDBusConnection *connection,
-                               G_GNUC_UNUSED const char *sender,
-                               G_GNUC_UNUSED const char *_object_path,
-                               G_GNUC_UNUSED const char *interface_name,
-                               const char *method_name,
-                               G_GNUC_UNUSED GVariant *parameters,
-                               GDBusMethodInvocation *invocation,
-                               gpointer user_data)
+static GVariant *get_stats(UserData *ud)
 {
-    UserData *ud = (UserData*)user_data;
-    if (g_strcmp0(method_name, "Pause") == 0) {
-        int paused = TRUE;
-        mpv_set_property(ud->mpv, "pause", MPV_FORMAT_FLAG, &paused);
-        g_dbus_method_invocation_return_value(invocation, NULL);
+    GVariantDict dict;
+    g_variant_dict_init(&dict, NULL);
 
-    } else if (g_strcmp0(method_name, "PlayPause") == 0) {
-        const char *cmd[] = {"cycle", "pause", NULL};
-        mpv_command_async(ud->mpv, 0, cmd);
-        g_dbus_method_invocation_return_value(invocation, NULL);
+    g_variant_dict_insert(&dict, "changed-properties", "u",
+                          ud->changed_properties->len);
+    g_variant_dict_insert(&dict, "art-cache-entries", "u",
+                          g_hash_table_size(ud->art_cache.entries));
+    g_variant_dict_insert(&dict, "art-cache-blobs", "u",
+                          g_hash_table_size(ud->art_cache.blobs));
+    g_variant_dict_insert(&dict, "art-cache-size", "t", (guint64)ud->art_cache.size);
+    g_variant_dict_insert(&dict, "art-cache-budget", "t", (guint64)ud->art_cache.budget);
+    g_variant_dict_insert(&dict, "art-cache-hits", "t", ud->art_cache.hits);
+    g_variant_dict_insert(&dict, "art-cache-misses", "t", ud->art_cache.misses);
+    g_variant_dict_insert(&dict, "signal-queue-size", "t", (guint64)ud->signal_queue_bytes);
+    g_variant_dict_insert(&dict, "signal-queue-count", "u", ud->signal_queue_count);
+    g_variant_dict_insert(&dict, "signals-coalesced", "t", ud->signals_coalesced);
+    g_variant_dict_insert(&dict, "events-handled", "t", ud->events_handled);
+    g_variant_dict_insert(&dict, "event-batches", "t", ud->event_batches);
+    g_variant_dict_insert(&dict, "event-batch-max", "u", ud->event_batch_max);
+    g_variant_dict_insert(&dict, "bus-reconnects", "t", ud->reconnects);
+    g_variant_dict_insert(&dict, "heartbeat-running", "b", ud->heartbeat != NULL);
+    g_variant_dict_insert(&dict, "writes-held", "u",
+                          ud->volume_write.pending + ud->rate_write.pending);
+    g_mutex_lock(&ud->read_buckets_lock);
+    g_variant_dict_insert(&dict, "reads-throttled", "t", ud->reads_throttled);
+    g_mutex_unlock(&ud->read_buckets_lock);
 
-    } else if (g_strcmp0(method_name, "Play") == 0) {
-        int paused = FALSE;
-        mpv_set_property(ud->mpv, "pause", MPV_FORMAT_FLAG, &paused);
-        g_dbus_method_invocation_return_value(invocation, NULL);
+    return g_variant_dict_end(&dict);
+}
 
-    } else if (g_strcmp0(method_name, "Stop") == 0) {
+static void get_art(UserData *ud, GDBusMethodInvocation *invocation)
+{
+    ArtBlob *blob;
+    gchar *filename = NULL;
+    gchar *mime = NULL;
+    GUnixFDList *fd_list;
+    struct stat buf;
+    int fd = -1;
+
+    // The current art is only looked up along with the metadata
+    get_metadata(ud);
+    blob = ud->current_art;
+
+    if (blob && blob->memfd >= 0) {
+        // Reopen rather than dup so that each client gets its own read-only
+        // file description and offset
+        gchar *fd_path = g_strdup_printf("/proc/self/fd/%d", blob->memfd);
+        fd = open(fd_path, O_RDONLY | O_CLOEXEC);
+        mime = g_strdup(blob->mime);
+        g_free(fd_path);
+    } else if (blob && (filename = g_filename_from_uri(blob->url, NULL, NULL))) {
+        gchar *content_type = g_content_type_guess(filename, NULL, 0, NULL);
+        fd = open(filename, O_RDONLY | O_CLOEXEC);
+        mime = g_content_type_get_mime_type(content_type);
+        g_free(content_type);
+        g_free(filename);
+    }
+
+    if (fd < 0 || fstat(fd, &buf) != 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        g_free(mime);
+        g_dbus_method_invocation_return_error(invocation, G_DBUS_ERROR,
+                                              G_DBUS_ERROR_FILE_NOT_FOUND,
+                                              "No local art for the current track");
+        return;
+    }
+
+    fd_list = g_unix_fd_list_new_from_array(&fd, 1);
+    g_dbus_method_invocation_return_value_with_unix_fd_list(
+        invocation,
+        g_variant_new("(hstt)", 0, mime ? mime : "application/octet-stream",
+                      (guint64)buf.st_size, ud->art_generation),
+        fd_list);
+    g_object_unref(fd_list);
+    g_free(mime);
+}
+
+static void batch_free(Batch *batch)
+{
+    for (guint i = 0; i < batch->count; i++) {
+        if (batch->results[i]) {
+            g_variant_unref(batch->results[i]);
+        }
+    }
+    g_free(batch->results);
+    g_free(batch->merged);
+    g_free(batch);
+}
+
+static void batch_finish(Batch *batch)
+{
+    GVariantBuilder results;
+
+    if (batch->waiting > 0) {
+        return;
+    }
+
+    g_variant_builder_init(&results, G_VARIANT_TYPE("a(bs)"));
+    for (guint i = 0; i < batch->count; i++) {
+        g_variant_builder_add_value(&results, batch->results[i]);
+    }
+    g_dbus_method_invocation_return_value(batch->invocation,
+                                          g_variant_new("(a(bs))", &results));
+    batch_free(batch);
+}
+
+static void batch_set_result(Batch *batch, guint index, gboolean ok, const char *message)
+{
+    // Operations merged into this one's command share its result
+    do {
+        batch->results[index] = g_variant_ref_sink(g_variant_new("(bs)", ok, message));
+        batch->waiting--;
+        index++;
+    } while (index < batch->count && batch->merged[index]);
+
+    batch_finish(batch);
+}
+
+static void enqueue(UserData *ud, GVariant *parameters, GDBusMethodInvocation *invocation)
+{
+    const char *uri;
+    uint64_t *reply = g_new(uint64_t, 1);
+    int err;
+
+    g_variant_get(parameters, "(&s)", &uri);
+    *reply = ud->next_batch_reply++;
+    const char *cmd[] = {"loadfile", uri, "append-play", NULL};
+    err = mpv_command_async(ud->mpv, *reply, cmd);
+    if (err < 0) {
+        g_dbus_method_invocation_return_error(invocation, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+                                              "%s", mpv_error_string(err));
+        g_free(reply);
+        return;
+    }
+
+    g_hash_table_insert(ud->enqueues, reply, invocation);
+}
+
+// mpv has appended the entry, so it is the last one unless something else
+// changed the playlist in the meantime
+static void handle_enqueue_reply(mpv_event *event, GDBusMethodInvocation *invocation,
+                                 UserData *ud)
+{
+    int64_t count = 0;
+    gchar *track_id;
+
+    if (event->error < 0) {
+        g_dbus_method_invocation_return_error(invocation, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+                                              "%s", mpv_error_string(event->error));
+        return;
+    }
+
+    read_property(ud, "playlist-count", MPV_FORMAT_INT64, &count);
+    track_id = g_strdup_printf("%s%" PRId64, TRACK_PATH_PREFIX, count - 1);
+    g_dbus_method_invocation_return_value(invocation, g_variant_new("(o)", track_id));
+    g_free(track_id);
+}
+
+static void handle_batch_reply(mpv_event *event, UserData *ud)
+{
+    Batch *batch = g_hash_table_lookup(ud->batches, &event->reply_userdata);
+    GDBusMethodInvocation *invocation;
+
+    if (!batch) {
+        invocation = g_hash_table_lookup(ud->enqueues, &event->reply_userdata);
+        if (invocation) {
+            g_hash_table_remove(ud->enqueues, &event->reply_userdata);
+            handle_enqueue_reply(event, invocation, ud);
+        }
+        return;
+    }
+
+    g_hash_table_remove(ud->batches, &event->reply_userdata);
+    batch_set_result(batch, event->reply_userdata - batch->first_reply,
+                     event->error >= 0, event->error >= 0 ? "" : mpv_error_string(event->error));
+}
+
+// A position given right after a URI is where playback starts, seeking
+// would fail since loadfile only queues the file
+static int batch_loadfile(UserData *ud, uint64_t reply, const char *uri, int64_t start_us)
+{
+    char start[G_ASCII_DTOSTR_BUF_SIZE + 6] = "start=";
+    char *keys[] = {"name", "url", "flags", "options"};
+    mpv_node values[4];
+    mpv_node_list args = {4, values, keys};
+    mpv_node cmd = {.format = MPV_FORMAT_NODE_MAP, .u.list = &args};
+
+    g_ascii_dtostr(start + 6, sizeof(start) - 6, start_us / 1000000.0);
+    values[0] = (mpv_node){.format = MPV_FORMAT_STRING, .u.string = "loadfile"};
+    values[1] = (mpv_node){.format = MPV_FORMAT_STRING, .u.string = (char*)uri};
+    values[2] = (mpv_node){.format = MPV_FORMAT_STRING,
+                           .u.string = ud->open_uri_append ? "append-play" : "replace"};
+    values[3] = (mpv_node){.format = MPV_FORMAT_STRING, .u.string = start};
+
+    return mpv_command_node_async(ud->mpv, reply, &cmd);
+}
+
+// Sends the command for one operation, returns an error message if it
+// could not be sent
+static const char *batch_command(UserData *ud, uint64_t reply, const char *op,
+                                 GVariant *arg, GVariant *next, gboolean *merged_next)
+{
+    char number[G_ASCII_DTOSTR_BUF_SIZE];
+    int err;
+
+    if (g_strcmp0(op, "Play") == 0) {
+        const char *cmd[] = {"set", "pause", "no", NULL};
+        err = mpv_command_async(ud->mpv, reply, cmd);
+
+    } else if (g_strcmp0(op, "Pause") == 0) {
+        const char *cmd[] = {"set", "pause", "yes", NULL};
+        err = mpv_command_async(ud->mpv, reply, cmd);
+
+    } else if (g_strcmp0(op, "PlayPause") == 0) {
+        const char *cmd[] = {"cycle", "pause", NULL};
+        err = mpv_command_async(ud->mpv, reply, cmd);
+
+    } else if (g_strcmp0(op, "Stop") == 0) {
         const char *cmd[] = {"stop", NULL};
-        mpv_command_async(ud->mpv, 0, cmd);
-        g_dbus_method_invocation_return_value(invocation, NULL);
+        err = mpv_command_async(ud->mpv, reply, cmd);
 
-    } else if (g_strcmp0(method_name, "Next") == 0) {
+    } else if (g_strcmp0(op, "Next") == 0) {
         const char *cmd[] = {"playlist_next", NULL};
-        mpv_command_async(ud->mpv, 0, cmd);
-        g_dbus_method_invocation_return_value(invocation, NULL);
+        err = mpv_command_async(ud->mpv, reply, cmd);
 
-    } else if (g_strcmp0(method_name, "Previous") == 0) {
+    } else if (g_strcmp0(op, "Previous") == 0) {
         const char *cmd[] = {"playlist_prev", NULL};
-        mpv_command_async(ud->mpv, 0, cmd);
-        g_dbus_method_invocation_return_value(invocation, NULL);
+        err = mpv_command_async(ud->mpv, reply, cmd);
 
-    } else if (g_strcmp0(method_name, "Seek") == 0) {
-        int64_t offset_us; // in microseconds
-        char offset_str[G_ASCII_DTOSTR_BUF_SIZE];
-        g_variant_get(parameters, "(x)", &offset_us);
-        double offset_s = offset_us / 1000000.0;
-        g_ascii_dtostr(offset_str, G_ASCII_DTOSTR_BUF_SIZE, offset_s);
+    } else if (g_strcmp0(op, "Seek") == 0 || g_strcmp0(op, "SetPosition") == 0) {
+        gboolean absolute = g_strcmp0(op, "SetPosition") == 0;
+        if (!g_variant_is_of_type(arg, G_VARIANT_TYPE_INT64)) {
+            return "Expected an int64 in microseconds";
+        }
+        if (absolute) {
+            cancel_seek_window(ud);
+        }
+        g_ascii_dtostr(number, sizeof(number), g_variant_get_int64(arg) / 1000000.0);
+        const char *cmd[] = {"seek", number, absolute ? "absolute" : "relative", NULL};
+        err = mpv_command_async(ud->mpv, reply, cmd);
+
+    } else if (g_strcmp0(op, "OpenUri") == 0) {
+        const char *next_op = NULL;
+        GVariant *next_arg = NULL;
+        if (!g_variant_is_of_type(arg, G_VARIANT_TYPE_STRING)) {
+            return "Expected a string";
+        }
+        if (next) {
+            g_variant_get(next, "(&sv)", &next_op, &next_arg);
+        }
+        if (g_strcmp0(next_op, "SetPosition") == 0 &&
+            g_variant_is_of_type(next_arg, G_VARIANT_TYPE_INT64)) {
+            err = batch_loadfile(ud, reply, g_variant_get_string(arg, NULL),
+                                 g_variant_get_int64(next_arg));
+            *merged_next = TRUE;
+        } else {
+            const char *cmd[] = {"loadfile", g_variant_get_string(arg, NULL),
+                                 ud->open_uri_append ? "append-play" : "replace", NULL};
+            err = mpv_command_async(ud->mpv, reply, cmd);
+        }
+        if (next_arg) {
+            g_variant_unref(next_arg);
+        }
 
-        const char *cmd[] = {"seek", offset_str, NULL};
-        mpv_command_async(ud->mpv, 0, cmd);
-        g_dbus_method_invocation_return_value(invocation, NULL);
+    } else if (g_strcmp0(op, "Enqueue") == 0) {
+        if (!g_variant_is_of_type(arg, G_VARIANT_TYPE_STRING)) {
+            return "Expected a string";
+        }
+        const char *cmd[] = {"loadfile", g_variant_get_string(arg, NULL), "append-play", NULL};
+        err = mpv_command_async(ud->mpv, reply, cmd);
+
+    } else if (g_strcmp0(op, "Volume") == 0 || g_strcmp0(op, "Rate") == 0) {
+        gboolean volume = g_strcmp0(op, "Volume") == 0;
+        if (!g_variant_is_of_type(arg, G_VARIANT_TYPE_DOUBLE)) {
+            return "Expected a double";
+        }
+        // A throttled Set that is still waiting would undo this one
+        (volume ? &ud->volume_write : &ud->rate_write)->pending = FALSE;
+        g_ascii_dtostr(number, sizeof(number),
+                       g_variant_get_double(arg) * (volume ? 100 : 1));
+        const char *cmd[] = {"set", volume ? "volume" : "speed", number, NULL};
+        err = mpv_command_async(ud->mpv, reply, cmd);
+
+    } else {
+        return "Unknown operation";
+    }
+
+    return err < 0 ? mpv_error_string(err) : NULL;
+}
+
+// Runs the operations as mpv commands in order and replies once mpv has
+// answered all of them
+static void batch_start(UserData *ud, GVariant *parameters, GDBusMethodInvocation *invocation)
+{
+    GVariant *operations = g_variant_get_child_value(parameters, 0);
+    Batch *batch = g_new0(Batch, 1);
+
+    batch->invocation = invocation;
+    batch->count = g_variant_n_children(operations);
+    // Held until every command is sent
+    batch->waiting = batch->count + 1;
+    batch->results = g_new0(GVariant*, batch->count);
+    batch->merged = g_new0(gboolean, batch->count);
+    batch->first_reply = ud->next_batch_reply;
+    ud->next_batch_reply += batch->count;
+
+    for (guint i = 0; i < batch->count; i++) {
+        GVariant *next = i + 1 < batch->count ?
+            g_variant_get_child_value(operations, i + 1) : NULL;
+        uint64_t reply = batch->first_reply + i;
+        const char *op;
+        GVariant *arg;
+        const char *error;
+
+        if (batch->merged[i]) {
+            g_clear_pointer(&next, g_variant_unref);
+            continue;
+        }
+
+        g_variant_get_child(operations, i, "(&sv)", &op, &arg);
+        error = batch_command(ud, reply, op, arg, next,
+                              i + 1 < batch->count ? &batch->merged[i + 1] : NULL);
+        if (error) {
+            batch_set_result(batch, i, FALSE, error);
+        } else {
+            uint64_t *key = g_new(uint64_t, 1);
+            *key = reply;
+            g_hash_table_insert(ud->batches, key, batch);
+        }
+
+        g_variant_unref(arg);
+        g_clear_pointer(&next, g_variant_unref);
+    }
+
+    g_variant_unref(operations);
+    batch->waiting--;
+    batch_finish(batch);
+}
+
+// Pending calls are answered before mpv goes away
+static void batch_abort_all(UserData *ud)
+{
+    GHashTable *pending = g_hash_table_new(NULL, NULL);
+    GHashTableIter iter;
+    gpointer value;
 
-    } else if (g_strcmp0(method_name, "SetPosition") == 0) {
-        char *object_path;
-        double new_position_s;
-        int64_t new_position_us;
+    g_hash_table_iter_init(&iter, ud->batches);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        g_hash_table_add(pending, value);
+    }
+    g_hash_table_remove_all(ud->batches);
+
+    g_hash_table_iter_init(&iter, pending);
+    while (g_hash_table_iter_next(&iter, &value, NULL)) {
+        Batch *batch = value;
+        g_dbus_method_invocation_return_error(batch->invocation, G_DBUS_ERROR,
+                                              G_DBUS_ERROR_FAILED, "mpv is shutting down");
+        batch_free(batch);
+    }
+    g_hash_table_unref(pending);
 
-        g_variant_get(parameters, "(&ox)", &object_path, &new_position_us);
-        new_position_s = ((double)new_position_us) / 1000000.0; // us -> s
+    g_hash_table_iter_init(&iter, ud->enqueues);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        g_dbus_method_invocation_return_error(value, G_DBUS_ERROR,
+                                              G_DBUS_ERROR_FAILED, "mpv is shutting down");
+    }
+    g_hash_table_remove_all(ud->enqueues);
+}
 
-        if (g_str_has_prefix(object_path, TRACK_PATH_PREFIX) &&
-            ud->playlist_pos == g_ascii_strtoll(object_path + strlen(TRACK_PATH_PREFIX),
-                                                NULL, 10)) {
-            mpv_set_property(ud->mpv, "time-pos", MPV_FORMAT_DOUBLE, &new_position_s);
-        }
+static void method_call_ext(G_GNUC_UNUSED GDBusConnection *connection,
+                            G_GNUC_UNUSED const char *sender,
+                            G_GNUC_UNUSED const char *object_path,
+                            const char *interface_name,
+                            const char *method_name,
+                            GVariant *parameters,
+                            GDBusMethodInvocation *invocation,
+                            gpointer user_data)
+{
+    UserData *ud = (UserData*)user_data;
+    trace_dbus(ud, 'c', interface_name, method_name, parameters);
+    if (g_strcmp0(method_name, "GetStats") == 0) {
+        g_dbus_method_invocation_return_value(invocation,
+                                              g_variant_new("(@a{sv})", get_stats(ud)));
 
-        g_dbus_method_invocation_return_value(invocation, NULL);
+    } else if (g_strcmp0(method_name, "GetArt") == 0) {
+        get_art(ud, invocation);
 
-    } else if (g_strcmp0(method_name, "OpenUri") == 0) {
-        char *uri;
-        g_variant_get(parameters, "(&s)", &uri);
-        const char *cmd[] = {"loadfile", uri, NULL};
-        mpv_command_async(ud->mpv, 0, cmd);
-        g_dbus_method_invocation_return_value(invocation, NULL);
+    } else if (g_strcmp0(method_name, "Batch") == 0) {
+        batch_start(ud, parameters, invocation);
+
+    } else if (g_strcmp0(method_name, "Enqueue") == 0) {
+        enqueue(ud, parameters, invocation);
 
     } else {
         g_dbus_method_invocation_return_error(invocation, G_DBUS_ERROR,
@@ -692,182 +3126,165 @@ static void method_call_player(G_GNUC_UNUSED GDBusConnection *connection,
     }
 }
 
-static GVariant *get_property_player(G_GNUC_UNUSED GDBusConnection *connection,
-                                     G_GNUC_UNUSED const char *sender,
-                                     G_GNUC_UNUSED const char *object_path,
-                                     G_GNUC_UNUSED const char *interface_name,
-                                     const char *property_name,
-                                     GError **error,
-                                     gpointer user_data)
-{
-    UserData *ud = (UserData*)user_data;
-    GVariant *ret;
-    if (g_strcmp0(property_name, "PlaybackStatus") == 0) {
-        ret = g_variant_new_string(ud->status);
+// Extensions to MPRIS, only registered with mpris-extensions=yes
+static GDBusInterfaceVTable vtable_ext = {
+    method_call_ext, NULL, NULL, {0}
+};
 
-    } else if (g_strcmp0(property_name, "LoopStatus") == 0) {
-        ret = g_variant_new_string(ud->loop_status);
+// GDBus buffers outgoing messages without limit, so keep track of what
+// has been emitted but possibly not yet written to the bus
+static gboolean signal_queue_full(UserData *ud)
+{
+    return ud->signal_queue_bytes >= ud->signal_queue_max_bytes ||
+           ud->signal_queue_count >= ud->signal_queue_max_count;
+}
 
-    } else if (g_strcmp0(property_name, "Rate") == 0) {
-        double rate = 1.0;
-        mpv_get_property(ud->mpv, "speed", MPV_FORMAT_DOUBLE, &rate);
-        ret = g_variant_new_double(rate);
+static void start_signal_queue_flush(UserData *ud);
 
-    } else if (g_strcmp0(property_name, "Shuffle") == 0) {
-        int shuffle = 0;
-        mpv_get_property(ud->mpv, "shuffle", MPV_FORMAT_FLAG, &shuffle);
-        ret = g_variant_new_boolean(shuffle);
+static void signal_queue_flushed(GObject *source, GAsyncResult *res, gpointer data)
+{
+    UserData *ud = (UserData*)data;
+    GError *error = NULL;
 
-    } else if (g_strcmp0(property_name, "Metadata") == 0) {
-        if (!ud->metadata) {
-            ud->metadata = g_variant_ref_sink(create_metadata(ud));
+    if (!g_dbus_connection_flush_finish(G_DBUS_CONNECTION(source), res, &error)) {
+        // Losing the bus is handled by reconnecting
+        if (!g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CLOSED)) {
+            g_printerr("%s", error->message);
         }
-        // Increase reference count to prevent it from being freed after returning
-        g_variant_ref(ud->metadata);
-        ret = ud->metadata;
-
-    } else if (g_strcmp0(property_name, "Volume") == 0) {
-        double volume = 0;
-        mpv_get_property(ud->mpv, "volume", MPV_FORMAT_DOUBLE, &volume);
-        volume /= 100;
-        ret = g_variant_new_double(volume);
-
-    } else if (g_strcmp0(property_name, "Position") == 0) {
-        double position_s = 0;
-        int64_t position_us;
-        mpv_get_property(ud->mpv, "time-pos", MPV_FORMAT_DOUBLE, &position_s);
-        position_us = position_s * 1000000.0; // s -> us
-        ret = g_variant_new_int64(position_us);
+        g_clear_error(&error);
+    }
 
-    } else if (g_strcmp0(property_name, "MinimumRate") == 0) {
-        ret = g_variant_new_double(0.01);
+    ud->signal_queue_bytes -= ud->signal_flush_bytes;
+    ud->signal_queue_count -= ud->signal_flush_count;
+    ud->signal_flush_bytes = 0;
+    ud->signal_flush_count = 0;
 
-    } else if (g_strcmp0(property_name, "MaximumRate") == 0) {
-        ret = g_variant_new_double(100);
+    if (ud->signal_queue_count > 0) {
+        start_signal_queue_flush(ud);
+    }
+}
 
-    } else if (g_strcmp0(property_name, "CanGoNext") == 0) {
-        ret = g_variant_new_boolean(can_go_next(ud));
+static void start_signal_queue_flush(UserData *ud)
+{
+    if (!ud->connection) {
+        // Whatever was still queued went down with the connection
+        ud->signal_queue_bytes = 0;
+        ud->signal_queue_count = 0;
+        return;
+    }
 
-    } else if (g_strcmp0(property_name, "CanGoPrevious") == 0) {
-        ret = g_variant_new_boolean(can_go_previous(ud));
+    ud->signal_flush_bytes = ud->signal_queue_bytes;
+    ud->signal_flush_count = ud->signal_queue_count;
+    g_dbus_connection_flush(ud->connection, NULL, signal_queue_flushed, ud);
+}
 
-    } else if (g_strcmp0(property_name, "CanPlay") == 0) {
-        ret = g_variant_new_boolean(can_play_pause(ud));
+static void emit_signal(UserData *ud, const char *interface_name,
+                        const char *signal_name, GVariant *params)
+{
+    GError *error = NULL;
+    // Rough allowance for the message header
+    gsize size = g_variant_get_size(params) + 128;
 
-    } else if (g_strcmp0(property_name, "CanPause") == 0) {
-        ret = g_variant_new_boolean(can_play_pause(ud));
+    g_variant_ref_sink(params);
 
-    } else if (g_strcmp0(property_name, "CanSeek") == 0) {
-        ret = g_variant_new_boolean(TRUE);
+    // Direct clients are local and read quickly, they aren't queued
+    for (guint i = 0; ud->peers && i < ud->peers->len; i++) {
+        PeerConnection *peer = g_ptr_array_index(ud->peers, i);
+        g_dbus_connection_emit_signal(peer->connection, NULL,
+                                      "/org/mpris/MediaPlayer2",
+                                      interface_name,
+                                      signal_name,
+                                      params, NULL);
+    }
 
-    } else if (g_strcmp0(property_name, "CanControl") == 0) {
-        ret = g_variant_new_boolean(TRUE);
+    if (!ud->connection) {
+        // Clients get a snapshot of everything after reconnecting
+        g_variant_unref(params);
+        return;
+    }
 
-    } else {
-        ret = NULL;
-        g_set_error(error, G_DBUS_ERROR,
-                    G_DBUS_ERROR_UNKNOWN_PROPERTY,
-                    "Unknown property %s", property_name);
+    g_dbus_connection_emit_signal(ud->connection, NULL,
+                                  "/org/mpris/MediaPlayer2",
+                                  interface_name,
+                                  signal_name,
+                                  params, &error);
+    g_variant_unref(params);
+    if (error != NULL) {
+        g_printerr("%s", error->message);
+        g_clear_error(&error);
+        return;
     }
 
-    return ret;
+    ud->signal_queue_bytes += size;
+    ud->signal_queue_count++;
+    if (ud->signal_flush_count == 0) {
+        start_signal_queue_flush(ud);
+    }
 }
 
-static gboolean set_property_player(G_GNUC_UNUSED GDBusConnection *connection,
-                                    G_GNUC_UNUSED const char *sender,
-                                    G_GNUC_UNUSED const char *object_path,
-                                    G_GNUC_UNUSED const char *interface_name,
-                                    const char *property_name,
-                                    GVariant *value,
-                                    G_GNUC_UNUSED GError **error,
-                                    gpointer user_data)
+static void update_read_snapshot(UserData *ud, const char *name, GVariant *value)
 {
-    UserData *ud = (UserData*)user_data;
-    if (g_strcmp0(property_name, "LoopStatus") == 0) {
-        const char *status;
-        int t = TRUE;
-        int f = FALSE;
-        status = g_variant_get_string(value, NULL);
-        if (g_strcmp0(status, "Track") == 0) {
-            mpv_set_property(ud->mpv, "loop-file", MPV_FORMAT_FLAG, &t);
-            mpv_set_property(ud->mpv, "loop-playlist", MPV_FORMAT_FLAG, &f);
-        } else if (g_strcmp0(status, "Playlist") == 0) {
-            mpv_set_property(ud->mpv, "loop-file", MPV_FORMAT_FLAG, &f);
-            mpv_set_property(ud->mpv, "loop-playlist", MPV_FORMAT_FLAG, &t);
-        } else {
-            mpv_set_property(ud->mpv, "loop-file", MPV_FORMAT_FLAG, &f);
-            mpv_set_property(ud->mpv, "loop-playlist", MPV_FORMAT_FLAG, &f);
-        }
+    if (!ud->read_snapshot) {
+        return;
+    }
 
-    } else if (g_strcmp0(property_name, "Rate") == 0) {
-        double rate = g_variant_get_double(value);
-        mpv_set_property(ud->mpv, "speed", MPV_FORMAT_DOUBLE, &rate);
+    g_mutex_lock(&ud->read_buckets_lock);
+    if (value) {
+        g_hash_table_insert(ud->read_snapshot, (gpointer)g_intern_string(name),
+                            g_variant_ref(value));
+    } else {
+        g_hash_table_remove(ud->read_snapshot, name);
+    }
+    g_mutex_unlock(&ud->read_buckets_lock);
+}
 
-    } else if (g_strcmp0(property_name, "Shuffle") == 0) {
-        int shuffle = g_variant_get_boolean(value);
-        if (shuffle && !ud->shuffle) {
-            const char *cmd[] = {"playlist-shuffle", NULL};
-            mpv_command_async(ud->mpv, 0, cmd);
-        } else if (!shuffle && ud->shuffle) {
-            const char *cmd[] = {"playlist-unshuffle", NULL};
-            mpv_command_async(ud->mpv, 0, cmd);
+static void send_property_changes(UserData *ud)
+{
+    if (ud->changed_properties->len > 0) {
+        GVariant *params;
+        GVariantBuilder properties;
+        GVariantBuilder invalidated;
+
+        g_variant_builder_init(&properties, G_VARIANT_TYPE("a{sv}"));
+        g_variant_builder_init(&invalidated, G_VARIANT_TYPE("as"));
+        for (guint i = 0; i < ud->changed_properties->len; i++) {
+            ChangedProperty *changed = &g_array_index(ud->changed_properties,
+                                                      ChangedProperty, i);
+            if (changed->value) {
+                g_variant_builder_add(&properties, "{sv}", changed->name, changed->value);
+            } else {
+                g_variant_builder_add(&invalidated, "s", changed->name);
+            }
+            update_read_snapshot(ud, changed->name, changed->value);
         }
-        mpv_set_property(ud->mpv, "shuffle", MPV_FORMAT_FLAG, &shuffle);
+        params = g_variant_new("(sa{sv}as)", "org.mpris.MediaPlayer2.Player",
+                               &properties, &invalidated);
 
-    } else if (g_strcmp0(property_name, "Volume") == 0) {
-        double volume = g_variant_get_double(value);
-        volume *= 100;
-        mpv_set_property(ud->mpv, "volume", MPV_FORMAT_DOUBLE, &volume);
+        emit_signal(ud, "org.freedesktop.DBus.Properties", "PropertiesChanged", params);
 
-    } else {
-        g_set_error(error, G_DBUS_ERROR,
-                    G_DBUS_ERROR_UNKNOWN_PROPERTY,
-                    "Cannot set property %s", property_name);
-        return FALSE;
+        clear_changed_properties(ud);
     }
-
-    return TRUE;
 }
 
-static GDBusInterfaceVTable vtable_player = {
-    method_call_player, get_property_player, set_property_player, {0}
-};
-
 static gboolean emit_property_changes(gpointer data)
 {
     UserData *ud = (UserData*)data;
-    GError *error = NULL;
-    gpointer prop_name, prop_value;
-    GHashTableIter iter;
 
-    if (g_hash_table_size(ud->changed_properties) > 0) {
-        GVariant *params;
-        GVariantBuilder *properties = g_variant_builder_new(G_VARIANT_TYPE("a{sv}"));
-        GVariantBuilder *invalidated = g_variant_builder_new(G_VARIANT_TYPE("as"));
-        g_hash_table_iter_init(&iter, ud->changed_properties);
-        while (g_hash_table_iter_next(&iter, &prop_name, &prop_value)) {
-            if (prop_value) {
-                g_variant_builder_add(properties, "{sv}", prop_name, prop_value);
-            } else {
-                g_variant_builder_add(invalidated, "s", prop_name);
-            }
-        }
-        params = g_variant_new("(sa{sv}as)",
-                               "org.mpris.MediaPlayer2.Player", properties, invalidated);
-        g_variant_builder_unref(properties);
-        g_variant_builder_unref(invalidated);
+    if (ud->changed_properties->len == 0 && !ud->seeked_pending) {
+        return TRUE;
+    }
 
-        g_dbus_connection_emit_signal(ud->connection, NULL,
-                                      "/org/mpris/MediaPlayer2",
-                                      "org.freedesktop.DBus.Properties",
-                                      "PropertiesChanged",
-                                      params, &error);
-        if (error != NULL) {
-            g_printerr("%s", error->message);
-            g_clear_error(&error);
-        }
+    // While the bus is not keeping up, changes keep accumulating in
+    // changed_properties where newer values replace older ones
+    if (signal_queue_full(ud)) {
+        ud->signals_coalesced++;
+        return TRUE;
+    }
+
+    send_property_changes(ud);
 
-        g_hash_table_remove_all(ud->changed_properties);
+    if (ud->seeked_pending) {
+        emit_seeked_signal(ud);
     }
     return TRUE;
 }
@@ -877,20 +3294,77 @@ static void emit_seeked_signal(UserData *ud)
     GVariant *params;
     double position_s = 0;
     int64_t position_us;
-    GError *error = NULL;
-    mpv_get_property(ud->mpv, "time-pos", MPV_FORMAT_DOUBLE, &position_s);
+
+    // Only the latest position matters, so send it once the bus catches up
+    if (signal_queue_full(ud)) {
+        ud->seeked_pending = TRUE;
+        ud->signals_coalesced++;
+        return;
+    }
+    ud->seeked_pending = FALSE;
+
+    read_property(ud, "time-pos", MPV_FORMAT_DOUBLE, &position_s);
     position_us = position_s * 1000000.0; // s -> us
     params = g_variant_new("(x)", position_us);
 
-    g_dbus_connection_emit_signal(ud->connection, NULL,
-                                  "/org/mpris/MediaPlayer2",
-                                  "org.mpris.MediaPlayer2.Player",
-                                  "Seeked",
-                                  params, &error);
+    emit_signal(ud, "org.mpris.MediaPlayer2.Player", "Seeked", params);
+}
 
-    if (error != NULL) {
-        g_printerr("%s", error->message);
-        g_clear_error(&error);
+// Lets clients extrapolate the position instead of polling Position. The
+// rate is 0 unless playing, timestamps are CLOCK_MONOTONIC in microseconds.
+static void emit_heartbeat(UserData *ud)
+{
+    double position_s = 0;
+    double rate = 0;
+
+    if (ud->ext_interface_id == 0) {
+        return;
+    }
+
+    // A newer heartbeat follows soon, don't add to a backlog
+    if (signal_queue_full(ud)) {
+        ud->signals_coalesced++;
+        return;
+    }
+
+    read_property(ud, "time-pos", MPV_FORMAT_DOUBLE, &position_s);
+    if (ud->status == STATUS_PLAYING) {
+        read_property(ud, "speed", MPV_FORMAT_DOUBLE, &rate);
+    }
+
+    emit_signal(ud, "io.mpv.Mpris", "Heartbeat",
+                g_variant_new("(xdx)", (gint64)(position_s * 1000000.0), rate,
+                              g_get_monotonic_time()));
+}
+
+static gboolean heartbeat_elapsed(gpointer data)
+{
+    emit_heartbeat(data);
+    return G_SOURCE_CONTINUE;
+}
+
+// Sends a heartbeat for the new state and only keeps the timer running
+// while playing, so there are no wakeups while paused or idle
+static void update_heartbeat(UserData *ud)
+{
+    // Nobody could receive it, don't wake up for nothing
+    if (ud->heartbeat_ms == 0 || !ud->extensions || ud->ext_interface_id == 0) {
+        if (ud->heartbeat) {
+            g_source_destroy(ud->heartbeat);
+            g_clear_pointer(&ud->heartbeat, g_source_unref);
+        }
+        return;
+    }
+
+    emit_heartbeat(ud);
+
+    if (ud->status == STATUS_PLAYING && !ud->heartbeat) {
+        ud->heartbeat = g_timeout_source_new(ud->heartbeat_ms);
+        g_source_set_callback(ud->heartbeat, heartbeat_elapsed, ud, NULL);
+        g_source_attach(ud->heartbeat, ud->ctx);
+    } else if (ud->status != STATUS_PLAYING && ud->heartbeat) {
+        g_source_destroy(ud->heartbeat);
+        g_clear_pointer(&ud->heartbeat, g_source_unref);
     }
 }
 
@@ -930,25 +3404,212 @@ static GVariant * set_playback_status(UserData *ud)
     } else {
         ud->status = STATUS_PLAYING;
     }
-    return g_variant_new_string(ud->status);
+    return variant_constant_string(ud->status);
 }
 
-static void set_stopped_status(UserData *ud)
+enum {
+    STATUS_PAGE_PLAYBACK = 1 << 0, // status, position and rate
+    STATUS_PAGE_VOLUME = 1 << 1,
+    STATUS_PAGE_TRACK = 1 << 2,
+    STATUS_PAGE_ALL = STATUS_PAGE_PLAYBACK | STATUS_PAGE_VOLUME | STATUS_PAGE_TRACK,
+};
+
+// Cuts text that doesn't fit at a character boundary
+static void status_page_copy_text(char *dest, const char *text)
+{
+    const gchar *end;
+
+    g_strlcpy(dest, text ? text : "", MPRIS_STATUS_TEXT_SIZE);
+    g_utf8_validate(dest, -1, &end);
+    dest[end - dest] = '\0';
+}
+
+// Values are fetched before the page is marked as being written, so
+// readers never have to wait for mpv
+static void status_page_update(UserData *ud, guint what)
+{
+    MprisStatusPage *page = ud->status_page;
+    guint32 sequence;
+    double position = 0;
+    double rate = 1;
+    double volume = 0;
+    char *title = NULL;
+    char *artist = NULL;
+
+    if (!page) {
+        return;
+    }
+
+    if (what & STATUS_PAGE_PLAYBACK) {
+        read_property(ud, "time-pos", MPV_FORMAT_DOUBLE, &position);
+        read_property(ud, "speed", MPV_FORMAT_DOUBLE, &rate);
+    }
+    if (what & STATUS_PAGE_VOLUME) {
+        read_property(ud, "volume", MPV_FORMAT_DOUBLE, &volume);
+    }
+    if (what & STATUS_PAGE_TRACK) {
+        title = read_property_string(ud, "media-title");
+        artist = read_property_string(ud, "metadata/by-key/Artist");
+        if (!artist) {
+            artist = read_property_string(ud, "metadata/by-key/uploader");
+        }
+    }
+
+    sequence = page->sequence;
+    __atomic_store_n(&page->sequence, sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    if (what & STATUS_PAGE_PLAYBACK) {
+        if (ud->status == STATUS_PLAYING) {
+            page->status.playback_status = MPRIS_STATUS_PLAYING;
+        } else if (ud->status == STATUS_PAUSED) {
+            page->status.playback_status = MPRIS_STATUS_PAUSED;
+        } else {
+            page->status.playback_status = MPRIS_STATUS_STOPPED;
+        }
+        page->status.position_us = (int64_t)(position * 1000000.0);
+        // Same clock as CLOCK_MONOTONIC
+        page->status.position_time_us = g_get_monotonic_time();
+        page->status.rate = rate;
+    }
+    if (what & STATUS_PAGE_VOLUME) {
+        page->status.volume = volume / 100;
+    }
+    if (what & STATUS_PAGE_TRACK) {
+        status_page_copy_text(page->status.title, title);
+        status_page_copy_text(page->status.artist, artist);
+    }
+
+    __atomic_store_n(&page->sequence, sequence + 2, __ATOMIC_RELEASE);
+
+    mpv_free(title);
+    mpv_free(artist);
+}
+
+// Only a page of ours that is left over from an earlier instance may be
+// replaced, anything else at that path is somebody's file
+static gboolean status_page_replaceable(const char *path)
+{
+    GStatBuf st;
+    guint32 magic = 0;
+    gboolean ok;
+    int fd;
+
+    if (g_lstat(path, &st) < 0) {
+        return errno == ENOENT;
+    }
+    if (!S_ISREG(st.st_mode) || st.st_uid != getuid() ||
+        st.st_size != sizeof(MprisStatusPage)) {
+        return FALSE;
+    }
+
+    fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        return FALSE;
+    }
+    ok = pread(fd, &magic, sizeof(magic), 0) == sizeof(magic) &&
+         (magic == MPRIS_STATUS_MAGIC || magic == 0);
+    close(fd);
+    return ok;
+}
+
+static void status_page_open(UserData *ud)
+{
+    char *path = get_script_opt(ud->mpv, "status-page");
+    gchar *tmp_path;
+    GStatBuf st;
+    void *page;
+    int fd;
+
+    if (!path || path[0] == '\0') {
+        g_free(path);
+        return;
+    }
+    if (g_strcmp0(path, "auto") == 0) {
+        g_free(path);
+        path = g_strdup_printf("%s/mpv-mpris-%d.status",
+                               g_get_user_runtime_dir(), (int)getpid());
+    }
+
+    if (!status_page_replaceable(path)) {
+        g_printerr("Not using %s as status page, it exists and is not one\n", path);
+        g_free(path);
+        return;
+    }
+
+    // Made complete next to the page and renamed over it, so readers never
+    // see a half initialized page, and readers that still map a page left
+    // behind by a crashed instance keep their copy
+    tmp_path = g_strconcat(path, ".XXXXXX", NULL);
+    fd = g_mkstemp_full(tmp_path, O_RDWR | O_CLOEXEC, 0600);
+    if (fd < 0 || ftruncate(fd, sizeof(MprisStatusPage)) < 0 || fstat(fd, &st) < 0 ||
+        (page = mmap(NULL, sizeof(MprisStatusPage), PROT_READ | PROT_WRITE,
+                     MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        g_printerr("Failed to create status page %s: %s\n", path, g_strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+            g_unlink(tmp_path);
+        }
+        g_free(tmp_path);
+        g_free(path);
+        return;
+    }
+    close(fd);
+
+    ud->status_page = page;
+    ud->status_page->version = MPRIS_STATUS_VERSION;
+    status_page_update(ud, STATUS_PAGE_ALL);
+    // Published last, readers check it before anything else
+    __atomic_store_n(&ud->status_page->magic, MPRIS_STATUS_MAGIC, __ATOMIC_RELEASE);
+
+    if (g_rename(tmp_path, path) < 0) {
+        g_printerr("Failed to create status page %s: %s\n", path, g_strerror(errno));
+        munmap(ud->status_page, sizeof(MprisStatusPage));
+        ud->status_page = NULL;
+        g_unlink(tmp_path);
+        g_free(tmp_path);
+        g_free(path);
+        return;
+    }
+    g_free(tmp_path);
+
+    ud->status_page_path = path;
+    ud->status_page_dev = st.st_dev;
+    ud->status_page_ino = st.st_ino;
+    mpv_set_property(ud->mpv, "user-data/mpris/status-page", MPV_FORMAT_STRING, &path);
+}
+
+static void status_page_close(UserData *ud)
 {
-  const char *prop_name = "PlaybackStatus";
-  GVariant *prop_value = g_variant_ref_sink(g_variant_new_string(STATUS_STOPPED));
+    GStatBuf st;
 
+    if (!ud->status_page) {
+        return;
+    }
+
+    // Tells readers that still have it mapped that it is stale
+    __atomic_store_n(&ud->status_page->magic, 0, __ATOMIC_RELEASE);
+    munmap(ud->status_page, sizeof(MprisStatusPage));
+    // Another instance configured with the same path may have replaced it
+    if (g_lstat(ud->status_page_path, &st) == 0 &&
+        st.st_dev == ud->status_page_dev && st.st_ino == ud->status_page_ino) {
+        g_unlink(ud->status_page_path);
+    }
+    g_clear_pointer(&ud->status_page_path, g_free);
+    ud->status_page = NULL;
+}
+
+static void set_stopped_status(UserData *ud)
+{
   ud->idle = TRUE;
   ud->status = STATUS_STOPPED;
 
-  g_hash_table_insert(ud->changed_properties,
-                      (gpointer)prop_name, prop_value);
-  g_hash_table_insert(ud->changed_properties, "CanPlay",
-                      g_variant_ref_sink(g_variant_new_boolean(can_play_pause(ud))));
-  g_hash_table_insert(ud->changed_properties, "CanPause",
-                      g_variant_ref_sink(g_variant_new_boolean(can_play_pause(ud))));
+  set_changed_property(ud, "PlaybackStatus", variant_constant_string(STATUS_STOPPED));
+  set_changed_property(ud, "CanPlay", variant_boolean(can_play_pause(ud)));
+  set_changed_property(ud, "CanPause", variant_boolean(can_play_pause(ud)));
+  status_page_update(ud, STATUS_PAGE_PLAYBACK);
 
-  emit_property_changes(ud);
+  send_property_changes(ud);
 }
 
 // Register D-Bus object and interfaces, then set up mpv event handlers
@@ -984,6 +3645,19 @@ static void on_bus_acquired(GDBusConnection *connection,
         }
     }
 
+    if (ud->extensions && ud->ext_interface_id == 0) {
+        ud->ext_interface_id =
+            g_dbus_connection_register_object(connection, "/org/mpris/MediaPlayer2",
+                                              ud->ext_interface_info,
+                                              &vtable_ext,
+                                              user_data, NULL, &error);
+        if (error != NULL) {
+            g_printerr("Failed to register extension interface: %s\n", error->message);
+            g_clear_error(&error);
+        }
+        update_heartbeat(ud);
+    }
+
     if (!ud->events_setup) {
         setup_mpv_event_sources(ud);
         ud->events_setup = TRUE;
@@ -1021,24 +3695,566 @@ static char *build_bus_name(const char *client_name, gboolean unique_suffix)
     return g_string_free(name, FALSE);
 }
 
+// Clients may have missed any number of changes while the bus was gone,
+// so tell them about every property at once
+static void send_property_snapshot(UserData *ud)
+{
+    GDBusPropertyInfo **property;
+
+    for (property = ud->player_interface_info->properties; *property; property++) {
+        GVariant *value;
+
+        // Position changes constantly and is never part of PropertiesChanged
+        if (g_strcmp0((*property)->name, "Position") == 0) {
+            continue;
+        }
+
+        value = player_property(ud, (*property)->name, NULL);
+        if (value) {
+            set_changed_property(ud, (*property)->name, g_variant_take_ref(value));
+        }
+    }
+
+    send_property_changes(ud);
+}
+
+static void on_name_acquired(G_GNUC_UNUSED GDBusConnection *connection,
+                             G_GNUC_UNUSED const char *name,
+                             gpointer user_data)
+{
+    UserData *ud = user_data;
+
+    if (ud->disconnected_at == 0) {
+        return;
+    }
+
+    g_debug("bus: back after %" G_GINT64_FORMAT "ms",
+            (g_get_monotonic_time() - ud->disconnected_at) / 1000);
+    ud->disconnected_at = 0;
+    ud->reconnects++;
+    send_property_snapshot(ud);
+}
+
 static void on_name_lost(GDBusConnection *connection,
                          G_GNUC_UNUSED const char *_name,
                          gpointer user_data)
 {
     UserData *ud = user_data;
 
-    if (connection) {
-        char *name = build_bus_name(ud->client_name, TRUE);
-        ud->bus_id = g_bus_own_name(G_BUS_TYPE_SESSION,
-                                    name,
-                                    G_BUS_NAME_OWNER_FLAGS_NONE,
-                                    NULL, NULL, NULL,
-                                    ud, NULL);
-        g_free(name);
+    // A closed connection is handled by reconnecting
+    if (!connection || g_dbus_connection_is_closed(connection)) {
+        return;
+    }
+
+    char *name = build_bus_name(ud->client_name, TRUE);
+    g_bus_unown_name(ud->bus_id);
+    ud->bus_id = g_bus_own_name_on_connection(connection,
+                                              name,
+                                              G_BUS_NAME_OWNER_FLAGS_NONE,
+                                              on_name_acquired, NULL,
+                                              ud, NULL);
+    g_free(name);
+}
+
+static void bus_connect(UserData *ud);
+
+static gboolean reconnect_elapsed(gpointer data)
+{
+    UserData *ud = data;
+    g_clear_pointer(&ud->reconnect, g_source_unref);
+    bus_connect(ud);
+    return G_SOURCE_REMOVE;
+}
+
+// Retries quickly at first, a restarted bus is usually back in moments
+static void schedule_reconnect(UserData *ud)
+{
+    ud->reconnect = g_timeout_source_new(ud->reconnect_delay_ms);
+    g_source_set_callback(ud->reconnect, reconnect_elapsed, ud, NULL);
+    g_source_attach(ud->reconnect, ud->ctx);
+    ud->reconnect_delay_ms = MIN(ud->reconnect_delay_ms * 2, RECONNECT_MAX_MS);
+}
+
+// Forgets everything tied to the connection, object registrations and the
+// name go away with it
+static void bus_disconnect(UserData *ud)
+{
+    if (!ud->connection) {
+        return;
+    }
+
+    if (ud->bus_id) {
+        g_bus_unown_name(ud->bus_id);
+        ud->bus_id = 0;
+    }
+    if (ud->root_interface_id) {
+        g_dbus_connection_unregister_object(ud->connection, ud->root_interface_id);
+        ud->root_interface_id = 0;
+    }
+    if (ud->player_interface_id) {
+        g_dbus_connection_unregister_object(ud->connection, ud->player_interface_id);
+        ud->player_interface_id = 0;
+    }
+    if (ud->ext_interface_id) {
+        g_dbus_connection_unregister_object(ud->connection, ud->ext_interface_id);
+        ud->ext_interface_id = 0;
+        update_heartbeat(ud);
+    }
+
+    g_signal_handler_disconnect(ud->connection, ud->closed_id);
+    ud->closed_id = 0;
+    g_clear_object(&ud->connection);
+}
+
+static void on_connection_closed(G_GNUC_UNUSED GDBusConnection *connection,
+                                 G_GNUC_UNUSED gboolean remote_peer_vanished,
+                                 GError *error,
+                                 gpointer user_data)
+{
+    UserData *ud = user_data;
+
+    g_debug("bus: connection lost: %s", error ? error->message : "closed");
+    bus_disconnect(ud);
+    ud->disconnected_at = g_get_monotonic_time();
+    ud->reconnect_delay_ms = RECONNECT_MIN_MS;
+    schedule_reconnect(ud);
+}
+
+// Only the user running mpv may control it directly
+static gboolean authorize_peer(G_GNUC_UNUSED GDBusAuthObserver *observer,
+                               G_GNUC_UNUSED GIOStream *stream,
+                               GCredentials *credentials,
+                               G_GNUC_UNUSED gpointer data)
+{
+    return credentials && g_credentials_get_unix_user(credentials, NULL) == getuid();
+}
+
+static gboolean allow_peer_mechanism(G_GNUC_UNUSED GDBusAuthObserver *observer,
+                                     const char *mechanism,
+                                     G_GNUC_UNUSED gpointer data)
+{
+    return g_strcmp0(mechanism, "EXTERNAL") == 0;
+}
+
+static guint register_peer_interface(UserData *ud, GDBusConnection *connection,
+                                     GDBusInterfaceInfo *info,
+                                     const GDBusInterfaceVTable *vtable)
+{
+    GError *error = NULL;
+    guint id = g_dbus_connection_register_object(connection, "/org/mpris/MediaPlayer2",
+                                                 info, vtable, ud, NULL, &error);
+    if (error != NULL) {
+        g_printerr("Failed to register %s for a direct client: %s\n",
+                   info->name, error->message);
+        g_clear_error(&error);
+    }
+    return id;
+}
+
+static void peer_free(PeerConnection *peer)
+{
+    for (guint i = 0; i < G_N_ELEMENTS(peer->interface_ids); i++) {
+        if (peer->interface_ids[i]) {
+            g_dbus_connection_unregister_object(peer->connection, peer->interface_ids[i]);
+        }
+    }
+    g_signal_handler_disconnect(peer->connection, peer->closed_id);
+    g_object_unref(peer->connection);
+    g_free(peer);
+}
+
+static void on_peer_closed(GDBusConnection *connection,
+                           G_GNUC_UNUSED gboolean remote_peer_vanished,
+                           G_GNUC_UNUSED GError *error,
+                           gpointer user_data)
+{
+    UserData *ud = user_data;
+
+    for (guint i = 0; i < ud->peers->len; i++) {
+        PeerConnection *peer = g_ptr_array_index(ud->peers, i);
+        if (peer->connection == connection) {
+            g_ptr_array_remove_index_fast(ud->peers, i);
+            break;
+        }
+    }
+}
+
+static gboolean on_new_peer(G_GNUC_UNUSED GDBusServer *server,
+                            GDBusConnection *connection,
+                            gpointer user_data)
+{
+    UserData *ud = user_data;
+    PeerConnection *peer = g_new0(PeerConnection, 1);
+
+    peer->connection = g_object_ref(connection);
+    peer->interface_ids[0] = register_peer_interface(ud, connection,
+                                                     ud->root_interface_info,
+                                                     &vtable_root);
+    peer->interface_ids[1] = register_peer_interface(ud, connection,
+                                                     ud->player_interface_info,
+                                                     &vtable_player);
+    if (ud->extensions) {
+        peer->interface_ids[2] = register_peer_interface(ud, connection,
+                                                         ud->ext_interface_info,
+                                                         &vtable_ext);
+    }
+    peer->closed_id = g_signal_connect(connection, "closed",
+                                       G_CALLBACK(on_peer_closed), ud);
+    g_ptr_array_add(ud->peers, peer);
+
+    return TRUE;
+}
+
+// Lets local clients talk to the plugin without the round trip through
+// dbus-daemon. The address is published in mpv's user-data/mpris/p2p-address.
+// A socket that still accepts connections belongs to a running instance,
+// only one that refuses them was left behind by one that crashed
+static gboolean socket_in_use(const char *path)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    gboolean in_use;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        return FALSE;
+    }
+    strcpy(addr.sun_path, path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return FALSE;
+    }
+    in_use = connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0 ||
+             (errno != ECONNREFUSED && errno != ENOENT);
+    close(fd);
+    return in_use;
+}
+
+static void peer_server_start(UserData *ud)
+{
+    GError *error = NULL;
+    GDBusAuthObserver *observer;
+    GStatBuf st;
+    char *path = get_script_opt(ud->mpv, "p2p-socket");
+    gchar *escaped;
+    gchar *address;
+    gchar *guid;
+    const char *client_address;
+
+    if (!path || path[0] == '\0') {
+        g_free(path);
+        return;
+    }
+    if (g_strcmp0(path, "auto") == 0) {
+        g_free(path);
+        path = g_strdup_printf("%s/mpv-mpris-%d.socket",
+                               g_get_user_runtime_dir(), (int)getpid());
+    }
+
+    if (g_lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        if (socket_in_use(path)) {
+            g_printerr("%s is in use by another instance, not listening for "
+                       "direct clients\n", path);
+            g_free(path);
+            return;
+        }
+        g_unlink(path);
+    }
+
+    escaped = g_dbus_address_escape_value(path);
+    address = g_strconcat("unix:path=", escaped, NULL);
+    guid = g_dbus_generate_guid();
+    observer = g_dbus_auth_observer_new();
+    g_signal_connect(observer, "authorize-authenticated-peer",
+                     G_CALLBACK(authorize_peer), NULL);
+    g_signal_connect(observer, "allow-mechanism",
+                     G_CALLBACK(allow_peer_mechanism), NULL);
+
+    ud->peer_server = g_dbus_server_new_sync(address, G_DBUS_SERVER_FLAGS_NONE, guid,
+                                             observer, NULL, &error);
+    g_object_unref(observer);
+    g_free(guid);
+    g_free(address);
+    g_free(escaped);
+
+    if (!ud->peer_server) {
+        g_printerr("Failed to listen on %s: %s\n", path, error->message);
+        g_error_free(error);
+        g_free(path);
+        return;
+    }
+
+    g_chmod(path, 0600);
+    ud->peers = g_ptr_array_new_with_free_func((GDestroyNotify)peer_free);
+    g_signal_connect(ud->peer_server, "new-connection", G_CALLBACK(on_new_peer), ud);
+    g_dbus_server_start(ud->peer_server);
+
+    client_address = g_dbus_server_get_client_address(ud->peer_server);
+    mpv_set_property(ud->mpv, "user-data/mpris/p2p-address", MPV_FORMAT_STRING,
+                     &client_address);
+    g_free(path);
+
+    // Direct clients are served even while the bus is unavailable
+    if (!ud->events_setup) {
+        setup_mpv_event_sources(ud);
+        ud->events_setup = TRUE;
+    }
+}
+
+static void peer_server_stop(UserData *ud)
+{
+    if (!ud->peer_server) {
+        return;
+    }
+
+    for (guint i = 0; i < ud->peers->len; i++) {
+        PeerConnection *peer = g_ptr_array_index(ud->peers, i);
+        g_dbus_connection_flush_sync(peer->connection, NULL, NULL);
+    }
+    g_dbus_server_stop(ud->peer_server);
+    g_clear_object(&ud->peer_server);
+    g_clear_pointer(&ud->peers, g_ptr_array_unref);
+}
+
+// Forgets clients that have been quiet long enough to have a full bucket
+// again
+static void prune_read_buckets(UserData *ud, gint64 now)
+{
+    GHashTableIter iter;
+    gpointer value;
+
+    g_hash_table_iter_init(&iter, ud->read_buckets);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        ReadBucket *bucket = value;
+        if ((now - bucket->updated) * ud->read_rate >= ud->read_burst * G_USEC_PER_SEC) {
+            g_hash_table_iter_remove(&iter);
+        }
+    }
+}
+
+static gboolean take_read_token(UserData *ud, const char *sender)
+{
+    gint64 now = g_get_monotonic_time();
+    ReadBucket *bucket;
+    gboolean allowed;
+
+    if (ud->read_rate <= 0 || !sender) {
+        return TRUE;
+    }
+
+    g_mutex_lock(&ud->read_buckets_lock);
+    bucket = g_hash_table_lookup(ud->read_buckets, sender);
+    if (!bucket) {
+        if (g_hash_table_size(ud->read_buckets) >= READ_BUCKETS_MAX) {
+            prune_read_buckets(ud, now);
+        }
+        bucket = g_new0(ReadBucket, 1);
+        bucket->tokens = ud->read_burst;
+        bucket->updated = now;
+        g_hash_table_insert(ud->read_buckets, g_strdup(sender), bucket);
+    }
+
+    bucket->tokens = MIN(bucket->tokens + (now - bucket->updated) * ud->read_rate /
+                         G_USEC_PER_SEC, ud->read_burst);
+    bucket->updated = now;
+    allowed = bucket->tokens >= 1;
+    if (allowed) {
+        bucket->tokens -= 1;
+        bucket->throttling = FALSE;
     } else {
-      ud->root_interface_id = 0;
-      ud->player_interface_id = 0;
+        if (!bucket->throttling) {
+            g_printerr("Throttling property reads from %s\n", sender);
+            bucket->throttling = TRUE;
+        }
+        bucket->throttled++;
+        ud->reads_throttled++;
+    }
+    g_mutex_unlock(&ud->read_buckets_lock);
+
+    return allowed;
+}
+
+// Answers a read of the player interface with the values clients were
+// last sent, or returns NULL if there is nothing to answer with
+static GDBusMessage *read_snapshot_reply(UserData *ud, GDBusMessage *message)
+{
+    GVariant *body = g_dbus_message_get_body(message);
+    const char *member = g_dbus_message_get_member(message);
+    const char *interface_name = NULL;
+    const char *property_name = NULL;
+    GDBusMessage *reply = NULL;
+
+    if (!ud->read_snapshot || !body) {
+        return NULL;
+    }
+
+    g_mutex_lock(&ud->read_buckets_lock);
+    if (g_strcmp0(member, "Get") == 0 &&
+        g_variant_is_of_type(body, G_VARIANT_TYPE("(ss)"))) {
+        GVariant *value;
+        g_variant_get(body, "(&s&s)", &interface_name, &property_name);
+        value = g_hash_table_lookup(ud->read_snapshot, property_name);
+        if (value && g_strcmp0(interface_name, "org.mpris.MediaPlayer2.Player") == 0) {
+            reply = g_dbus_message_new_method_reply(message);
+            g_dbus_message_set_body(reply, g_variant_new("(v)", value));
+        }
+    } else if (g_strcmp0(member, "GetAll") == 0 &&
+               g_variant_is_of_type(body, G_VARIANT_TYPE("(s)"))) {
+        g_variant_get(body, "(&s)", &interface_name);
+        if (g_strcmp0(interface_name, "org.mpris.MediaPlayer2.Player") == 0) {
+            GVariantBuilder properties;
+            GHashTableIter iter;
+            gpointer name;
+            gpointer value;
+
+            g_variant_builder_init(&properties, G_VARIANT_TYPE("a{sv}"));
+            g_hash_table_iter_init(&iter, ud->read_snapshot);
+            while (g_hash_table_iter_next(&iter, &name, &value)) {
+                g_variant_builder_add(&properties, "{sv}", name, value);
+            }
+            reply = g_dbus_message_new_method_reply(message);
+            g_dbus_message_set_body(reply, g_variant_new("(a{sv})", &properties));
+        }
+    }
+    g_mutex_unlock(&ud->read_buckets_lock);
+
+    return reply;
+}
+
+// Runs in the GDBus worker thread, so that reads over the limit are
+// refused before they are queued behind anything else
+static GDBusMessage *filter_property_reads(GDBusConnection *connection,
+                                           GDBusMessage *message,
+                                           gboolean incoming,
+                                           gpointer user_data)
+{
+    UserData *ud = user_data;
+    const char *member = g_dbus_message_get_member(message);
+
+    if (!incoming ||
+        g_dbus_message_get_message_type(message) != G_DBUS_MESSAGE_TYPE_METHOD_CALL ||
+        g_strcmp0(g_dbus_message_get_path(message), "/org/mpris/MediaPlayer2") != 0 ||
+        g_strcmp0(g_dbus_message_get_interface(message),
+                  "org.freedesktop.DBus.Properties") != 0 ||
+        (g_strcmp0(member, "Get") != 0 && g_strcmp0(member, "GetAll") != 0)) {
+        return message;
+    }
+
+    if (!take_read_token(ud, g_dbus_message_get_sender(message))) {
+        GDBusMessage *reply = read_snapshot_reply(ud, message);
+        if (!reply) {
+            reply = g_dbus_message_new_method_error(message,
+                                                    "org.freedesktop.DBus.Error.LimitsExceeded",
+                                                    "Too many property reads, at most %g per second",
+                                                    ud->read_rate);
+        }
+        g_dbus_connection_send_message(connection, reply, G_DBUS_SEND_MESSAGE_FLAGS_NONE,
+                                       NULL, NULL);
+        g_object_unref(reply);
+        g_object_unref(message);
+        return NULL;
+    }
+
+    return message;
+}
+
+static void on_bus_connected(G_GNUC_UNUSED GObject *source, GAsyncResult *res,
+                             gpointer data)
+{
+    UserData *ud = data;
+    GError *error = NULL;
+    GDBusConnection *connection = g_dbus_connection_new_for_address_finish(res, &error);
+
+    if (!connection) {
+        if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+            g_error_free(error);
+            return;
+        }
+
+        // Without a bus to begin with there is nothing to wait for, unless
+        // direct clients are served
+        if (ud->disconnected_at == 0 && !ud->peer_server) {
+            g_printerr("Failed to connect to the session bus: %s\n", error->message);
+            g_error_free(error);
+            g_main_loop_quit(ud->loop);
+            return;
+        }
+
+        // Only the first failure is worth reporting, the bus is expected
+        // to be missing for a moment while it restarts
+        if (ud->connect_failures++ == 0 && ud->disconnected_at == 0) {
+            g_printerr("Failed to connect to the session bus: %s\n", error->message);
+        } else {
+            g_debug("bus: connecting failed: %s", error->message);
+        }
+        g_error_free(error);
+        schedule_reconnect(ud);
+        return;
+    }
+
+    ud->connect_failures = 0;
+    ud->connection = connection;
+    g_dbus_connection_set_exit_on_close(connection, FALSE);
+    ud->closed_id = g_signal_connect(connection, "closed",
+                                     G_CALLBACK(on_connection_closed), ud);
+    if (ud->read_rate > 0) {
+        g_dbus_connection_add_filter(connection, filter_property_reads, ud, NULL);
+    }
+
+    char *bus_name = build_bus_name(ud->client_name, FALSE);
+    ud->bus_id = g_bus_own_name_on_connection(connection,
+                                              bus_name,
+                                              G_BUS_NAME_OWNER_FLAGS_DO_NOT_QUEUE,
+                                              on_name_acquired,
+                                              on_name_lost,
+                                              ud, NULL);
+    on_bus_acquired(connection, bus_name, ud);
+    g_free(bus_name);
+}
+
+// Uses a private connection instead of the shared session bus singleton,
+// which would take mpv down with it when the bus goes away
+static void bus_connect(UserData *ud)
+{
+    g_dbus_connection_new_for_address(ud->bus_address,
+                                      G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT |
+                                      G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION,
+                                      NULL, ud->connect_cancellable,
+                                      on_bus_connected, ud);
+}
+
+// Finds the session bus without GIO's fallbacks, which may try X11
+// autolaunch on hosts that have no bus. Returns NULL if there is none or
+// it was disabled with mpris-bus-address=none.
+static gchar *find_bus_address(mpv_handle *mpv)
+{
+    char *address = get_script_opt(mpv, "bus-address");
+    const char *env;
+    gchar *path;
+
+    if (address && address[0] != '\0') {
+        if (g_strcmp0(address, "none") == 0) {
+            g_clear_pointer(&address, g_free);
+        }
+        return address;
+    }
+    g_free(address);
+
+    env = g_getenv("DBUS_SESSION_BUS_ADDRESS");
+    if (env && env[0] != '\0') {
+        return g_strdup(env);
     }
+
+    // Where systemd and dbus-broker put the user bus
+    path = g_build_filename(g_get_user_runtime_dir(), "bus", NULL);
+    if (g_file_test(path, G_FILE_TEST_EXISTS)) {
+        gchar *escaped = g_dbus_address_escape_value(path);
+        address = g_strconcat("unix:path=", escaped, NULL);
+        g_free(escaped);
+    }
+    g_free(path);
+
+    return address;
 }
 
 static void handle_property_change(const char *name, void *data, UserData *ud)
@@ -1047,38 +4263,41 @@ static void handle_property_change(const char *name, void *data, UserData *ud)
     GVariant *prop_value = NULL;
     gboolean update_can_go_next_prev = FALSE;
     gboolean update_can_play_pause = FALSE;
+    gboolean state_changed = FALSE;
+    guint status_page_changes = 0;
 
     if (g_strcmp0(name, "pause") == 0) {
         ud->paused = *(int*)data;
         prop_name = "PlaybackStatus";
         prop_value = set_playback_status(ud);
+        state_changed = TRUE;
 
     } else if (g_strcmp0(name, "idle-active") == 0) {
         ud->idle = *(int*)data;
         prop_name = "PlaybackStatus";
         prop_value = set_playback_status(ud);
         update_can_play_pause = TRUE;
+        state_changed = TRUE;
 
     } else if (g_strcmp0(name, "media-title") == 0 ||
                g_strcmp0(name, "duration") == 0) {
-        // Free existing metadata object
-        if (ud->metadata) {
-            g_variant_unref(ud->metadata);
-        }
-        ud->metadata = g_variant_ref_sink(create_metadata(ud));
-        prop_name = "Metadata";
-        prop_value = ud->metadata;
+        update_metadata(ud);
+        status_page_changes = STATUS_PAGE_TRACK;
 
     } else if (g_strcmp0(name, "speed") == 0) {
         double *rate = data;
+        ud->rate = *rate;
         prop_name = "Rate";
         prop_value = g_variant_new_double(*rate);
+        state_changed = TRUE;
 
     } else if (g_strcmp0(name, "volume") == 0) {
         double *volume = data;
         *volume /= 100;
+        ud->volume = *volume;
         prop_name = "Volume";
         prop_value = g_variant_new_double(*volume);
+        status_page_changes = STATUS_PAGE_VOLUME;
 
     } else if (g_strcmp0(name, "loop-file") == 0) {
         char *status = *(char **)data;
@@ -1086,7 +4305,7 @@ static void handle_property_change(const char *name, void *data, UserData *ud)
             ud->loop_status = LOOP_TRACK;
         } else {
             char *playlist_status = NULL;
-            mpv_get_property(ud->mpv, "loop-playlist", MPV_FORMAT_STRING, &playlist_status);
+            read_property(ud, "loop-playlist", MPV_FORMAT_STRING, &playlist_status);
             if (g_strcmp0(playlist_status, "no") != 0) {
                 ud->loop_status = LOOP_PLAYLIST;
             } else {
@@ -1095,7 +4314,7 @@ static void handle_property_change(const char *name, void *data, UserData *ud)
             mpv_free(playlist_status);
         }
         prop_name = "LoopStatus";
-        prop_value = g_variant_new_string(ud->loop_status);
+        prop_value = variant_constant_string(ud->loop_status);
         update_can_go_next_prev = TRUE;
 
     } else if (g_strcmp0(name, "loop-playlist") == 0) {
@@ -1104,7 +4323,7 @@ static void handle_property_change(const char *name, void *data, UserData *ud)
             ud->loop_status = LOOP_PLAYLIST;
         } else {
             char *file_status = NULL;
-            mpv_get_property(ud->mpv, "loop-file", MPV_FORMAT_STRING, &file_status);
+            read_property(ud, "loop-file", MPV_FORMAT_STRING, &file_status);
             if (g_strcmp0(file_status, "no") != 0) {
                 ud->loop_status = LOOP_TRACK;
             } else {
@@ -1113,19 +4332,19 @@ static void handle_property_change(const char *name, void *data, UserData *ud)
             mpv_free(file_status);
         }
         prop_name = "LoopStatus";
-        prop_value = g_variant_new_string(ud->loop_status);
+        prop_value = variant_constant_string(ud->loop_status);
         update_can_go_next_prev = TRUE;
 
     } else if (g_strcmp0(name, "shuffle") == 0) {
         int shuffle = *(int*)data;
         ud->shuffle = shuffle;
         prop_name = "Shuffle";
-        prop_value = g_variant_new_boolean(shuffle);
+        prop_value = variant_boolean(shuffle);
 
     } else if (g_strcmp0(name, "fullscreen") == 0) {
         gboolean *status = data;
         prop_name = "Fullscreen";
-        prop_value = g_variant_new_boolean(*status);
+        prop_value = variant_boolean(*status);
 
     } else if (g_strcmp0(name, "playlist-count") == 0) {
       ud->playlist_count = *(int64_t *)data;
@@ -1138,24 +4357,53 @@ static void handle_property_change(const char *name, void *data, UserData *ud)
 
     if (prop_name) {
         if (prop_value) {
-            g_variant_ref_sink(prop_value);
+            // Interned values are already full references
+            g_variant_take_ref(prop_value);
         }
-        g_hash_table_insert(ud->changed_properties,
-                            (gpointer)prop_name, prop_value);
+        set_changed_property(ud, prop_name, prop_value);
     }
 
     if (update_can_go_next_prev) {
-        g_hash_table_insert(ud->changed_properties, "CanGoNext",
-                            g_variant_ref_sink(g_variant_new_boolean(can_go_next(ud))));
-        g_hash_table_insert(ud->changed_properties, "CanGoPrevious",
-                            g_variant_ref_sink(g_variant_new_boolean(can_go_previous(ud))));
+        set_changed_property(ud, "CanGoNext", variant_boolean(can_go_next(ud)));
+        set_changed_property(ud, "CanGoPrevious", variant_boolean(can_go_previous(ud)));
     }
 
     if (update_can_play_pause) {
-        g_hash_table_insert(ud->changed_properties, "CanPlay",
-                            g_variant_ref_sink(g_variant_new_boolean(can_play_pause(ud))));
-        g_hash_table_insert(ud->changed_properties, "CanPause",
-                            g_variant_ref_sink(g_variant_new_boolean(can_play_pause(ud))));
+        set_changed_property(ud, "CanPlay", variant_boolean(can_play_pause(ud)));
+        set_changed_property(ud, "CanPause", variant_boolean(can_play_pause(ud)));
+    }
+
+    if (state_changed) {
+        update_heartbeat(ud);
+        status_page_changes |= STATUS_PAGE_PLAYBACK;
+    }
+
+    if (status_page_changes) {
+        status_page_update(ud, status_page_changes);
+    }
+}
+
+// Report the value mpv settled on once the last write has been applied,
+// mpv does not notify observers if it was already at that value
+static void handle_property_write_reply(uint64_t reply_id, UserData *ud)
+{
+    PropertyWrite *write;
+    double value;
+
+    if (reply_id == REPLY_VOLUME) {
+        write = &ud->volume_write;
+    } else if (reply_id == REPLY_RATE) {
+        write = &ud->rate_write;
+    } else {
+        return;
+    }
+
+    if (write->pending) {
+        return;
+    }
+
+    if (read_property(ud, write->name, MPV_FORMAT_DOUBLE, &value) >= 0) {
+        handle_property_change(write->name, &value, ud);
     }
 }
 
@@ -1163,13 +4411,19 @@ static gboolean event_handler(int fd, G_GNUC_UNUSED GIOCondition condition, gpoi
 {
     UserData *ud = data;
     gboolean has_event = TRUE;
+    guint batch = 0;
+    eventfd_t unused;
 
-    // Discard data in pipe
-    char unused[16];
-    while (read(fd, unused, sizeof(unused)) > 0);
+    // Any number of wakeups is cleared by a single read
+    eventfd_read(fd, &unused);
 
-    while (has_event) {
+    // Handle a bounded number of events at a time so that D-Bus calls are
+    // not starved while mpv is flooding us with events
+    while (has_event && batch < ud->event_batch_size) {
         mpv_event *event = mpv_wait_event(ud->mpv, 0);
+        if (event->event_id != MPV_EVENT_NONE) {
+            trace_mpv_event(ud, event);
+        }
         switch (event->event_id) {
         case MPV_EVENT_NONE:
             has_event = FALSE;
@@ -1182,18 +4436,58 @@ static gboolean event_handler(int fd, G_GNUC_UNUSED GIOCondition condition, gpoi
             mpv_event_property *prop_event = (mpv_event_property*)event->data;
             handle_property_change(prop_event->name, prop_event->data, ud);
         } break;
+        case MPV_EVENT_SET_PROPERTY_REPLY:
+            handle_property_write_reply(event->reply_userdata, ud);
+            break;
+        case MPV_EVENT_COMMAND_REPLY:
+            if (event->reply_userdata == REPLY_THUMBNAIL) {
+                handle_thumbnail_frame(event, ud);
+            } else if (event->reply_userdata == REPLY_SEEK) {
+                handle_seek_reply(event, ud);
+            } else if (event->reply_userdata >= REPLY_BATCH) {
+                handle_batch_reply(event, ud);
+            }
+            break;
+        case MPV_EVENT_START_FILE:
+            thumbnail_reset(&ud->thumbnailer);
+            ud->thumbnailer.frame_shown = FALSE;
+            break;
         case MPV_EVENT_SEEK:
             ud->seek_expected = TRUE;
             break;
         case MPV_EVENT_PLAYBACK_RESTART: {
+            ud->thumbnailer.frame_shown = TRUE;
+            thumbnail_capture(ud);
+            update_heartbeat(ud);
+            status_page_update(ud, STATUS_PAGE_PLAYBACK);
             if (ud->seek_expected) {
-                emit_seeked_signal(ud);
+                // Only report the final position of a burst of seeks
+                seek_done(ud);
                 ud->seek_expected = FALSE;
             }
          } break;
         default:
             break;
         }
+
+        if (has_event) {
+            batch++;
+        }
+    }
+
+    if (has_event) {
+        // There may be more events waiting, come back for them on the
+        // next main loop iteration
+        eventfd_write(fd, 1);
+        ud->event_batches_full++;
+    }
+
+    ud->event_batches++;
+    ud->events_handled += batch;
+    ud->event_batch_max = MAX(ud->event_batch_max, batch);
+
+    if (ud->trace) {
+        fflush(ud->trace);
     }
 
     return TRUE;
@@ -1201,30 +4495,28 @@ static gboolean event_handler(int fd, G_GNUC_UNUSED GIOCondition condition, gpoi
 
 static void wakeup_handler(void *fd)
 {
-    (void)!write(*((int*)fd), "0", 1);
+    eventfd_write(*((int*)fd), 1);
 }
 
 static void setup_mpv_event_sources(UserData *ud)
 {
-    GError *error = NULL;
-    GSource *mpv_pipe_source;
+    GSource *mpv_wakeup_source;
     GSource *timeout_source;
 
-    g_unix_open_pipe(ud->wakeup_pipe, 0, &error);
-    if (error != NULL) {
-        g_printerr("%s", error->message);
-        g_clear_error(&error);
+    ud->wakeup_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (ud->wakeup_fd < 0) {
+        g_printerr("Failed to create eventfd: %s\n", g_strerror(errno));
+        return;
     }
-    fcntl(ud->wakeup_pipe[0], F_SETFL, O_NONBLOCK);
-    mpv_set_wakeup_callback(ud->mpv, wakeup_handler, &ud->wakeup_pipe[1]);
+    mpv_set_wakeup_callback(ud->mpv, wakeup_handler, &ud->wakeup_fd);
 
-    mpv_pipe_source = g_unix_fd_source_new(ud->wakeup_pipe[0], G_IO_IN);
-    g_source_set_callback(mpv_pipe_source,
+    mpv_wakeup_source = g_unix_fd_source_new(ud->wakeup_fd, G_IO_IN);
+    g_source_set_callback(mpv_wakeup_source,
                           G_SOURCE_FUNC(event_handler),
                           ud,
                           NULL);
-    g_source_attach(mpv_pipe_source, ud->ctx);
-    g_source_unref(mpv_pipe_source);
+    g_source_attach(mpv_wakeup_source, ud->ctx);
+    g_source_unref(mpv_wakeup_source);
 
     timeout_source = g_timeout_source_new(100);
     g_source_set_callback(timeout_source,
@@ -1243,6 +4535,15 @@ int mpv_open_cplugin(mpv_handle *mpv)
     UserData ud = {0};
     GError *error = NULL;
     GDBusNodeInfo *introspection_data = NULL;
+    gchar *bus_address = find_bus_address(mpv);
+    char *p2p_socket = get_script_opt(mpv, "p2p-socket");
+    gboolean serve_peers = p2p_socket && p2p_socket[0] != '\0';
+
+    g_free(p2p_socket);
+    if (!bus_address && !serve_peers) {
+        // Nobody could reach us, don't keep a thread around for nothing
+        return 0;
+    }
 
     ctx = g_main_context_new();
     loop = g_main_loop_new(ctx, FALSE);
@@ -1257,36 +4558,89 @@ int mpv_open_cplugin(mpv_handle *mpv)
         g_dbus_node_info_lookup_interface(introspection_data, "org.mpris.MediaPlayer2");
     ud.player_interface_info =
         g_dbus_node_info_lookup_interface(introspection_data, "org.mpris.MediaPlayer2.Player");
+    ud.ext_interface_info =
+        g_dbus_node_info_lookup_interface(introspection_data, "io.mpv.Mpris");
 
     ud.mpv = mpv;
+    ud.bus_address = bus_address;
     ud.loop = loop;
     ud.ctx = ctx;
     ud.status = STATUS_STOPPED;
     ud.loop_status = LOOP_NONE;
-    ud.changed_properties = g_hash_table_new_full(g_str_hash, g_str_equal,
-                                                  NULL,
-                                                  (GDestroyNotify)g_variant_unref);
+    ud.batches = g_hash_table_new_full(g_int64_hash, g_int64_equal, g_free, NULL);
+    ud.enqueues = g_hash_table_new_full(g_int64_hash, g_int64_equal, g_free, NULL);
+    ud.next_batch_reply = REPLY_BATCH;
+    ud.changed_properties = g_array_sized_new(FALSE, FALSE, sizeof(ChangedProperty), 16);
     ud.seek_expected = FALSE;
     ud.idle = FALSE;
     ud.paused = FALSE;
     ud.shuffle = FALSE;
+    ud.rate = 1.0;
     char *client_name = mpv_get_property_string(mpv, "audio-client-name");
     ud.client_name = g_strdup(client_name);
     mpv_free(client_name);
     mpv_get_property(mpv, "playlist-count", MPV_FORMAT_INT64, &ud.playlist_count);
     mpv_get_property(mpv, "playlist-pos", MPV_FORMAT_INT64, &ud.playlist_pos);
-
-    char *bus_name = build_bus_name(ud.client_name, FALSE);
+    ud.seek_window_ms = get_script_opt_int(mpv, "seek-coalesce-ms", 100);
+    ud.seek_burst_flag = SEEK_KEYFRAMES;
+    char *seek_mode = get_script_opt(mpv, "seek-burst-mode");
+    if (g_strcmp0(seek_mode, SEEK_EXACT) == 0) {
+        ud.seek_burst_flag = SEEK_EXACT;
+    } else if (seek_mode && g_strcmp0(seek_mode, SEEK_KEYFRAMES) != 0) {
+        g_printerr("Invalid value for mpris-seek-burst-mode: %s\n", seek_mode);
+    }
+    g_free(seek_mode);
+    ud.wakeup_fd = -1;
+    ud.extensions = get_script_opt_bool(mpv, "extensions", FALSE);
+    ud.metadata_scratch = g_string_sized_new(256);
+    ud.lazy_metadata = get_script_opt_bool(mpv, "lazy-metadata", FALSE);
+    ud.event_batch_size = MAX(get_script_opt_int(mpv, "event-batch-size", 64), 1);
+    ud.write_interval_ms = get_script_opt_int(mpv, "write-interval-ms", 50);
+    ud.heartbeat_ms = get_script_opt_int(mpv, "heartbeat-ms", 0);
+    g_mutex_init(&ud.read_buckets_lock);
+    ud.read_buckets = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    ud.read_rate = get_script_opt_int(mpv, "read-rate", 0);
+    ud.read_burst = MAX(get_script_opt_int(mpv, "read-burst", 100), 1);
+    char *read_excess = get_script_opt(mpv, "read-excess");
+    if (g_strcmp0(read_excess, "snapshot") == 0) {
+        ud.read_snapshot = g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+                                                 (GDestroyNotify)g_variant_unref);
+    } else if (read_excess && g_strcmp0(read_excess, "reject") != 0) {
+        g_printerr("Invalid value for mpris-read-excess: %s\n", read_excess);
+    }
+    g_free(read_excess);
+    char *open_uri_mode = get_script_opt(mpv, "open-uri-mode");
+    if (g_strcmp0(open_uri_mode, "append") == 0) {
+        ud.open_uri_append = TRUE;
+    } else if (open_uri_mode && g_strcmp0(open_uri_mode, "replace") != 0) {
+        g_printerr("Invalid value for mpris-open-uri-mode: %s\n", open_uri_mode);
+    }
+    g_free(open_uri_mode);
+    if (get_script_opt_bool(mpv, "prefetch", FALSE)) {
+        // Opens and buffers the next entry before the current one ends
+        int prefetch = TRUE;
+        mpv_set_property(mpv, "prefetch-playlist", MPV_FORMAT_FLAG, &prefetch);
+    }
+    trace_open(&ud);
+    ud.volume_write = (PropertyWrite){&ud, "volume", REPLY_VOLUME, 0, FALSE, FALSE};
+    ud.rate_write = (PropertyWrite){&ud, "speed", REPLY_RATE, 0, FALSE, FALSE};
+    ud.signal_queue_max_bytes = get_script_opt_int(mpv, "signal-queue-size", 4 * 1024 * 1024);
+    ud.signal_queue_max_count = get_script_opt_int(mpv, "signal-queue-count", 256);
+    art_policy_init(&ud.art_policy, mpv);
+    thumbnailer_init(&ud.thumbnailer, &ud);
+    art_cache_init(&ud.art_cache,
+                   get_script_opt_int(mpv, "art-cache-size", 16 * 1024 * 1024),
+                   ud.extensions);
+
+    // Async GIO operations complete in the thread-default context
     g_main_context_push_thread_default(ctx);
-    ud.bus_id = g_bus_own_name(G_BUS_TYPE_SESSION,
-                               bus_name,
-                               G_BUS_NAME_OWNER_FLAGS_DO_NOT_QUEUE,
-                               on_bus_acquired,
-                               NULL,
-                               on_name_lost,
-                               &ud, NULL);
-    g_main_context_pop_thread_default(ctx);
-    g_free(bus_name);
+    ud.connect_cancellable = g_cancellable_new();
+    ud.reconnect_delay_ms = RECONNECT_MIN_MS;
+    status_page_open(&ud);
+    peer_server_start(&ud);
+    if (ud.bus_address) {
+        bus_connect(&ud);
+    }
 
     // Receive event for property changes
     mpv_observe_property(mpv, 0, "pause", MPV_FORMAT_FLAG);
@@ -1302,26 +4656,92 @@ int mpv_open_cplugin(mpv_handle *mpv)
     mpv_observe_property(mpv, 0, "playlist-count", MPV_FORMAT_INT64);
     mpv_observe_property(mpv, 0, "playlist-pos", MPV_FORMAT_INT64);
 
-    g_main_loop_run(loop);
+    // Nothing to serve if listening for direct clients failed
+    if (ud.bus_address || ud.peer_server) {
+        g_main_loop_run(loop);
+    }
+    thumbnailer_clear(&ud.thumbnailer);
+    batch_abort_all(&ud);
+    g_main_context_pop_thread_default(ctx);
+
+    if (ud.seek_window) {
+        g_source_destroy(ud.seek_window);
+        g_source_unref(ud.seek_window);
+    }
+    if (ud.heartbeat) {
+        g_source_destroy(ud.heartbeat);
+        g_source_unref(ud.heartbeat);
+    }
+
+    if (ud.wakeup_fd >= 0) {
+        mpv_set_wakeup_callback(mpv, NULL, NULL);
+        close(ud.wakeup_fd);
+    }
 
+    peer_server_stop(&ud);
+    g_cancellable_cancel(ud.connect_cancellable);
+    g_object_unref(ud.connect_cancellable);
+    if (ud.reconnect) {
+        g_source_destroy(ud.reconnect);
+        g_source_unref(ud.reconnect);
+    }
     if (ud.connection) {
-        g_dbus_connection_unregister_object(ud.connection, ud.root_interface_id);
-        g_dbus_connection_unregister_object(ud.connection, ud.player_interface_id);
+        // Deliver the last signals before the connection goes away, and
+        // make sure the filter isn't running in the worker thread anymore
+        g_dbus_connection_flush_sync(ud.connection, NULL, NULL);
+        g_dbus_connection_close_sync(ud.connection, NULL, NULL);
     }
+    bus_disconnect(&ud);
+    status_page_close(&ud);
 
     if (ud.metadata) {
         g_variant_unref(ud.metadata);
     }
-    g_hash_table_unref(ud.changed_properties);
+    clear_changed_properties(&ud);
+    g_array_unref(ud.changed_properties);
+    g_hash_table_unref(ud.batches);
+    g_hash_table_unref(ud.enqueues);
 
-    g_bus_unown_name(ud.bus_id);
     g_main_loop_unref(loop);
     g_main_context_unref(ctx);
     g_dbus_node_info_unref(introspection_data);
 
+    g_debug("events: %" G_GUINT64_FORMAT " in %" G_GUINT64_FORMAT " batches, "
+            "largest %u, %" G_GUINT64_FORMAT " batches hit the limit of %u",
+            ud.events_handled, ud.event_batches, ud.event_batch_max,
+            ud.event_batches_full, ud.event_batch_size);
+    g_debug("signals: %" G_GUINT64_FORMAT " times coalesced while the bus was slow",
+            ud.signals_coalesced);
+    g_debug("bus: reconnected %" G_GUINT64_FORMAT " times", ud.reconnects);
+    // Shown without G_MESSAGES_DEBUG, a throttled client is worth knowing about
+    if (ud.reads_throttled > 0) {
+        g_printerr("Throttled %" G_GUINT64_FORMAT " property reads\n", ud.reads_throttled);
+    }
+    GHashTableIter buckets;
+    gpointer sender, bucket;
+    g_hash_table_iter_init(&buckets, ud.read_buckets);
+    while (g_hash_table_iter_next(&buckets, &sender, &bucket)) {
+        if (((ReadBucket*)bucket)->throttled > 0) {
+            g_printerr("Throttled %" G_GUINT64_FORMAT " property reads from %s\n",
+                       ((ReadBucket*)bucket)->throttled, (const char*)sender);
+        }
+    }
+    g_hash_table_unref(ud.read_buckets);
+    g_clear_pointer(&ud.read_snapshot, g_hash_table_unref);
+    g_mutex_clear(&ud.read_buckets_lock);
+    g_debug("art cache: %" G_GUINT64_FORMAT " hits, %" G_GUINT64_FORMAT " misses, %"
+            G_GSIZE_FORMAT " of %" G_GSIZE_FORMAT " bytes used",
+            ud.art_cache.hits, ud.art_cache.misses,
+            ud.art_cache.size, ud.art_cache.budget);
+    if (ud.trace) {
+        fclose(ud.trace);
+    }
+    art_blob_release(&ud.art_cache, ud.current_art);
+    art_cache_clear(&ud.art_cache);
+    g_string_free(ud.metadata_scratch, TRUE);
+
     g_free(ud.client_name);
-    g_free(ud.cached_path);
-    g_free(ud.cached_art_url);
+    g_free(ud.bus_address);
 
     return 0;
 }
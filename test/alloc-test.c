@@ -0,0 +1,246 @@
+// Checks that handling the property changes mpv reports all the time
+// doesn't allocate once the plugin has warmed up, that sending them
+// allocates the same for every signal, and that building Metadata
+// allocates no more than reading the tags and making the variant. Built
+// like replay, against a stub mpv, with malloc counting what the test
+// thread allocates.
+// Also has the checks of the property change path that need control over
+// timing the bus can't give, like keeping the signal queue full.
+#include "../mpris.c"
+#include "stub-mpv.h"
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+// Other threads, e.g. GLib's workers, may allocate whenever they like
+static __thread gboolean counting;
+static __thread guint64 allocations;
+
+void *malloc(size_t size)
+{
+    if (counting) {
+        allocations++;
+    }
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size)
+{
+    if (counting) {
+        allocations++;
+    }
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    if (counting) {
+        allocations++;
+    }
+    return __libc_realloc(ptr, size);
+}
+
+static void user_data_init(UserData *ud)
+{
+    memset(ud, 0, sizeof(*ud));
+    ud->mpv = stub_mpv_new();
+    ud->status = STATUS_STOPPED;
+    ud->loop_status = LOOP_NONE;
+    ud->changed_properties = g_array_sized_new(FALSE, FALSE, sizeof(ChangedProperty), 16);
+    ud->metadata_scratch = g_string_sized_new(256);
+}
+
+static void user_data_clear(UserData *ud)
+{
+    clear_changed_properties(ud);
+    g_array_unref(ud->changed_properties);
+    g_string_free(ud->metadata_scratch, TRUE);
+    stub_mpv_free(ud->mpv);
+}
+
+// Every value alternates, so each call is a real change
+static void handle_changes(UserData *ud, int round)
+{
+    int flag = round % 2;
+    int64_t playlist_pos = round % 2;
+    int64_t playlist_count = 2 + round % 2;
+    // Anything but "no" is handled without asking mpv
+    char *loop = "inf";
+
+    handle_property_change("pause", &flag, ud);
+    handle_property_change("idle-active", &flag, ud);
+    handle_property_change("shuffle", &flag, ud);
+    handle_property_change("fullscreen", &flag, ud);
+    handle_property_change("playlist-pos", &playlist_pos, ud);
+    handle_property_change("playlist-count", &playlist_count, ud);
+    handle_property_change(round % 2 ? "loop-file" : "loop-playlist", &loop, ud);
+}
+
+// Building PropertiesChanged can't avoid what GVariant allocates for the
+// message body, but that must be all: the same for every signal with the
+// same properties, however many changes came before. Without a bus,
+// emit_signal() stops short of g_dbus_connection_emit_signal().
+static void test_property_change(void)
+{
+    UserData ud;
+    double speed = 1.5;
+    // Every other round changes the same properties
+    guint64 per_signal[2] = {0, 0};
+
+    user_data_init(&ud);
+
+    // Makes the interned variants and the changed property slots
+    for (int round = 0; round < 4; round++) {
+        handle_changes(&ud, round);
+        send_property_changes(&ud);
+    }
+
+    for (int round = 0; round < 100; round++) {
+        counting = TRUE;
+        handle_changes(&ud, round);
+        counting = FALSE;
+        g_assert_cmpuint(allocations, ==, 0);
+
+        counting = TRUE;
+        send_property_changes(&ud);
+        counting = FALSE;
+        g_assert_cmpuint(ud.changed_properties->len, ==, 0);
+        if (round < 2) {
+            per_signal[round] = allocations;
+        } else {
+            g_assert_cmpuint(allocations, ==, per_signal[round % 2]);
+        }
+        allocations = 0;
+    }
+
+    // Doubles can't be interned, this also shows that counting works
+    counting = TRUE;
+    handle_property_change("speed", &speed, &ud);
+    counting = FALSE;
+    g_assert_cmpuint(allocations, >, 0);
+
+    user_data_clear(&ud);
+}
+
+static void set_tags(mpv_handle *mpv)
+{
+    stub_mpv_set(mpv, "media-title", g_variant_new_string("Title"));
+    stub_mpv_set(mpv, "metadata/by-key/Album", g_variant_new_string("Album"));
+    stub_mpv_set(mpv, "metadata/by-key/Genre", g_variant_new_string("Genre"));
+    stub_mpv_set(mpv, "metadata/by-key/Artist", g_variant_new_string("Artist One, Artist Two"));
+}
+
+static guint64 count_create_metadata(UserData *ud)
+{
+    GVariant *metadata;
+    guint64 before = allocations;
+
+    counting = TRUE;
+    metadata = create_metadata(ud);
+    counting = FALSE;
+    g_variant_unref(g_variant_ref_sink(metadata));
+
+    return allocations - before;
+}
+
+// What building the same Metadata can't do without: reading each tag from
+// mpv and putting it into the dictionary as is
+static guint64 count_minimum_metadata(mpv_handle *mpv)
+{
+    static const char *const tags[][2] = {
+        {"media-title", "xesam:title"},
+        {"metadata/by-key/Album", "xesam:album"},
+        {"metadata/by-key/Genre", "xesam:genre"},
+    };
+    guint64 before = allocations;
+    GVariantDict dict;
+    GVariantBuilder builder;
+    GVariant *metadata;
+    char *value;
+
+    counting = TRUE;
+    g_variant_dict_init(&dict, NULL);
+    g_variant_dict_insert(&dict, "mpris:trackid", "o", NO_TRACK_ID);
+    for (gsize i = 0; i < G_N_ELEMENTS(tags); i++) {
+        value = mpv_get_property_string(mpv, tags[i][0]);
+        g_variant_dict_insert(&dict, tags[i][1], "s", value);
+        mpv_free(value);
+    }
+    value = mpv_get_property_string(mpv, "metadata/by-key/Artist");
+    g_variant_builder_init(&builder, G_VARIANT_TYPE("as"));
+    g_variant_builder_add(&builder, "s", "Artist One");
+    g_variant_builder_add(&builder, "s", "Artist Two");
+    g_variant_dict_insert(&dict, "xesam:artist", "as", &builder);
+    mpv_free(value);
+    metadata = g_variant_dict_end(&dict);
+    counting = FALSE;
+    g_variant_unref(g_variant_ref_sink(metadata));
+
+    return allocations - before;
+}
+
+// Plain ASCII tags go from mpv's string into the variant without a copy
+static void test_create_metadata(void)
+{
+    UserData ud;
+    guint64 minimum;
+
+    user_data_init(&ud);
+    ud.playlist_pos = -1;
+    set_tags(ud.mpv);
+
+    // Warms up the same caches for both
+    count_create_metadata(&ud);
+    count_minimum_metadata(ud.mpv);
+
+    minimum = count_minimum_metadata(ud.mpv);
+    g_assert_cmpuint(minimum, >, 0);
+    g_assert_cmpuint(count_create_metadata(&ud), ==, minimum);
+
+    user_data_clear(&ud);
+}
+
+// A bus that isn't keeping up can't be made on demand, so the queue is
+// filled by hand: one signal still being written with room for only one
+static void test_signal_queue_full(void)
+{
+    UserData ud;
+    ChangedProperty *changed;
+
+    user_data_init(&ud);
+    ud.signal_queue_max_bytes = 4096;
+    ud.signal_queue_max_count = 1;
+    ud.signal_queue_count = 1;
+
+    // Changes are merged while waiting, the newest value wins
+    for (int round = 1; round <= 10; round++) {
+        double volume = round * 10;
+        handle_property_change("volume", &volume, &ud);
+        emit_property_changes(&ud);
+    }
+    g_assert_cmpuint(ud.signals_coalesced, ==, 10);
+    g_assert_cmpuint(ud.changed_properties->len, ==, 1);
+    changed = &g_array_index(ud.changed_properties, ChangedProperty, 0);
+    g_assert_cmpstr(changed->name, ==, "Volume");
+    g_assert_cmpfloat(g_variant_get_double(changed->value), ==, 1.0);
+
+    // and sent as one signal once there is room
+    ud.signal_queue_count = 0;
+    emit_property_changes(&ud);
+    g_assert_cmpuint(ud.signals_coalesced, ==, 10);
+    g_assert_cmpuint(ud.changed_properties->len, ==, 0);
+
+    user_data_clear(&ud);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/alloc/property-change", test_property_change);
+    g_test_add_func("/alloc/create-metadata", test_create_metadata);
+    g_test_add_func("/signals/queue-full", test_signal_queue_full);
+
+    return g_test_run();
+}
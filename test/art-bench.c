@@ -0,0 +1,375 @@
+// Measures what each cover art source costs on a library made by
+// gen-art-corpus. Every lookup is timed and reports the system calls it
+// made and how much it raised the peak RSS, once with the corpus dropped
+// from the page cache (cold) and once right after the same lookup (warm).
+// Built like replay, so it runs the plugin's own lookup functions against
+// a stub mpv.
+#include "../mpris.c"
+#include "stub-mpv.h"
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+typedef struct Sample
+{
+    gint64 time_us;
+    gint64 syscalls; // -1 if they can't be counted
+    gint64 peak_kib;
+} Sample;
+
+typedef struct Bench
+{
+    mpv_handle *mpv;
+    int syscall_counter;
+    gint64 syscall_overhead;
+    gint64 start;
+    gint64 rss_kib;
+    gboolean verbose;
+} Bench;
+
+enum {
+    CACHE_COLD,
+    CACHE_WARM,
+    CACHE_COUNT,
+};
+
+static const char *cache_names[CACHE_COUNT] = {"cold", "warm"};
+
+// Same as mpv's defaults
+static const char *image_exts =
+    "avif,bmp,gif,j2k,jp2,jpeg,jpg,jxl,png,svg,tga,tif,tiff,webp";
+static const char *cover_art_whitelist =
+    "AlbumArt,Album,cover,front,AlbumArtSmall,Folder,.folder,thumb";
+
+// Counts the raw_syscalls:sys_enter tracepoint for this thread. Needs
+// kernel.perf_event_paranoid=-1 or CAP_PERFMON.
+static int syscall_counter_open(void)
+{
+    const char *paths[] = {
+        "/sys/kernel/tracing/events/raw_syscalls/sys_enter/id",
+        "/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id",
+    };
+    struct perf_event_attr attr;
+    gchar *contents = NULL;
+
+    for (guint i = 0; i < G_N_ELEMENTS(paths) && !contents; i++) {
+        g_file_get_contents(paths[i], &contents, NULL, NULL);
+    }
+    if (!contents) {
+        return -1;
+    }
+
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_TRACEPOINT;
+    attr.size = sizeof(attr);
+    attr.config = g_ascii_strtoull(contents, NULL, 10);
+    attr.disabled = 1;
+    attr.exclude_hv = 1;
+    g_free(contents);
+
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+}
+
+static gint64 read_status_kib(const char *field)
+{
+    gchar *contents;
+    const char *line;
+    gint64 value = 0;
+
+    if (!g_file_get_contents("/proc/self/status", &contents, NULL, NULL)) {
+        return 0;
+    }
+    line = strstr(contents, field);
+    if (line) {
+        value = g_ascii_strtoll(line + strlen(field), NULL, 10);
+    }
+    g_free(contents);
+    return value;
+}
+
+// Lets VmHWM start over from the current RSS
+static void reset_peak_rss(void)
+{
+    FILE *clear_refs = fopen("/proc/self/clear_refs", "w");
+    if (clear_refs) {
+        fputs("5", clear_refs);
+        fclose(clear_refs);
+    }
+}
+
+static void measure_begin(Bench *bench)
+{
+    reset_peak_rss();
+    bench->rss_kib = read_status_kib("VmRSS:");
+    if (bench->syscall_counter >= 0) {
+        ioctl(bench->syscall_counter, PERF_EVENT_IOC_RESET, 0);
+        ioctl(bench->syscall_counter, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    bench->start = g_get_monotonic_time();
+}
+
+static Sample measure_end(Bench *bench)
+{
+    Sample sample;
+    guint64 count = 0;
+
+    sample.time_us = g_get_monotonic_time() - bench->start;
+    sample.syscalls = -1;
+    if (bench->syscall_counter >= 0) {
+        ioctl(bench->syscall_counter, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(bench->syscall_counter, &count, sizeof(count)) == sizeof(count)) {
+            sample.syscalls = MAX((gint64)count - bench->syscall_overhead, 0);
+        }
+    }
+    sample.peak_kib = MAX(read_status_kib("VmHWM:") - bench->rss_kib, 0);
+    return sample;
+}
+
+// Drops the track and everything next to it from the page cache. Dentries
+// and inodes stay cached, dropping those needs root.
+static void drop_page_cache(const char *path)
+{
+    gchar *dirname = g_path_get_dirname(path);
+    GDir *dir = g_dir_open(dirname, 0, NULL);
+    const char *name;
+
+    while (dir && (name = g_dir_read_name(dir))) {
+        gchar *file = g_build_filename(dirname, name, NULL);
+        int fd = open(file, O_RDONLY | O_CLOEXEC);
+        if (fd >= 0) {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+            close(fd);
+        }
+        g_free(file);
+    }
+
+    if (dir) {
+        g_dir_close(dir);
+    }
+    g_free(dirname);
+}
+
+// Returns whether art was found, and its size if it is known
+static gboolean lookup(Bench *bench, ArtSource source, char *path, gsize *size)
+{
+    gchar *url = NULL;
+    GBytes *data = NULL;
+    const char *mime = NULL;
+
+    *size = 0;
+    switch (source) {
+    case ART_SOURCE_COVER_ART_FILES:
+        url = try_get_cover_art_file(bench->mpv);
+        break;
+    case ART_SOURCE_YOUTUBE:
+        url = try_get_youtube_thumbnail(path);
+        break;
+    case ART_SOURCE_EMBEDDED:
+        data = try_get_embedded_art(path, &mime, G_MAXINT64, NULL);
+        break;
+    case ART_SOURCE_FOLDER:
+        url = try_get_folder_art(bench->mpv, path, G_MAXINT64, NULL);
+        break;
+    default:
+        break;
+    }
+
+    if (data) {
+        *size = g_bytes_get_size(data);
+        g_bytes_unref(data);
+        return TRUE;
+    }
+    if (url) {
+        g_free(url);
+        return TRUE;
+    }
+    return FALSE;
+}
+
+// mpv only knows about cover-art-files it was told about, so pretend the
+// user listed the cover next to each track
+static void set_cover_art_files(Bench *bench, const char *path)
+{
+    gchar *dirname = g_path_get_dirname(path);
+    gchar *cover = g_build_filename(dirname, "cover.jpg", NULL);
+
+    stub_mpv_set(bench->mpv, "cover-art-files",
+                 g_variant_new_string(g_file_test(cover, G_FILE_TEST_EXISTS) ? cover : ""));
+    g_free(cover);
+    g_free(dirname);
+}
+
+static int compare_int64(gconstpointer a, gconstpointer b)
+{
+    gint64 x = *(const gint64*)a;
+    gint64 y = *(const gint64*)b;
+    return (x > y) - (x < y);
+}
+
+static void report(ArtSource source, int cache, GArray *samples, guint found)
+{
+    GArray *times = g_array_sized_new(FALSE, FALSE, sizeof(gint64), samples->len);
+    gint64 total_us = 0;
+    gint64 syscalls = 0;
+    gint64 peak_kib = 0;
+    gboolean counted = TRUE;
+    gchar *syscalls_column;
+
+    for (guint i = 0; i < samples->len; i++) {
+        Sample *sample = &g_array_index(samples, Sample, i);
+        g_array_append_val(times, sample->time_us);
+        total_us += sample->time_us;
+        counted = counted && sample->syscalls >= 0;
+        syscalls += sample->syscalls;
+        peak_kib = MAX(peak_kib, sample->peak_kib);
+    }
+    g_array_sort(times, compare_int64);
+
+    syscalls_column = counted ? g_strdup_printf("%.1f", (double)syscalls / samples->len)
+                              : g_strdup("-");
+    g_print("%-16s %-5s %7u %6u %9.1f %9" G_GINT64_FORMAT " %9" G_GINT64_FORMAT
+            " %9s %9" G_GINT64_FORMAT "\n",
+            art_source_names[source], cache_names[cache], samples->len, found,
+            (double)total_us / samples->len,
+            g_array_index(times, gint64, times->len / 2),
+            g_array_index(times, gint64, times->len - 1),
+            syscalls_column, peak_kib);
+
+    g_free(syscalls_column);
+    g_array_unref(times);
+}
+
+static void run(Bench *bench, ArtSource source, gchar **paths, guint runs)
+{
+    for (int cache = 0; cache < CACHE_COUNT; cache++) {
+        GArray *samples = g_array_new(FALSE, FALSE, sizeof(Sample));
+        guint found = 0;
+
+        for (guint i = 0; i < runs; i++) {
+            for (gchar **path = paths; *path; path++) {
+                Sample sample;
+                gboolean hit;
+                gsize size;
+
+                if (source == ART_SOURCE_COVER_ART_FILES) {
+                    set_cover_art_files(bench, *path);
+                }
+                if (cache == CACHE_COLD) {
+                    drop_page_cache(*path);
+                } else {
+                    lookup(bench, source, *path, &size);
+                }
+
+                measure_begin(bench);
+                hit = lookup(bench, source, *path, &size);
+                sample = measure_end(bench);
+
+                g_array_append_val(samples, sample);
+                found += hit;
+                if (bench->verbose) {
+                    g_print("%s %s %" G_GINT64_FORMAT "us %" G_GINT64_FORMAT
+                            " syscalls %" G_GINT64_FORMAT "KiB %s %" G_GSIZE_FORMAT
+                            " %s\n",
+                            art_source_names[source], cache_names[cache],
+                            sample.time_us, sample.syscalls, sample.peak_kib,
+                            hit ? "found" : "none", size, *path);
+                }
+            }
+        }
+
+        report(source, cache, samples, found);
+        g_array_unref(samples);
+    }
+}
+
+static gchar **read_lines(const char *dir, const char *name)
+{
+    gchar *path = g_build_filename(dir, name, NULL);
+    gchar *contents = NULL;
+    gchar **lines;
+    GError *error = NULL;
+
+    if (!g_file_get_contents(path, &contents, NULL, &error)) {
+        g_printerr("%s\n", error->message);
+        g_error_free(error);
+        g_free(path);
+        return NULL;
+    }
+    g_strchomp(contents);
+    lines = g_strsplit(contents, "\n", -1);
+    g_free(contents);
+    g_free(path);
+    return lines;
+}
+
+int main(int argc, char **argv)
+{
+    gint runs = 3;
+    gboolean verbose = FALSE;
+    GOptionEntry entries[] = {
+        {"runs", 'n', 0, G_OPTION_ARG_INT, &runs,
+         "Look up the art of each file N times for each cache state", "N"},
+        {"verbose", 'v', 0, G_OPTION_ARG_NONE, &verbose,
+         "Print every lookup", NULL},
+        {NULL, 0, 0, 0, NULL, NULL, NULL},
+    };
+    GOptionContext *options = g_option_context_new("CORPUS");
+    GError *error = NULL;
+    Bench bench = {0};
+    gchar **files;
+    gchar **urls;
+    gchar **streams;
+    gchar *working_directory;
+
+    g_option_context_add_main_entries(options, entries, NULL);
+    if (!g_option_context_parse(options, &argc, &argv, &error) || argc != 2 || runs < 1) {
+        g_printerr("%s\n", error ? error->message : "Expected one corpus directory");
+        return 2;
+    }
+    g_option_context_free(options);
+
+    files = read_lines(argv[1], "files.txt");
+    urls = read_lines(argv[1], "urls.txt");
+    if (!files || !urls) {
+        return 1;
+    }
+    // Local files are what the YouTube source sees most of the time
+    streams = g_new0(gchar*, g_strv_length(files) + g_strv_length(urls) + 1);
+    memcpy(streams, urls, g_strv_length(urls) * sizeof(gchar*));
+    memcpy(streams + g_strv_length(urls), files, g_strv_length(files) * sizeof(gchar*));
+
+    av_log_set_level(AV_LOG_QUIET);
+    bench.mpv = stub_mpv_new();
+    bench.verbose = verbose;
+    working_directory = g_get_current_dir();
+    stub_mpv_set(bench.mpv, "working-directory", g_variant_new_string(working_directory));
+    stub_mpv_set(bench.mpv, "image-exts", g_variant_new_string(image_exts));
+    stub_mpv_set(bench.mpv, "cover-art-whitelist", g_variant_new_string(cover_art_whitelist));
+
+    bench.syscall_counter = syscall_counter_open();
+    if (bench.syscall_counter >= 0) {
+        // What enabling and disabling the counter adds by itself
+        measure_begin(&bench);
+        bench.syscall_overhead = measure_end(&bench).syscalls;
+    } else {
+        g_print("Not counting system calls, they need kernel.perf_event_paranoid=-1\n");
+    }
+
+    g_print("%-16s %-5s %7s %6s %9s %9s %9s %9s %9s\n", "source", "cache", "lookups",
+            "found", "mean us", "p50 us", "max us", "syscalls", "peak KiB");
+    run(&bench, ART_SOURCE_COVER_ART_FILES, files, runs);
+    run(&bench, ART_SOURCE_EMBEDDED, files, runs);
+    run(&bench, ART_SOURCE_FOLDER, files, runs);
+    run(&bench, ART_SOURCE_YOUTUBE, streams, runs);
+
+    if (bench.syscall_counter >= 0) {
+        close(bench.syscall_counter);
+    }
+    stub_mpv_free(bench.mpv);
+    g_free(working_directory);
+    g_free(streams);
+    g_strfreev(urls);
+    g_strfreev(files);
+    return 0;
+}
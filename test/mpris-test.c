@@ -0,0 +1,1842 @@
+// For clock_gettime and mmap in strict C99
+#define _GNU_SOURCE
+
+#include <gio/gio.h>
+#include <gio/gunixfdlist.h>
+#include <gio/gunixsocketaddress.h>
+#include <glib/gstdio.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <utime.h>
+
+#include "../mpris-status.h"
+
+#define MPRIS_PATH "/org/mpris/MediaPlayer2"
+#define ROOT_IFACE "org.mpris.MediaPlayer2"
+#define PLAYER_IFACE "org.mpris.MediaPlayer2.Player"
+#define PROPERTIES_IFACE "org.freedesktop.DBus.Properties"
+#define EXT_IFACE "io.mpv.Mpris"
+
+#define TIMEOUT_MS 5000
+
+typedef struct Player
+{
+    GSubprocess *mpv;
+    gboolean exited;
+    GDBusConnection *bus;
+    gchar *client_name;
+    gchar *bus_name;
+    gchar *owner;
+    guint properties_changed_id;
+    guint seeked_id;
+    // Newest value of each property seen in PropertiesChanged
+    GHashTable *changed;
+    guint seeked_count;
+    gint64 seeked_position;
+    guint metadata_invalidated;
+} Player;
+
+static const char *plugin;
+static const char *log_dir;
+static const char *play_file;
+static gchar *play_path;
+static gchar *play_uri;
+static Player *shared_player;
+
+static gboolean deadline_reached(gpointer data)
+{
+    *(gboolean*)data = TRUE;
+    return G_SOURCE_REMOVE;
+}
+
+typedef gboolean (*Condition)(Player *player, gconstpointer data);
+
+// Runs the main loop until the condition holds, without polling
+static gboolean wait_for(Player *player, Condition condition, gconstpointer data)
+{
+    gboolean timed_out = FALSE;
+    GSource *timeout = g_timeout_source_new(TIMEOUT_MS);
+    g_source_set_callback(timeout, deadline_reached, &timed_out, NULL);
+    g_source_attach(timeout, NULL);
+
+    while (!condition(player, data) && !timed_out) {
+        g_main_context_iteration(NULL, TRUE);
+    }
+
+    g_source_destroy(timeout);
+    g_source_unref(timeout);
+    return !timed_out;
+}
+
+static void on_properties_changed(G_GNUC_UNUSED GDBusConnection *connection,
+                                  G_GNUC_UNUSED const char *sender,
+                                  G_GNUC_UNUSED const char *object_path,
+                                  G_GNUC_UNUSED const char *interface_name,
+                                  G_GNUC_UNUSED const char *signal_name,
+                                  GVariant *parameters,
+                                  gpointer user_data)
+{
+    Player *player = user_data;
+    GVariantIter *changed;
+    GVariantIter *invalidated;
+    const char *name;
+    GVariant *value;
+
+    g_variant_get(parameters, "(&sa{sv}as)", NULL, &changed, &invalidated);
+    while (g_variant_iter_next(changed, "{&sv}", &name, &value)) {
+        g_hash_table_insert(player->changed, g_strdup(name), value);
+    }
+    while (g_variant_iter_next(invalidated, "&s", &name)) {
+        g_hash_table_remove(player->changed, name);
+        if (g_strcmp0(name, "Metadata") == 0) {
+            player->metadata_invalidated++;
+        }
+    }
+    g_variant_iter_free(changed);
+    g_variant_iter_free(invalidated);
+}
+
+static void on_seeked(G_GNUC_UNUSED GDBusConnection *connection,
+                      G_GNUC_UNUSED const char *sender,
+                      G_GNUC_UNUSED const char *object_path,
+                      G_GNUC_UNUSED const char *interface_name,
+                      G_GNUC_UNUSED const char *signal_name,
+                      GVariant *parameters,
+                      gpointer user_data)
+{
+    Player *player = user_data;
+    g_variant_get(parameters, "(x)", &player->seeked_position);
+    player->seeked_count++;
+}
+
+static gboolean name_has_owner(Player *player, G_GNUC_UNUSED gconstpointer data)
+{
+    GVariant *reply;
+
+    g_clear_pointer(&player->owner, g_free);
+    reply = g_dbus_connection_call_sync(player->bus, "org.freedesktop.DBus",
+                                        "/org/freedesktop/DBus",
+                                        "org.freedesktop.DBus", "GetNameOwner",
+                                        g_variant_new("(s)", player->bus_name),
+                                        G_VARIANT_TYPE("(s)"),
+                                        G_DBUS_CALL_FLAGS_NONE, -1, NULL, NULL);
+    if (reply) {
+        g_variant_get(reply, "(s)", &player->owner);
+        g_variant_unref(reply);
+    }
+    return player->owner != NULL;
+}
+
+static gboolean name_has_no_owner(Player *player, G_GNUC_UNUSED gconstpointer data)
+{
+    return !name_has_owner(player, NULL);
+}
+
+static void on_name_owner_changed(G_GNUC_UNUSED GDBusConnection *connection,
+                                  G_GNUC_UNUSED const char *sender,
+                                  G_GNUC_UNUSED const char *object_path,
+                                  G_GNUC_UNUSED const char *interface_name,
+                                  G_GNUC_UNUSED const char *signal_name,
+                                  G_GNUC_UNUSED GVariant *parameters,
+                                  G_GNUC_UNUSED gpointer user_data)
+{
+    // Only used to wake up the main loop so the condition is checked again
+}
+
+static gboolean wait_for_name(Player *player, Condition condition)
+{
+    gboolean ok;
+    guint id = g_dbus_connection_signal_subscribe(player->bus, "org.freedesktop.DBus",
+                                                  "org.freedesktop.DBus",
+                                                  "NameOwnerChanged",
+                                                  "/org/freedesktop/DBus",
+                                                  player->bus_name,
+                                                  G_DBUS_SIGNAL_FLAGS_NONE,
+                                                  on_name_owner_changed, NULL, NULL);
+    ok = wait_for(player, condition, NULL);
+    g_dbus_connection_signal_unsubscribe(player->bus, id);
+    return ok;
+}
+
+static gboolean metadata_url_is(Player *player, gconstpointer url)
+{
+    GVariant *metadata = g_hash_table_lookup(player->changed, "Metadata");
+    const char *value = NULL;
+    return metadata && g_variant_lookup(metadata, "xesam:url", "&s", &value) &&
+           g_strcmp0(value, url) == 0;
+}
+
+static void wait_for_metadata_url(Player *player, const char *url)
+{
+    GVariant *metadata = NULL;
+    GVariant *reply;
+    const char *value = NULL;
+    gboolean loaded;
+
+    reply = g_dbus_connection_call_sync(player->bus, player->bus_name, MPRIS_PATH,
+                                        PROPERTIES_IFACE, "Get",
+                                        g_variant_new("(ss)", PLAYER_IFACE, "Metadata"),
+                                        G_VARIANT_TYPE("(v)"), G_DBUS_CALL_FLAGS_NONE,
+                                        TIMEOUT_MS, NULL, NULL);
+    if (reply) {
+        g_variant_get(reply, "(v)", &metadata);
+        g_variant_unref(reply);
+    }
+    loaded = metadata && g_variant_lookup(metadata, "xesam:url", "&s", &value) &&
+             g_strcmp0(value, url) == 0;
+    if (metadata) {
+        g_variant_unref(metadata);
+    }
+
+    if (!loaded && !wait_for(player, metadata_url_is, url)) {
+        g_error("timed out after %dms waiting for Metadata with xesam:url %s",
+                TIMEOUT_MS, url);
+    }
+}
+
+static void player_subscribe(Player *player)
+{
+    player->properties_changed_id =
+        g_dbus_connection_signal_subscribe(player->bus, player->owner,
+                                           PROPERTIES_IFACE, "PropertiesChanged",
+                                           MPRIS_PATH, NULL,
+                                           G_DBUS_SIGNAL_FLAGS_NONE,
+                                           on_properties_changed, player, NULL);
+    player->seeked_id =
+        g_dbus_connection_signal_subscribe(player->bus, player->owner,
+                                           PLAYER_IFACE, "Seeked",
+                                           MPRIS_PATH, NULL,
+                                           G_DBUS_SIGNAL_FLAGS_NONE,
+                                           on_seeked, player, NULL);
+}
+
+static GDBusConnection *bus_new(const char *address)
+{
+    GDBusConnection *bus;
+    GError *error = NULL;
+
+    if (address) {
+        bus = g_dbus_connection_new_for_address_sync(
+            address,
+            G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT |
+            G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION,
+            NULL, NULL, &error);
+    } else {
+        bus = g_bus_get_sync(G_BUS_TYPE_SESSION, NULL, &error);
+    }
+    g_assert_no_error(error);
+    return bus;
+}
+
+// extra_args are passed to mpv before the files to play, bus_address
+// replaces the session bus when not NULL
+static Player *player_new_on_bus(const char *client_name, const char *const *extra_args,
+                                 const char *bus_address)
+{
+    static guint instance = 0;
+    Player *player = g_new0(Player, 1);
+    GPtrArray *args = g_ptr_array_new_with_free_func(g_free);
+    GSubprocessLauncher *launcher = g_subprocess_launcher_new(G_SUBPROCESS_FLAGS_NONE);
+    GError *error = NULL;
+
+    player->client_name = g_strdup_printf("%s%u", client_name, instance++);
+    player->bus_name = g_strconcat("org.mpris.MediaPlayer2.mpv.", player->client_name, NULL);
+    player->changed = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                            (GDestroyNotify)g_variant_unref);
+    player->bus = bus_new(bus_address);
+    if (bus_address) {
+        g_subprocess_launcher_setenv(launcher, "DBUS_SESSION_BUS_ADDRESS", bus_address, TRUE);
+    }
+
+    g_ptr_array_add(args, g_strdup("mpv"));
+    g_ptr_array_add(args, g_strdup("--no-config"));
+    g_ptr_array_add(args, g_strdup("--no-terminal"));
+    g_ptr_array_add(args, g_strdup("--vo=null"));
+    g_ptr_array_add(args, g_strdup("--ao=null"));
+    g_ptr_array_add(args, g_strdup("--pause"));
+    g_ptr_array_add(args, g_strdup("--keep-open=yes"));
+    g_ptr_array_add(args, g_strdup_printf("--audio-client-name=%s", player->client_name));
+    g_ptr_array_add(args, g_strdup_printf("--log-file=%s/%s.mpv.log",
+                                          log_dir, player->client_name));
+    if (plugin[0] != '\0') {
+        g_ptr_array_add(args, g_strdup("--load-scripts=no"));
+        g_ptr_array_add(args, g_strdup_printf("--script=%s", plugin));
+    }
+    for (; extra_args && *extra_args; extra_args++) {
+        g_ptr_array_add(args, g_strdup(*extra_args));
+    }
+    g_ptr_array_add(args, g_strdup(play_file));
+    g_ptr_array_add(args, g_strdup(play_file));
+    g_ptr_array_add(args, NULL);
+
+    player->mpv = g_subprocess_launcher_spawnv(launcher, (const char *const *)args->pdata,
+                                               &error);
+    g_assert_no_error(error);
+    g_ptr_array_unref(args);
+    g_object_unref(launcher);
+
+    if (!wait_for_name(player, name_has_owner)) {
+        g_error("timed out after %dms waiting for %s to appear on the bus",
+                TIMEOUT_MS, player->bus_name);
+    }
+
+    player_subscribe(player);
+    wait_for_metadata_url(player, play_uri);
+
+    return player;
+}
+
+static Player *player_new(const char *client_name, const char *const *extra_args)
+{
+    return player_new_on_bus(client_name, extra_args, NULL);
+}
+
+static gboolean process_exited(Player *player, G_GNUC_UNUSED gconstpointer data)
+{
+    return player->exited;
+}
+
+static void on_process_exited(GObject *source, GAsyncResult *res, gpointer data)
+{
+    Player *player = data;
+    g_subprocess_wait_finish(G_SUBPROCESS(source), res, NULL);
+    player->exited = TRUE;
+}
+
+static gboolean player_wait_exit(Player *player)
+{
+    if (!player->exited) {
+        g_subprocess_wait_async(player->mpv, NULL, on_process_exited, player);
+    }
+    return wait_for(player, process_exited, NULL);
+}
+
+static void player_free(Player *player)
+{
+    g_dbus_connection_signal_unsubscribe(player->bus, player->properties_changed_id);
+    g_dbus_connection_signal_unsubscribe(player->bus, player->seeked_id);
+
+    if (!player->exited) {
+        g_subprocess_send_signal(player->mpv, SIGTERM);
+        if (!player_wait_exit(player)) {
+            g_subprocess_force_exit(player->mpv);
+        }
+    }
+
+    g_object_unref(player->mpv);
+    g_object_unref(player->bus);
+    g_hash_table_unref(player->changed);
+    g_free(player->client_name);
+    g_free(player->bus_name);
+    g_free(player->owner);
+    g_free(player);
+}
+
+static GVariant *call(Player *player, const char *iface, const char *method,
+                      GVariant *params, GError **error)
+{
+    return g_dbus_connection_call_sync(player->bus, player->bus_name, MPRIS_PATH,
+                                       iface, method, params, NULL,
+                                       G_DBUS_CALL_FLAGS_NONE, TIMEOUT_MS,
+                                       NULL, error);
+}
+
+static void call_ok(Player *player, const char *iface, const char *method, GVariant *params)
+{
+    GError *error = NULL;
+    GVariant *reply = call(player, iface, method, params, &error);
+    g_assert_no_error(error);
+    g_variant_unref(reply);
+}
+
+static GVariant *get(Player *player, const char *iface, const char *name)
+{
+    GError *error = NULL;
+    GVariant *value;
+    GVariant *reply = call(player, PROPERTIES_IFACE, "Get",
+                           g_variant_new("(ss)", iface, name), &error);
+    g_assert_no_error(error);
+    g_variant_get(reply, "(v)", &value);
+    g_variant_unref(reply);
+    return value;
+}
+
+static void set(Player *player, const char *iface, const char *name, GVariant *value)
+{
+    call_ok(player, PROPERTIES_IFACE, "Set", g_variant_new("(ssv)", iface, name, value));
+}
+
+typedef struct Expected
+{
+    const char *name;
+    GVariant *value;
+} Expected;
+
+static gboolean property_changed_to(Player *player, gconstpointer data)
+{
+    const Expected *expected = data;
+    GVariant *value = g_hash_table_lookup(player->changed, expected->name);
+    return value && g_variant_equal(value, expected->value);
+}
+
+// Passes if the property already has the value, or once a
+// PropertiesChanged signal reports it
+static void assert_property(Player *player, const char *iface,
+                            const char *name, GVariant *expected_value)
+{
+    Expected expected = {name, g_variant_ref_sink(expected_value)};
+    GVariant *current = get(player, iface, name);
+
+    if (!g_variant_equal(current, expected.value) &&
+        !wait_for(player, property_changed_to, &expected)) {
+        GVariant *signalled = g_hash_table_lookup(player->changed, name);
+        gchar *want = g_variant_print(expected.value, TRUE);
+        gchar *got = g_variant_print(current, TRUE);
+        gchar *last = signalled ? g_variant_print(signalled, TRUE) : g_strdup("nothing");
+        g_error("timed out after %dms waiting for %s.%s == %s: "
+                "Get returned %s before waiting, last PropertiesChanged reported %s",
+                TIMEOUT_MS, iface, name, want, got, last);
+    }
+
+    g_variant_unref(current);
+    g_variant_unref(expected.value);
+}
+
+static GVariant *get_metadata_item(Player *player, const char *key)
+{
+    GVariant *metadata = get(player, PLAYER_IFACE, "Metadata");
+    GVariant *item = g_variant_lookup_value(metadata, key, NULL);
+    g_variant_unref(metadata);
+    return item;
+}
+
+static gboolean seeked_more_than(Player *player, gconstpointer count)
+{
+    return player->seeked_count > GPOINTER_TO_UINT(count);
+}
+
+static void assert_seeked_near(Player *player, guint count, gint64 position_us)
+{
+    if (!wait_for(player, seeked_more_than, GUINT_TO_POINTER(count))) {
+        g_error("timed out after %dms waiting for Seeked to %" G_GINT64_FORMAT "us",
+                TIMEOUT_MS, position_us);
+    }
+    if (ABS(player->seeked_position - position_us) > 250000) {
+        g_error("Seeked reported %" G_GINT64_FORMAT "us, expected about %" G_GINT64_FORMAT "us",
+                player->seeked_position, position_us);
+    }
+}
+
+// Signals the plugin sent before it answered a call are handled once this
+// returns, so a test can tell that nothing else was sent up to now
+static void sync_with_player(Player *player)
+{
+    g_variant_unref(get(player, PLAYER_IFACE, "PlaybackStatus"));
+    while (g_main_context_iteration(NULL, FALSE)) {
+    }
+}
+
+static GVariant *get_stat(Player *player, const char *name)
+{
+    GVariant *reply = call(player, EXT_IFACE, "GetStats", NULL, NULL);
+    GVariant *stats;
+    GVariant *value;
+
+    g_assert_nonnull(reply);
+    stats = g_variant_get_child_value(reply, 0);
+    value = g_variant_lookup_value(stats, name, NULL);
+    g_assert_nonnull(value);
+    g_variant_unref(stats);
+    g_variant_unref(reply);
+    return value;
+}
+
+static void assert_stat(Player *player, const char *name, GVariant *expected)
+{
+    GVariant *value = get_stat(player, name);
+
+    g_variant_ref_sink(expected);
+    if (!g_variant_equal(value, expected)) {
+        gchar *want = g_variant_print(expected, TRUE);
+        gchar *got = g_variant_print(value, TRUE);
+        g_error("GetStats returned %s for %s, expected %s", got, name, want);
+    }
+    g_variant_unref(expected);
+    g_variant_unref(value);
+}
+
+// Put the shared player back into a known state before each test
+static Player *get_shared_player(void)
+{
+    if (!shared_player) {
+        shared_player = player_new("test-shared", NULL);
+    }
+
+    call_ok(shared_player, PLAYER_IFACE, "Pause", NULL);
+    set(shared_player, PLAYER_IFACE, "LoopStatus", g_variant_new_string("None"));
+    set(shared_player, PLAYER_IFACE, "Shuffle", g_variant_new_boolean(FALSE));
+    set(shared_player, PLAYER_IFACE, "Volume", g_variant_new_double(1.0));
+    set(shared_player, PLAYER_IFACE, "Rate", g_variant_new_double(1.0));
+    assert_property(shared_player, PLAYER_IFACE, "PlaybackStatus", g_variant_new_string("Paused"));
+
+    return shared_player;
+}
+
+static void test_root_properties(void)
+{
+    Player *player = get_shared_player();
+    const gchar **strv;
+    GVariant *value;
+
+    assert_property(player, ROOT_IFACE, "CanQuit", g_variant_new_boolean(TRUE));
+    assert_property(player, ROOT_IFACE, "CanRaise", g_variant_new_boolean(FALSE));
+    assert_property(player, ROOT_IFACE, "HasTrackList", g_variant_new_boolean(FALSE));
+    assert_property(player, ROOT_IFACE, "Identity", g_variant_new_string(player->client_name));
+    assert_property(player, ROOT_IFACE, "DesktopEntry", g_variant_new_string("mpv"));
+
+    value = get(player, ROOT_IFACE, "CanSetFullscreen");
+    g_assert_true(g_variant_is_of_type(value, G_VARIANT_TYPE_BOOLEAN));
+    g_variant_unref(value);
+
+    value = get(player, ROOT_IFACE, "SupportedUriSchemes");
+    g_assert_true(g_variant_is_of_type(value, G_VARIANT_TYPE_STRING_ARRAY));
+    strv = g_variant_get_strv(value, NULL);
+    g_assert_true(g_strv_contains(strv, "https"));
+    g_free(strv);
+    g_variant_unref(value);
+
+    value = get(player, ROOT_IFACE, "SupportedMimeTypes");
+    g_assert_true(g_variant_is_of_type(value, G_VARIANT_TYPE_STRING_ARRAY));
+    strv = g_variant_get_strv(value, NULL);
+    g_assert_true(g_strv_contains(strv, "audio/mpeg"));
+    g_free(strv);
+    g_variant_unref(value);
+}
+
+static void test_root_raise(void)
+{
+    call_ok(get_shared_player(), ROOT_IFACE, "Raise", NULL);
+}
+
+static void test_root_fullscreen(void)
+{
+    Player *player = get_shared_player();
+
+    set(player, ROOT_IFACE, "Fullscreen", g_variant_new_boolean(TRUE));
+    assert_property(player, ROOT_IFACE, "Fullscreen", g_variant_new_boolean(TRUE));
+    set(player, ROOT_IFACE, "Fullscreen", g_variant_new_boolean(FALSE));
+    assert_property(player, ROOT_IFACE, "Fullscreen", g_variant_new_boolean(FALSE));
+}
+
+static void test_root_quit(void)
+{
+    Player *player = player_new("test-quit", NULL);
+
+    call_ok(player, ROOT_IFACE, "Quit", NULL);
+    if (!player_wait_exit(player)) {
+        g_error("timed out after %dms waiting for mpv to quit", TIMEOUT_MS);
+    }
+    if (!wait_for_name(player, name_has_no_owner)) {
+        g_error("%s still owned after mpv quit", player->bus_name);
+    }
+
+    player_free(player);
+}
+
+static void test_player_properties(void)
+{
+    Player *player = get_shared_player();
+    GVariant *value;
+
+    assert_property(player, PLAYER_IFACE, "MinimumRate", g_variant_new_double(0.01));
+    assert_property(player, PLAYER_IFACE, "MaximumRate", g_variant_new_double(100));
+    assert_property(player, PLAYER_IFACE, "CanSeek", g_variant_new_boolean(TRUE));
+    assert_property(player, PLAYER_IFACE, "CanControl", g_variant_new_boolean(TRUE));
+    assert_property(player, PLAYER_IFACE, "CanPlay", g_variant_new_boolean(TRUE));
+    assert_property(player, PLAYER_IFACE, "CanPause", g_variant_new_boolean(TRUE));
+
+    value = get(player, PLAYER_IFACE, "Position");
+    g_assert_cmpint(g_variant_get_int64(value), >=, 0);
+    g_variant_unref(value);
+}
+
+static void test_player_play_pause(void)
+{
+    Player *player = get_shared_player();
+
+    call_ok(player, PLAYER_IFACE, "Play", NULL);
+    assert_property(player, PLAYER_IFACE, "PlaybackStatus", g_variant_new_string("Playing"));
+    call_ok(player, PLAYER_IFACE, "Pause", NULL);
+    assert_property(player, PLAYER_IFACE, "PlaybackStatus", g_variant_new_string("Paused"));
+    call_ok(player, PLAYER_IFACE, "PlayPause", NULL);
+    assert_property(player, PLAYER_IFACE, "PlaybackStatus", g_variant_new_string("Playing"));
+    call_ok(player, PLAYER_IFACE, "PlayPause", NULL);
+    assert_property(player, PLAYER_IFACE, "PlaybackStatus", g_variant_new_string("Paused"));
+}
+
+static void test_player_stop(void)
+{
+    const char *args[] = {"--idle=yes", NULL};
+    Player *player = player_new("test-stop", args);
+
+    call_ok(player, PLAYER_IFACE, "Stop", NULL);
+    assert_property(player, PLAYER_IFACE, "PlaybackStatus", g_variant_new_string("Stopped"));
+    assert_property(player, PLAYER_IFACE, "CanPlay", g_variant_new_boolean(FALSE));
+    assert_property(player, PLAYER_IFACE, "CanPause", g_variant_new_boolean(FALSE));
+
+    player_free(player);
+}
+
+static void test_player_next_previous(void)
+{
+    Player *player = get_shared_player();
+
+    assert_property(player, PLAYER_IFACE, "CanGoNext", g_variant_new_boolean(TRUE));
+    assert_property(player, PLAYER_IFACE, "CanGoPrevious", g_variant_new_boolean(FALSE));
+
+    call_ok(player, PLAYER_IFACE, "Next", NULL);
+    assert_property(player, PLAYER_IFACE, "CanGoNext", g_variant_new_boolean(FALSE));
+    assert_property(player, PLAYER_IFACE, "CanGoPrevious", g_variant_new_boolean(TRUE));
+
+    call_ok(player, PLAYER_IFACE, "Previous", NULL);
+    assert_property(player, PLAYER_IFACE, "CanGoNext", g_variant_new_boolean(TRUE));
+    assert_property(player, PLAYER_IFACE, "CanGoPrevious", g_variant_new_boolean(FALSE));
+}
+
+static void test_player_seek(void)
+{
+    Player *player = get_shared_player();
+    GVariant *trackid = get_metadata_item(player, "mpris:trackid");
+
+    call_ok(player, PLAYER_IFACE, "SetPosition",
+            g_variant_new("(ox)", g_variant_get_string(trackid, NULL), (gint64)0));
+    assert_seeked_near(player, player->seeked_count, 0);
+
+    call_ok(player, PLAYER_IFACE, "Seek", g_variant_new("(x)", (gint64)500000));
+    assert_seeked_near(player, player->seeked_count, 500000);
+
+    call_ok(player, PLAYER_IFACE, "SetPosition",
+            g_variant_new("(ox)", g_variant_get_string(trackid, NULL), (gint64)1000000));
+    assert_seeked_near(player, player->seeked_count, 1000000);
+
+    g_variant_unref(trackid);
+}
+
+static void test_player_seek_burst(void)
+{
+    const char *args[] = {"--script-opts=mpris-seek-coalesce-ms=200,mpris-seek-burst-mode=exact",
+                          NULL};
+    Player *player = player_new("test-seek-burst", args);
+    guint count = player->seeked_count;
+
+    // Only the final position of the burst is reported
+    for (int i = 0; i < 10; i++) {
+        call_ok(player, PLAYER_IFACE, "Seek", g_variant_new("(x)", (gint64)50000));
+    }
+    // Seeked waits for mpv to restart after the last seek it was sent, so
+    // no earlier restart can add another one
+    assert_seeked_near(player, count, 500000);
+    sync_with_player(player);
+    g_assert_cmpuint(player->seeked_count, ==, count + 1);
+
+    player_free(player);
+}
+
+static void test_player_loop_status(void)
+{
+    Player *player = get_shared_player();
+
+    set(player, PLAYER_IFACE, "LoopStatus", g_variant_new_string("Track"));
+    assert_property(player, PLAYER_IFACE, "LoopStatus", g_variant_new_string("Track"));
+    set(player, PLAYER_IFACE, "LoopStatus", g_variant_new_string("Playlist"));
+    assert_property(player, PLAYER_IFACE, "LoopStatus", g_variant_new_string("Playlist"));
+    assert_property(player, PLAYER_IFACE, "CanGoPrevious", g_variant_new_boolean(TRUE));
+    set(player, PLAYER_IFACE, "LoopStatus", g_variant_new_string("None"));
+    assert_property(player, PLAYER_IFACE, "LoopStatus", g_variant_new_string("None"));
+}
+
+static void test_player_rate(void)
+{
+    Player *player = get_shared_player();
+
+    set(player, PLAYER_IFACE, "Rate", g_variant_new_double(1.5));
+    assert_property(player, PLAYER_IFACE, "Rate", g_variant_new_double(1.5));
+}
+
+static void test_player_shuffle(void)
+{
+    Player *player = get_shared_player();
+
+    set(player, PLAYER_IFACE, "Shuffle", g_variant_new_boolean(TRUE));
+    assert_property(player, PLAYER_IFACE, "Shuffle", g_variant_new_boolean(TRUE));
+    set(player, PLAYER_IFACE, "Shuffle", g_variant_new_boolean(FALSE));
+    assert_property(player, PLAYER_IFACE, "Shuffle", g_variant_new_boolean(FALSE));
+}
+
+static void test_player_volume(void)
+{
+    Player *player = get_shared_player();
+
+    set(player, PLAYER_IFACE, "Volume", g_variant_new_double(0.5));
+    assert_property(player, PLAYER_IFACE, "Volume", g_variant_new_double(0.5));
+}
+
+static void test_player_volume_burst(void)
+{
+    const char *args[] = {"--script-opts=mpris-extensions=yes,mpris-write-interval-ms=200",
+                          NULL};
+    Player *player = player_new("test-volume-burst", args);
+    Expected expected = {"Volume", g_variant_ref_sink(g_variant_new_double(0.5))};
+    GVariant *volume;
+
+    // Writes held back by the interval are replaced by newer ones
+    for (int i = 1; i <= 10; i++) {
+        set(player, PLAYER_IFACE, "Volume", g_variant_new_double(i * 0.05));
+    }
+    if (!wait_for(player, property_changed_to, &expected)) {
+        g_error("timed out after %dms waiting for Volume == 0.5", TIMEOUT_MS);
+    }
+
+    // and with nothing held back any more, no older value can land after
+    // the newest
+    assert_stat(player, "writes-held", g_variant_new_uint32(0));
+    sync_with_player(player);
+    volume = g_hash_table_lookup(player->changed, "Volume");
+    g_assert_cmpfloat(g_variant_get_double(volume), ==, 0.5);
+    g_variant_unref(expected.value);
+
+    player_free(player);
+}
+
+static void test_player_metadata(void)
+{
+    Player *player = get_shared_player();
+    GVariant *item;
+
+    item = get_metadata_item(player, "xesam:url");
+    g_assert_nonnull(item);
+    g_assert_cmpstr(g_variant_get_string(item, NULL), ==, play_uri);
+    g_variant_unref(item);
+
+    item = get_metadata_item(player, "mpris:trackid");
+    g_assert_nonnull(item);
+    g_assert_true(g_variant_is_of_type(item, G_VARIANT_TYPE_OBJECT_PATH));
+    g_variant_unref(item);
+
+    item = get_metadata_item(player, "xesam:title");
+    g_assert_nonnull(item);
+    g_assert_cmpstr(g_variant_get_string(item, NULL), !=, "");
+    g_variant_unref(item);
+
+    item = get_metadata_item(player, "mpris:length");
+    g_assert_nonnull(item);
+    g_assert_cmpint(g_variant_get_int64(item), >, 0);
+    g_variant_unref(item);
+}
+
+typedef struct Heartbeats
+{
+    guint count;
+    guint wanted;
+    double rate;
+} Heartbeats;
+
+static void on_heartbeat(G_GNUC_UNUSED GDBusConnection *connection,
+                         G_GNUC_UNUSED const char *sender,
+                         G_GNUC_UNUSED const char *object_path,
+                         G_GNUC_UNUSED const char *interface_name,
+                         G_GNUC_UNUSED const char *signal_name,
+                         GVariant *parameters,
+                         gpointer user_data)
+{
+    Heartbeats *heartbeats = user_data;
+    g_variant_get(parameters, "(xdx)", NULL, &heartbeats->rate, NULL);
+    heartbeats->count++;
+}
+
+static gboolean heartbeats_received(G_GNUC_UNUSED Player *player, gconstpointer data)
+{
+    const Heartbeats *heartbeats = data;
+    return heartbeats->count >= heartbeats->wanted;
+}
+
+static gboolean heartbeat_stopped(G_GNUC_UNUSED Player *player, gconstpointer data)
+{
+    const Heartbeats *heartbeats = data;
+    return heartbeats->count >= heartbeats->wanted && heartbeats->rate == 0.0;
+}
+
+static void test_ext_heartbeat(void)
+{
+    const char *args[] = {"--script-opts=mpris-extensions=yes,mpris-heartbeat-ms=50", NULL};
+    Player *player = player_new("test-heartbeat", args);
+    Heartbeats heartbeats = {0};
+    guint id;
+
+    id = g_dbus_connection_signal_subscribe(player->bus, player->owner, EXT_IFACE,
+                                            "Heartbeat", MPRIS_PATH, NULL,
+                                            G_DBUS_SIGNAL_FLAGS_NONE,
+                                            on_heartbeat, &heartbeats, NULL);
+
+    // Only state changes are sent while paused, e.g. when the file was
+    // loaded, there is no timer for them
+    assert_property(player, PLAYER_IFACE, "PlaybackStatus", g_variant_new_string("Paused"));
+    assert_stat(player, "heartbeat-running", g_variant_new_boolean(FALSE));
+
+    call_ok(player, PLAYER_IFACE, "Play", NULL);
+    heartbeats.wanted += 3;
+    if (!wait_for(player, heartbeats_received, &heartbeats)) {
+        g_error("timed out after %dms waiting for heartbeats while playing", TIMEOUT_MS);
+    }
+    g_assert_cmpfloat(heartbeats.rate, ==, 1.0);
+
+    // Pausing sends one with rate 0 and stops the timer
+    heartbeats.wanted = heartbeats.count + 1;
+    call_ok(player, PLAYER_IFACE, "Pause", NULL);
+    if (!wait_for(player, heartbeat_stopped, &heartbeats)) {
+        g_error("timed out after %dms waiting for a heartbeat with rate 0", TIMEOUT_MS);
+    }
+    assert_property(player, PLAYER_IFACE, "PlaybackStatus", g_variant_new_string("Paused"));
+    assert_stat(player, "heartbeat-running", g_variant_new_boolean(FALSE));
+
+    g_dbus_connection_signal_unsubscribe(player->bus, id);
+    player_free(player);
+}
+
+static void test_ext_batch(void)
+{
+    const char *args[] = {"--script-opts=mpris-extensions=yes,mpris-write-interval-ms=200",
+                          NULL};
+    Player *player = player_new("test-batch", args);
+    GVariantBuilder operations;
+    GVariant *reply;
+    GVariantIter *results;
+    gboolean ok;
+    const char *message;
+    guint i = 0;
+
+    g_variant_builder_init(&operations, G_VARIANT_TYPE("a(sv)"));
+    g_variant_builder_add(&operations, "(sv)", "OpenUri", g_variant_new_string(play_uri));
+    g_variant_builder_add(&operations, "(sv)", "SetPosition", g_variant_new_int64(100000));
+    g_variant_builder_add(&operations, "(sv)", "Play", g_variant_new("()"));
+    g_variant_builder_add(&operations, "(sv)", "Volume", g_variant_new_double(0.5));
+    g_variant_builder_add(&operations, "(sv)", "Volume", g_variant_new_string("loud"));
+    g_variant_builder_add(&operations, "(sv)", "Rewind", g_variant_new("()"));
+
+    reply = call(player, EXT_IFACE, "Batch", g_variant_new("(a(sv))", &operations), NULL);
+    g_assert_nonnull(reply);
+    g_variant_get(reply, "(a(bs))", &results);
+    g_assert_cmpuint(g_variant_iter_n_children(results), ==, 6);
+    // One result per operation, in order, with the bad ones failing alone
+    while (g_variant_iter_next(results, "(b&s)", &ok, &message)) {
+        g_assert_cmpint(ok, ==, i < 4);
+        g_assert_cmpint(message[0] == '\0', ==, i < 4);
+        i++;
+    }
+    g_variant_iter_free(results);
+    g_variant_unref(reply);
+
+    assert_property(player, PLAYER_IFACE, "PlaybackStatus", g_variant_new_string("Playing"));
+    assert_property(player, PLAYER_IFACE, "Volume", g_variant_new_double(0.5));
+
+    // A Set held back by the write interval doesn't undo a later Batch
+    set(player, PLAYER_IFACE, "Volume", g_variant_new_double(0.2));
+    set(player, PLAYER_IFACE, "Volume", g_variant_new_double(0.3));
+    g_variant_builder_init(&operations, G_VARIANT_TYPE("a(sv)"));
+    g_variant_builder_add(&operations, "(sv)", "Volume", g_variant_new_double(0.8));
+    reply = call(player, EXT_IFACE, "Batch", g_variant_new("(a(sv))", &operations), NULL);
+    g_assert_nonnull(reply);
+    g_variant_unref(reply);
+    assert_stat(player, "writes-held", g_variant_new_uint32(0));
+    assert_property(player, PLAYER_IFACE, "Volume", g_variant_new_double(0.8));
+
+    player_free(player);
+}
+
+// 1x1 PNG, used as embedded cover art
+static const char *COVER_PNG =
+    "iVBORw0KGgoAAAANSUhEUgAAAAEAAAABCAYAAAAfFcSJAAAACklEQVR4nGMAAQAABQABDQottAAAAABJRU5ErkJggg==";
+
+static void append_le(GByteArray *out, guint32 value, guint bytes)
+{
+    for (guint i = 0; i < bytes; i++) {
+        guint8 byte = value >> (8 * i);
+        g_byte_array_append(out, &byte, 1);
+    }
+}
+
+static void append_be32(GByteArray *out, guint32 value)
+{
+    guint32 be = GUINT32_TO_BE(value);
+    g_byte_array_append(out, (const guint8*)&be, 4);
+}
+
+// A second of silence as 8-bit PCM WAV, with the cover in an ID3v2 tag
+// chunk which FFmpeg reads as an attached picture
+static gchar *write_wav_with_cover(const char *dir, GBytes *cover)
+{
+    static const char mime[] = "image/png";
+    gsize cover_size;
+    const guint8 *cover_data = g_bytes_get_data(cover, &cover_size);
+    guint32 frame_size = 1 + sizeof(mime) + 1 + 1 + cover_size;
+    guint32 tag_size = 10 + frame_size;
+    guint8 tag_header[] = {'I', 'D', '3', 3, 0, 0,
+                           (tag_size >> 21) & 0x7f, (tag_size >> 14) & 0x7f,
+                           (tag_size >> 7) & 0x7f, tag_size & 0x7f};
+    guint8 apic_header[] = {0, 0, 0}; // flags, then text encoding
+    guint8 picture_type[] = {3, 0}; // front cover, then an empty description
+    GByteArray *id3 = g_byte_array_new();
+    GByteArray *wav = g_byte_array_new();
+    guint8 silence[8000];
+    gchar *path = g_build_filename(dir, "cover.wav", NULL);
+    GError *error = NULL;
+
+    g_byte_array_append(id3, tag_header, sizeof(tag_header));
+    g_byte_array_append(id3, (const guint8*)"APIC", 4);
+    append_be32(id3, frame_size);
+    g_byte_array_append(id3, apic_header, sizeof(apic_header));
+    g_byte_array_append(id3, (const guint8*)mime, sizeof(mime));
+    g_byte_array_append(id3, picture_type, sizeof(picture_type));
+    g_byte_array_append(id3, cover_data, cover_size);
+
+    memset(silence, 0x80, sizeof(silence));
+    g_byte_array_append(wav, (const guint8*)"RIFF", 4);
+    append_le(wav, 0, 4); // filled in below
+    g_byte_array_append(wav, (const guint8*)"WAVEfmt ", 8);
+    append_le(wav, 16, 4);
+    append_le(wav, 1, 2); // PCM
+    append_le(wav, 1, 2); // mono
+    append_le(wav, sizeof(silence), 4); // samples per second
+    append_le(wav, sizeof(silence), 4); // bytes per second
+    append_le(wav, 1, 2); // block align
+    append_le(wav, 8, 2); // bits per sample
+    g_byte_array_append(wav, (const guint8*)"id3 ", 4);
+    append_le(wav, id3->len, 4);
+    g_byte_array_append(wav, id3->data, id3->len);
+    if (id3->len % 2) {
+        append_le(wav, 0, 1);
+    }
+    g_byte_array_append(wav, (const guint8*)"data", 4);
+    append_le(wav, sizeof(silence), 4);
+    g_byte_array_append(wav, silence, sizeof(silence));
+    for (guint i = 0; i < 4; i++) {
+        wav->data[4 + i] = (wav->len - 8) >> (8 * i);
+    }
+
+    g_file_set_contents(path, (const gchar*)wav->data, wav->len, &error);
+    g_assert_no_error(error);
+    g_byte_array_unref(wav);
+    g_byte_array_unref(id3);
+    return path;
+}
+
+static GBytes *read_fd(int fd)
+{
+    GByteArray *data = g_byte_array_new();
+    guint8 buf[4096];
+    ssize_t n;
+
+    while ((n = pread(fd, buf, sizeof(buf), data->len)) > 0) {
+        g_byte_array_append(data, buf, n);
+    }
+    g_assert_cmpint(n, ==, 0);
+    return g_byte_array_free_to_bytes(data);
+}
+
+// Checks the signature and returns the size from the header
+static void assert_png(GBytes *png, guint32 *width, guint32 *height)
+{
+    static const guint8 signature[] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    gsize size;
+    const guint8 *data = g_bytes_get_data(png, &size);
+
+    g_assert_cmpuint(size, >, 24);
+    g_assert_cmpmem(data, sizeof(signature), signature, sizeof(signature));
+    g_assert_cmpmem(data + 12, 4, "IHDR", 4);
+    memcpy(width, data + 16, 4);
+    memcpy(height, data + 20, 4);
+    *width = GUINT32_FROM_BE(*width);
+    *height = GUINT32_FROM_BE(*height);
+}
+
+typedef struct ArtResult
+{
+    const char *mime_type;
+    guint64 size;
+    guint64 generation;
+    GBytes *data;
+    guint seals;
+} ArtResult;
+
+static void get_art(Player *player, ArtResult *art)
+{
+    GUnixFDList *fds = NULL;
+    GError *error = NULL;
+    GVariant *reply;
+    int fd;
+
+    reply = g_dbus_connection_call_with_unix_fd_list_sync(player->bus, player->bus_name,
+                                                          MPRIS_PATH, EXT_IFACE, "GetArt",
+                                                          NULL, G_VARIANT_TYPE("(hstt)"),
+                                                          G_DBUS_CALL_FLAGS_NONE, TIMEOUT_MS,
+                                                          NULL, &fds, NULL, &error);
+    g_assert_no_error(error);
+    fd = g_unix_fd_list_get(fds, 0, &error);
+    g_assert_no_error(error);
+
+    g_variant_get(reply, "(h&stt)", NULL, &art->mime_type, &art->size, &art->generation);
+    // Outlives the reply
+    art->mime_type = g_intern_string(art->mime_type);
+    art->data = read_fd(fd);
+    art->seals = fcntl(fd, F_GET_SEALS);
+    close(fd);
+    g_variant_unref(reply);
+    g_object_unref(fds);
+}
+
+typedef struct ArtChanges
+{
+    guint count;
+    guint64 generation;
+} ArtChanges;
+
+static void on_art_changed(G_GNUC_UNUSED GDBusConnection *connection,
+                           G_GNUC_UNUSED const char *sender,
+                           G_GNUC_UNUSED const char *object_path,
+                           G_GNUC_UNUSED const char *interface_name,
+                           G_GNUC_UNUSED const char *signal_name,
+                           GVariant *parameters,
+                           gpointer user_data)
+{
+    ArtChanges *changes = user_data;
+    g_variant_get(parameters, "(t)", &changes->generation);
+    changes->count++;
+}
+
+typedef struct ArtChangesWanted
+{
+    const ArtChanges *changes;
+    guint64 generation;
+} ArtChangesWanted;
+
+static gboolean art_changed_to(G_GNUC_UNUSED Player *player, gconstpointer data)
+{
+    const ArtChangesWanted *wanted = data;
+    return wanted->changes->count > 0 &&
+           wanted->changes->generation == wanted->generation;
+}
+
+static gboolean metadata_art_url_has_prefix(Player *player, gconstpointer prefix)
+{
+    GVariant *metadata = g_hash_table_lookup(player->changed, "Metadata");
+    const char *value = NULL;
+    return metadata && g_variant_lookup(metadata, "mpris:artUrl", "&s", &value) &&
+           g_str_has_prefix(value, prefix);
+}
+
+static void wait_for_art_url(Player *player, const char *prefix)
+{
+    GVariant *item = get_metadata_item(player, "mpris:artUrl");
+    gboolean found = item && g_str_has_prefix(g_variant_get_string(item, NULL), prefix);
+
+    if (item) {
+        g_variant_unref(item);
+    }
+    if (!found && !wait_for(player, metadata_art_url_has_prefix, prefix)) {
+        g_error("timed out after %dms waiting for Metadata with mpris:artUrl %s...",
+                TIMEOUT_MS, prefix);
+    }
+}
+
+static void test_ext_get_art(void)
+{
+    // Without mpv showing the cover, it is read from the file
+    const char *args[] = {"--script-opts=mpris-extensions=yes", "--audio-display=no", NULL};
+    Player *player = player_new("test-get-art", args);
+    GError *error = NULL;
+    gchar *dir = g_dir_make_tmp("mpv-mpris-test-XXXXXX", &error);
+    GBytes *cover = g_base64_decode_bytes(COVER_PNG);
+    gchar *path;
+    gchar *uri;
+    gchar *art_url;
+    ArtChanges changes = {0};
+    ArtChangesWanted wanted = {&changes, 0};
+    ArtResult art;
+    guint id;
+
+    g_assert_no_error(error);
+    path = write_wav_with_cover(dir, cover);
+    uri = g_filename_to_uri(path, NULL, NULL);
+    id = g_dbus_connection_signal_subscribe(player->bus, player->owner, EXT_IFACE,
+                                            "ArtChanged", MPRIS_PATH, NULL,
+                                            G_DBUS_SIGNAL_FLAGS_NONE,
+                                            on_art_changed, &changes, NULL);
+
+    call_ok(player, PLAYER_IFACE, "OpenUri", g_variant_new("(s)", uri));
+    wait_for_metadata_url(player, uri);
+    art_url = g_strconcat("data:image/png;base64,", COVER_PNG, NULL);
+    wait_for_art_url(player, art_url);
+
+    get_art(player, &art);
+    g_assert_cmpstr(art.mime_type, ==, "image/png");
+    g_assert_cmpuint(art.size, ==, g_bytes_get_size(cover));
+    g_assert_true(g_bytes_equal(art.data, cover));
+    // The fd is a memfd that nobody can change
+    g_assert_cmpint(art.seals & (F_SEAL_WRITE | F_SEAL_SHRINK | F_SEAL_GROW), ==,
+                    F_SEAL_WRITE | F_SEAL_SHRINK | F_SEAL_GROW);
+
+    // Clients are told about it with the same generation
+    wanted.generation = art.generation;
+    if (!wait_for(player, art_changed_to, &wanted)) {
+        g_error("timed out after %dms waiting for ArtChanged(%" G_GUINT64_FORMAT ")",
+                TIMEOUT_MS, wanted.generation);
+    }
+
+    g_dbus_connection_signal_unsubscribe(player->bus, id);
+    player_free(player);
+    g_bytes_unref(art.data);
+    g_unlink(path);
+    g_rmdir(dir);
+    g_free(art_url);
+    g_free(uri);
+    g_free(path);
+    g_bytes_unref(cover);
+    g_free(dir);
+}
+
+static void test_art_albumart(void)
+{
+    // mpv shows the cover as the video track, which is the default, but
+    // the cover is still the one from the file and not a frame of it
+    const char *args[] = {"--script-opts=mpris-extensions=yes", NULL};
+    Player *player = player_new("test-albumart", args);
+    GError *error = NULL;
+    gchar *dir = g_dir_make_tmp("mpv-mpris-test-XXXXXX", &error);
+    GBytes *cover = g_base64_decode_bytes(COVER_PNG);
+    gchar *path;
+    gchar *uri;
+    gchar *art_url;
+    ArtResult art;
+
+    g_assert_no_error(error);
+    path = write_wav_with_cover(dir, cover);
+    uri = g_filename_to_uri(path, NULL, NULL);
+
+    call_ok(player, PLAYER_IFACE, "OpenUri", g_variant_new("(s)", uri));
+    wait_for_metadata_url(player, uri);
+    art_url = g_strconcat("data:image/png;base64,", COVER_PNG, NULL);
+    wait_for_art_url(player, art_url);
+
+    get_art(player, &art);
+    g_assert_cmpstr(art.mime_type, ==, "image/png");
+    g_assert_cmpuint(art.size, ==, g_bytes_get_size(cover));
+    g_assert_true(g_bytes_equal(art.data, cover));
+
+    player_free(player);
+    g_bytes_unref(art.data);
+    g_unlink(path);
+    g_rmdir(dir);
+    g_free(art_url);
+    g_free(uri);
+    g_free(path);
+    g_bytes_unref(cover);
+    g_free(dir);
+}
+
+static void test_art_thumbnail(void)
+{
+    const char *args[] = {"--script-opts=mpris-video-thumbnails=yes,mpris-thumbnail-size=64,"
+                          "mpris-thumbnail-cache-size=4096", NULL};
+    GError *error = NULL;
+    gchar *cache = g_dir_make_tmp("mpv-mpris-test-XXXXXX", &error);
+    gchar *app_cache = g_build_filename(cache, "mpv-mpris", NULL);
+    gchar *thumbnails = g_build_filename(app_cache, "thumbnails", NULL);
+    gchar *stale = g_build_filename(thumbnails, "stale.png", NULL);
+    gchar *thumbnails_uri;
+    gchar *prefix;
+    gchar *old_cache = g_strdup(g_getenv("XDG_CACHE_HOME"));
+    GVariant *item;
+    gchar *thumbnail;
+    gchar *contents;
+    gsize length;
+    GBytes *png;
+    guint32 width;
+    guint32 height;
+    struct utimbuf long_ago = {0, 0};
+    char filler[8192] = {0};
+    Player *player;
+
+    g_assert_no_error(error);
+    // Older than anything written by the plugin, and over the cache size
+    g_assert_cmpint(g_mkdir_with_parents(thumbnails, 0700), ==, 0);
+    g_file_set_contents(stale, filler, sizeof(filler), &error);
+    g_assert_no_error(error);
+    g_assert_cmpint(g_utime(stale, &long_ago), ==, 0);
+
+    // The cache dir is only changed for mpv
+    g_setenv("XDG_CACHE_HOME", cache, TRUE);
+    player = player_new("test-thumbnail", args);
+    if (old_cache) {
+        g_setenv("XDG_CACHE_HOME", old_cache, TRUE);
+    } else {
+        g_unsetenv("XDG_CACHE_HOME");
+    }
+
+    call_ok(player, PLAYER_IFACE, "OpenUri",
+            g_variant_new("(s)", "av://lavfi:testsrc=size=320x240:rate=25"));
+    thumbnails_uri = g_filename_to_uri(thumbnails, NULL, NULL);
+    prefix = g_strconcat(thumbnails_uri, "/", NULL);
+    wait_for_art_url(player, prefix);
+
+    item = get_metadata_item(player, "mpris:artUrl");
+    thumbnail = g_filename_from_uri(g_variant_get_string(item, NULL), NULL, &error);
+    g_assert_no_error(error);
+    g_file_get_contents(thumbnail, &contents, &length, &error);
+    g_assert_no_error(error);
+    png = g_bytes_new_take(contents, length);
+    assert_png(png, &width, &height);
+    g_assert_cmpuint(width, ==, 64);
+    g_assert_cmpuint(height, ==, 48);
+
+    // Writing it pruned the least recently used one
+    g_assert_false(g_file_test(stale, G_FILE_TEST_EXISTS));
+
+    player_free(player);
+    g_unlink(thumbnail);
+    g_rmdir(thumbnails);
+    g_rmdir(app_cache);
+    g_rmdir(cache);
+    g_free(thumbnail);
+    g_bytes_unref(png);
+    g_variant_unref(item);
+    g_free(prefix);
+    g_free(thumbnails_uri);
+    g_free(old_cache);
+    g_free(stale);
+    g_free(thumbnails);
+    g_free(app_cache);
+    g_free(cache);
+}
+
+static gboolean metadata_invalidated(Player *player, G_GNUC_UNUSED gconstpointer data)
+{
+    return player->metadata_invalidated > 0;
+}
+
+static void test_player_lazy_metadata(void)
+{
+    const char *args[] = {"--script-opts=mpris-lazy-metadata=yes", NULL};
+    Player *player = player_new("test-lazy-metadata", args);
+    GVariant *item;
+
+    call_ok(player, PLAYER_IFACE, "Next", NULL);
+    if (!wait_for(player, metadata_invalidated, NULL)) {
+        g_error("timed out after %dms waiting for Metadata to be invalidated", TIMEOUT_MS);
+    }
+    g_assert_false(g_hash_table_contains(player->changed, "Metadata"));
+
+    item = get_metadata_item(player, "mpris:trackid");
+    g_assert_nonnull(item);
+    g_assert_true(g_str_has_suffix(g_variant_get_string(item, NULL), "/1"));
+    g_variant_unref(item);
+
+    item = get_metadata_item(player, "xesam:url");
+    g_assert_nonnull(item);
+    g_assert_cmpstr(g_variant_get_string(item, NULL), ==, play_uri);
+    g_variant_unref(item);
+
+    player_free(player);
+}
+
+static void test_player_open_uri(void)
+{
+    const char *args[] = {"--idle=yes", NULL};
+    Player *player = player_new("test-open-uri", args);
+
+    call_ok(player, PLAYER_IFACE, "Stop", NULL);
+    assert_property(player, PLAYER_IFACE, "PlaybackStatus", g_variant_new_string("Stopped"));
+
+    g_hash_table_remove(player->changed, "Metadata");
+    call_ok(player, PLAYER_IFACE, "OpenUri", g_variant_new("(s)", play_uri));
+    wait_for_metadata_url(player, play_uri);
+
+    player_free(player);
+}
+
+// Starts a dbus-daemon listening on path and waits until it is ready
+static GSubprocess *bus_daemon_start(const char *path)
+{
+    gchar *address = g_strdup_printf("--address=unix:path=%s", path);
+    GSubprocess *daemon;
+    GDataInputStream *output;
+    gchar *line;
+    GError *error = NULL;
+
+    daemon = g_subprocess_new(G_SUBPROCESS_FLAGS_STDOUT_PIPE, &error,
+                              "dbus-daemon", "--session", "--nofork", "--nopidfile",
+                              "--print-address=1", address, NULL);
+    g_assert_no_error(error);
+
+    // The address is printed once it listens
+    output = g_data_input_stream_new(g_subprocess_get_stdout_pipe(daemon));
+    line = g_data_input_stream_read_line(output, NULL, NULL, &error);
+    g_assert_no_error(error);
+    g_assert_nonnull(line);
+
+    g_free(line);
+    g_object_unref(output);
+    g_free(address);
+    return daemon;
+}
+
+static void bus_daemon_stop(GSubprocess *daemon)
+{
+    g_subprocess_send_signal(daemon, SIGTERM);
+    g_subprocess_wait(daemon, NULL, NULL);
+    g_object_unref(daemon);
+}
+
+static gboolean has_snapshot(Player *player, G_GNUC_UNUSED gconstpointer data)
+{
+    return g_hash_table_contains(player->changed, "PlaybackStatus") &&
+           g_hash_table_contains(player->changed, "Metadata") &&
+           g_hash_table_contains(player->changed, "CanGoNext");
+}
+
+static void test_bus_reconnect(void)
+{
+    GError *error = NULL;
+    gchar *dir = g_dir_make_tmp("mpv-mpris-test-XXXXXX", &error);
+    gchar *path = g_build_filename(dir, "bus", NULL);
+    gchar *next_path = g_build_filename(dir, "bus-next", NULL);
+    gchar *address = g_strconcat("unix:path=", path, NULL);
+    gchar *next_address = g_strconcat("unix:path=", next_path, NULL);
+    GSubprocess *daemon;
+    Player *player;
+    gint64 start;
+    gint64 recovery_ms;
+
+    g_assert_no_error(error);
+    daemon = bus_daemon_start(path);
+    player = player_new_on_bus("test-reconnect", NULL, address);
+
+    bus_daemon_stop(daemon);
+    g_unlink(path);
+
+    // Subscribe on the new bus before mpv can find it, so the snapshot
+    // can't be missed, then move the socket to where mpv looks for it
+    daemon = bus_daemon_start(next_path);
+    g_dbus_connection_signal_unsubscribe(player->bus, player->properties_changed_id);
+    g_dbus_connection_signal_unsubscribe(player->bus, player->seeked_id);
+    g_object_unref(player->bus);
+    player->bus = bus_new(next_address);
+    g_clear_pointer(&player->owner, g_free);
+    g_hash_table_remove_all(player->changed);
+    player_subscribe(player);
+    g_assert_cmpint(g_rename(next_path, path), ==, 0);
+    start = g_get_monotonic_time();
+
+    if (!wait_for(player, has_snapshot, NULL)) {
+        g_error("timed out after %dms waiting for all properties after the bus restarted",
+                TIMEOUT_MS);
+    }
+    recovery_ms = (g_get_monotonic_time() - start) / 1000;
+    g_test_message("back on the bus after %" G_GINT64_FORMAT "ms", recovery_ms);
+    g_assert_cmpint(recovery_ms, <, 3000);
+
+    // The objects are registered again
+    g_assert_true(wait_for_name(player, name_has_owner));
+    assert_property(player, PLAYER_IFACE, "PlaybackStatus", g_variant_new_string("Paused"));
+    call_ok(player, PLAYER_IFACE, "Play", NULL);
+    assert_property(player, PLAYER_IFACE, "PlaybackStatus", g_variant_new_string("Playing"));
+
+    player_free(player);
+    bus_daemon_stop(daemon);
+    g_unlink(path);
+    g_rmdir(dir);
+    g_free(next_address);
+    g_free(address);
+    g_free(next_path);
+    g_free(path);
+    g_free(dir);
+}
+
+static void on_peer_properties_changed(G_GNUC_UNUSED GDBusConnection *connection,
+                                       G_GNUC_UNUSED const char *sender,
+                                       G_GNUC_UNUSED const char *object_path,
+                                       G_GNUC_UNUSED const char *interface_name,
+                                       G_GNUC_UNUSED const char *signal_name,
+                                       GVariant *parameters,
+                                       gpointer user_data)
+{
+    gchar **status = user_data;
+    gchar *new_status;
+    GVariant *changed;
+
+    g_variant_get(parameters, "(&s@a{sv}as)", NULL, &changed, NULL);
+    if (g_variant_lookup(changed, "PlaybackStatus", "s", &new_status)) {
+        g_free(*status);
+        *status = new_status;
+    }
+    g_variant_unref(changed);
+}
+
+static gboolean peer_status_is(G_GNUC_UNUSED Player *player, gconstpointer data)
+{
+    const gchar *const *status = data;
+    return g_strcmp0(status[0], status[1]) == 0;
+}
+
+// Asks mpv over its JSON IPC to send a message to the plugin, which fails
+// once the plugin's client is gone. mpv answers only after it loaded its
+// scripts. Returns FALSE while mpv isn't listening yet.
+static gboolean ask_plugin_exited(const char *ipc_path, const char *script,
+                                  gboolean *exited)
+{
+    GSocketClient *client = g_socket_client_new();
+    GSocketAddress *address = g_unix_socket_address_new(ipc_path);
+    GSocketConnection *connection;
+    GDataInputStream *input;
+    gchar *request;
+    gchar *line = NULL;
+    gboolean answered = FALSE;
+
+    connection = g_socket_client_connect(client, G_SOCKET_CONNECTABLE(address), NULL, NULL);
+    g_object_unref(address);
+    g_object_unref(client);
+    if (!connection) {
+        return FALSE;
+    }
+
+    request = g_strdup_printf("{\"command\": [\"script-message-to\", \"%s\", \"ping\"], "
+                              "\"request_id\": 1}\n", script);
+    g_output_stream_write_all(g_io_stream_get_output_stream(G_IO_STREAM(connection)),
+                              request, strlen(request), NULL, NULL, NULL);
+    g_free(request);
+
+    // Events may come first
+    input = g_data_input_stream_new(g_io_stream_get_input_stream(G_IO_STREAM(connection)));
+    while ((line = g_data_input_stream_read_line(input, NULL, NULL, NULL))) {
+        if (strstr(line, "\"request_id\"")) {
+            *exited = !strstr(line, "\"error\":\"success\"");
+            answered = TRUE;
+            break;
+        }
+        g_free(line);
+    }
+
+    g_free(line);
+    g_object_unref(input);
+    g_object_unref(connection);
+    return answered;
+}
+
+static void wait_for_plugin_exit(const char *ipc_path)
+{
+    gint64 deadline = g_get_monotonic_time() + TIMEOUT_MS * 1000;
+    gchar *script = plugin[0] != '\0' ? g_path_get_basename(plugin) : g_strdup("mpris");
+    char *extension = strrchr(script, '.');
+    gboolean exited = FALSE;
+
+    // mpv names a plugin's client after its file
+    if (extension) {
+        *extension = '\0';
+    }
+
+    while (!ask_plugin_exited(ipc_path, script, &exited) || !exited) {
+        if (g_get_monotonic_time() > deadline) {
+            g_error("timed out after %dms waiting for the plugin to exit", TIMEOUT_MS);
+        }
+        g_usleep(10 * 1000);
+    }
+    g_free(script);
+}
+
+static void test_bus_disabled(void)
+{
+    Player player = {0};
+    GPtrArray *args = g_ptr_array_new_with_free_func(g_free);
+    GError *error = NULL;
+    gchar *dir = g_dir_make_tmp("mpv-mpris-test-XXXXXX", &error);
+    gchar *ipc_path = g_build_filename(dir, "ipc", NULL);
+
+    g_assert_no_error(error);
+    player.client_name = "test-bus-disabled";
+    player.bus_name = "org.mpris.MediaPlayer2.mpv.test-bus-disabled";
+    player.bus = bus_new(NULL);
+
+    g_ptr_array_add(args, g_strdup("mpv"));
+    g_ptr_array_add(args, g_strdup("--no-config"));
+    g_ptr_array_add(args, g_strdup("--no-terminal"));
+    g_ptr_array_add(args, g_strdup("--vo=null"));
+    g_ptr_array_add(args, g_strdup("--ao=null"));
+    g_ptr_array_add(args, g_strdup("--idle=yes"));
+    g_ptr_array_add(args, g_strdup_printf("--audio-client-name=%s", player.client_name));
+    g_ptr_array_add(args, g_strdup_printf("--log-file=%s/%s.mpv.log",
+                                          log_dir, player.client_name));
+    if (plugin[0] != '\0') {
+        g_ptr_array_add(args, g_strdup("--load-scripts=no"));
+        g_ptr_array_add(args, g_strdup_printf("--script=%s", plugin));
+    }
+    g_ptr_array_add(args, g_strdup("--script-opts=mpris-bus-address=none"));
+    g_ptr_array_add(args, g_strdup_printf("--input-ipc-server=%s", ipc_path));
+    g_ptr_array_add(args, NULL);
+
+    player.mpv = g_subprocess_newv((const char *const *)args->pdata,
+                                   G_SUBPROCESS_FLAGS_NONE, &error);
+    g_assert_no_error(error);
+    g_ptr_array_unref(args);
+
+    // The plugin stays off the bus, it is done without ever taking the
+    // name, and doesn't hold mpv up when quitting
+    wait_for_plugin_exit(ipc_path);
+    g_assert_false(name_has_owner(&player, NULL));
+    g_subprocess_send_signal(player.mpv, SIGTERM);
+    g_assert_true(player_wait_exit(&player));
+
+    g_object_unref(player.mpv);
+    g_object_unref(player.bus);
+    g_unlink(ipc_path);
+    g_rmdir(dir);
+    g_free(ipc_path);
+    g_free(dir);
+}
+
+static void test_p2p_direct(void)
+{
+    GError *error = NULL;
+    gchar *dir = g_dir_make_tmp("mpv-mpris-test-XXXXXX", &error);
+    gchar *path = g_build_filename(dir, "p2p", NULL);
+    gchar *opts = g_strdup_printf("--script-opts=mpris-p2p-socket=%s", path);
+    gchar *address = g_strconcat("unix:path=", path, NULL);
+    const char *args[] = {opts, NULL};
+    Player *player;
+    GDBusConnection *peer;
+    GVariant *reply;
+    GVariant *value;
+    // The status last signalled to the direct client, and the wanted one
+    gchar *status[2] = {NULL, "Playing"};
+    guint id;
+
+    g_assert_no_error(error);
+    player = player_new("test-p2p", args);
+
+    peer = g_dbus_connection_new_for_address_sync(address,
+                                                  G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT,
+                                                  NULL, NULL, &error);
+    g_assert_no_error(error);
+    id = g_dbus_connection_signal_subscribe(peer, NULL, PROPERTIES_IFACE,
+                                            "PropertiesChanged", MPRIS_PATH, NULL,
+                                            G_DBUS_SIGNAL_FLAGS_NONE,
+                                            on_peer_properties_changed, &status[0], NULL);
+
+    reply = g_dbus_connection_call_sync(peer, NULL, MPRIS_PATH, PROPERTIES_IFACE, "Get",
+                                        g_variant_new("(ss)", ROOT_IFACE, "Identity"),
+                                        G_VARIANT_TYPE("(v)"), G_DBUS_CALL_FLAGS_NONE,
+                                        TIMEOUT_MS, NULL, &error);
+    g_assert_no_error(error);
+    g_variant_get(reply, "(v)", &value);
+    g_assert_cmpstr(g_variant_get_string(value, NULL), ==, player->client_name);
+    g_variant_unref(value);
+    g_variant_unref(reply);
+
+    reply = g_dbus_connection_call_sync(peer, NULL, MPRIS_PATH, PLAYER_IFACE, "Play",
+                                        NULL, NULL, G_DBUS_CALL_FLAGS_NONE,
+                                        TIMEOUT_MS, NULL, &error);
+    g_assert_no_error(error);
+    g_variant_unref(reply);
+
+    // Signals reach both the direct client and the bus
+    if (!wait_for(player, peer_status_is, status)) {
+        g_error("timed out after %dms waiting for PlaybackStatus on the direct connection",
+                TIMEOUT_MS);
+    }
+    assert_property(player, PLAYER_IFACE, "PlaybackStatus", g_variant_new_string("Playing"));
+
+    g_dbus_connection_signal_unsubscribe(peer, id);
+    g_object_unref(peer);
+    player_free(player);
+    g_rmdir(dir);
+    g_free(status[0]);
+    g_free(address);
+    g_free(opts);
+    g_free(path);
+    g_free(dir);
+}
+
+static void test_trace_replay(void)
+{
+    gchar *trace = g_strdup_printf("%s/trace-replay.trace", log_dir);
+    gchar *opts = g_strdup_printf("--script-opts=mpris-trace-file=%s", trace);
+    const char *args[] = {opts, NULL};
+    Player *player;
+    GSubprocess *replay;
+    gchar *output = NULL;
+    GError *error = NULL;
+
+    if (!g_file_test("./replay", G_FILE_TEST_IS_EXECUTABLE)) {
+        g_test_skip("replay not built");
+        g_free(opts);
+        g_free(trace);
+        return;
+    }
+
+    player = player_new("test-trace-replay", args);
+    call_ok(player, PLAYER_IFACE, "Play", NULL);
+    assert_property(player, PLAYER_IFACE, "PlaybackStatus", g_variant_new_string("Playing"));
+    call_ok(player, PLAYER_IFACE, "Pause", NULL);
+    assert_property(player, PLAYER_IFACE, "PlaybackStatus", g_variant_new_string("Paused"));
+    player_free(player);
+
+    replay = g_subprocess_new(G_SUBPROCESS_FLAGS_STDOUT_PIPE | G_SUBPROCESS_FLAGS_STDERR_MERGE,
+                              &error, "./replay", "--fast", trace, NULL);
+    g_assert_no_error(error);
+    g_subprocess_communicate_utf8(replay, NULL, NULL, &output, NULL, &error);
+    g_assert_no_error(error);
+    g_test_message("%s", output);
+    g_assert_true(g_subprocess_get_successful(replay));
+    g_assert_nonnull(strstr(output, "signal PropertiesChanged:"));
+
+    g_free(output);
+    g_object_unref(replay);
+    g_free(opts);
+    g_free(trace);
+}
+
+static void test_player_open_uri_append(void)
+{
+    const char *args[] = {"--script-opts=mpris-open-uri-mode=append,mpris-extensions=yes",
+                          NULL};
+    Player *player = player_new("test-open-uri-append", args);
+    GVariant *reply;
+    GVariant *item;
+    const char *track_id;
+
+    // Both go to the end of the two entry playlist, in order
+    call_ok(player, PLAYER_IFACE, "OpenUri", g_variant_new("(s)", play_uri));
+    reply = call(player, EXT_IFACE, "Enqueue", g_variant_new("(s)", play_uri), NULL);
+    g_assert_nonnull(reply);
+    g_variant_get(reply, "(&o)", &track_id);
+    g_assert_true(g_str_has_suffix(track_id, "/3"));
+    g_variant_unref(reply);
+
+    // The current track keeps playing
+    item = get_metadata_item(player, "mpris:trackid");
+    g_assert_nonnull(item);
+    g_assert_true(g_str_has_suffix(g_variant_get_string(item, NULL), "/0"));
+    g_variant_unref(item);
+    assert_property(player, PLAYER_IFACE, "CanGoNext", g_variant_new_boolean(TRUE));
+
+    player_free(player);
+}
+
+static void test_player_read_limit(void)
+{
+    const char *args[] = {"--script-opts=mpris-read-rate=1,mpris-read-burst=5", NULL};
+    Player *player = player_new("test-read-limit", args);
+    GError *error = NULL;
+    GVariant *reply;
+    int reads;
+
+    // The burst is used up within a few reads, the rest are refused
+    for (reads = 0; reads < 20; reads++) {
+        reply = call(player, PROPERTIES_IFACE, "GetAll",
+                     g_variant_new("(s)", PLAYER_IFACE), &error);
+        if (!reply) {
+            break;
+        }
+        g_variant_unref(reply);
+    }
+    g_assert_error(error, G_DBUS_ERROR, G_DBUS_ERROR_LIMITS_EXCEEDED);
+    g_assert_cmpint(reads, <=, 6);
+    g_clear_error(&error);
+
+    // Control calls are not limited
+    call_ok(player, PLAYER_IFACE, "Play", NULL);
+    call_ok(player, PLAYER_IFACE, "Pause", NULL);
+
+    player_free(player);
+}
+
+static void test_player_read_snapshot(void)
+{
+    const char *args[] = {"--script-opts=mpris-read-rate=1,mpris-read-burst=5,"
+                          "mpris-read-excess=snapshot", NULL};
+    Player *player = player_new("test-read-snapshot", args);
+    GError *error = NULL;
+    GVariant *reply;
+
+    // Reads over the limit get the value that was read last
+    for (int reads = 0; reads < 20; reads++) {
+        assert_property(player, PLAYER_IFACE, "Volume", g_variant_new_double(1.0));
+    }
+    reply = call(player, PROPERTIES_IFACE, "GetAll",
+                 g_variant_new("(s)", PLAYER_IFACE), &error);
+    g_assert_no_error(error);
+    g_variant_unref(reply);
+
+    // Only the player interface has a snapshot
+    reply = call(player, PROPERTIES_IFACE, "Get",
+                 g_variant_new("(ss)", ROOT_IFACE, "Identity"), &error);
+    g_assert_null(reply);
+    g_assert_error(error, G_DBUS_ERROR, G_DBUS_ERROR_LIMITS_EXCEEDED);
+    g_clear_error(&error);
+
+    player_free(player);
+}
+
+typedef gboolean (*StatusCondition)(const MprisStatus *status, gconstpointer data);
+
+// The page is meant to be polled, so that is what the test does
+static void wait_for_status(const MprisStatusPage *page, MprisStatus *status,
+                            StatusCondition condition, gconstpointer data)
+{
+    gint64 deadline = g_get_monotonic_time() + TIMEOUT_MS * 1000;
+
+    while (!mpris_status_read(page, status) || !condition(status, data)) {
+        if (g_get_monotonic_time() > deadline) {
+            g_error("timed out after %dms waiting for the status page", TIMEOUT_MS);
+        }
+        g_usleep(10 * 1000);
+    }
+}
+
+static gboolean status_title_is(const MprisStatus *status, gconstpointer title)
+{
+    return g_strcmp0(status->title, title) == 0;
+}
+
+static gboolean status_is_playing(const MprisStatus *status,
+                                  G_GNUC_UNUSED gconstpointer data)
+{
+    return status->playback_status == MPRIS_STATUS_PLAYING;
+}
+
+static void test_status_page(void)
+{
+    GError *error = NULL;
+    gchar *dir = g_dir_make_tmp("mpv-mpris-test-XXXXXX", &error);
+    gchar *path = g_build_filename(dir, "status", NULL);
+    gchar *opts = g_strconcat("--script-opts=mpris-status-page=", path, NULL);
+    const char *args[] = {opts, NULL};
+    Player *player;
+    const MprisStatusPage *page;
+    MprisStatus status;
+    GVariant *title;
+    GVariant *volume;
+    int fd;
+
+    g_assert_no_error(error);
+    player = player_new("test-status-page", args);
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    g_assert_cmpint(fd, >=, 0);
+    page = mmap(NULL, sizeof(*page), PROT_READ, MAP_SHARED, fd, 0);
+    g_assert_true(page != MAP_FAILED);
+    close(fd);
+
+    // The page agrees with the bus
+    title = get_metadata_item(player, "xesam:title");
+    g_assert_nonnull(title);
+    wait_for_status(page, &status, status_title_is, g_variant_get_string(title, NULL));
+    g_variant_unref(title);
+    g_assert_cmpuint(status.playback_status, ==, MPRIS_STATUS_PAUSED);
+    g_assert_cmpfloat(status.rate, ==, 1.0);
+    volume = get(player, PLAYER_IFACE, "Volume");
+    g_assert_cmpfloat(status.volume, ==, g_variant_get_double(volume));
+    g_variant_unref(volume);
+
+    call_ok(player, PLAYER_IFACE, "Play", NULL);
+    wait_for_status(page, &status, status_is_playing, NULL);
+    g_assert_cmpint(mpris_status_position(&status), >=, status.position_us);
+
+    // Readers that still have it mapped can tell that mpv is gone
+    player_free(player);
+    g_assert_false(mpris_status_read(page, &status));
+    g_assert_false(g_file_test(path, G_FILE_TEST_EXISTS));
+
+    munmap((void*)page, sizeof(*page));
+    g_rmdir(dir);
+    g_free(opts);
+    g_free(path);
+    g_free(dir);
+}
+
+int main(int argc, char **argv)
+{
+    GTestDBus *bus;
+    int ret;
+
+    g_test_init(&argc, &argv, NULL);
+
+    plugin = g_getenv("MPV_MPRIS_TEST_PLUGIN");
+    if (!plugin) {
+        plugin = "../mpris.so";
+    }
+    log_dir = g_getenv("MPV_MPRIS_TEST_LOG");
+    if (!log_dir) {
+        log_dir = ".";
+    }
+    play_file = g_getenv("MPV_MPRIS_TEST_PLAY");
+    if (!play_file) {
+        play_file = "/usr/share/sounds/freedesktop/stereo/alarm-clock-elapsed.oga";
+    }
+    if (!g_file_test(play_file, G_FILE_TEST_IS_REGULAR)) {
+        g_printerr("%s not an existing file\n", play_file);
+        return 1;
+    }
+    // The plugin reports canonical file URIs
+    play_path = g_canonicalize_filename(play_file, NULL);
+    play_file = play_path;
+    play_uri = g_filename_to_uri(play_path, NULL, NULL);
+
+    g_test_add_func("/root/properties", test_root_properties);
+    g_test_add_func("/root/raise", test_root_raise);
+    g_test_add_func("/root/fullscreen", test_root_fullscreen);
+    g_test_add_func("/root/quit", test_root_quit);
+    g_test_add_func("/player/properties", test_player_properties);
+    g_test_add_func("/player/play-pause", test_player_play_pause);
+    g_test_add_func("/player/stop", test_player_stop);
+    g_test_add_func("/player/next-previous", test_player_next_previous);
+    g_test_add_func("/player/seek", test_player_seek);
+    g_test_add_func("/player/seek-burst", test_player_seek_burst);
+    g_test_add_func("/player/loop-status", test_player_loop_status);
+    g_test_add_func("/player/rate", test_player_rate);
+    g_test_add_func("/player/shuffle", test_player_shuffle);
+    g_test_add_func("/player/volume", test_player_volume);
+    g_test_add_func("/player/volume-burst", test_player_volume_burst);
+    g_test_add_func("/player/metadata", test_player_metadata);
+    g_test_add_func("/player/lazy-metadata", test_player_lazy_metadata);
+    g_test_add_func("/player/open-uri", test_player_open_uri);
+    g_test_add_func("/player/open-uri-append", test_player_open_uri_append);
+    g_test_add_func("/player/read-limit", test_player_read_limit);
+    g_test_add_func("/player/read-snapshot", test_player_read_snapshot);
+    g_test_add_func("/ext/heartbeat", test_ext_heartbeat);
+    g_test_add_func("/ext/batch", test_ext_batch);
+    g_test_add_func("/ext/get-art", test_ext_get_art);
+    g_test_add_func("/art/albumart", test_art_albumart);
+    g_test_add_func("/art/thumbnail", test_art_thumbnail);
+    g_test_add_func("/bus/reconnect", test_bus_reconnect);
+    g_test_add_func("/bus/disabled", test_bus_disabled);
+    g_test_add_func("/p2p/direct", test_p2p_direct);
+    g_test_add_func("/trace/replay", test_trace_replay);
+    g_test_add_func("/status/page", test_status_page);
+
+    bus = g_test_dbus_new(G_TEST_DBUS_NONE);
+    g_test_dbus_up(bus);
+
+    ret = g_test_run();
+
+    if (shared_player) {
+        player_free(shared_player);
+    }
+    g_test_dbus_down(bus);
+    g_object_unref(bus);
+    g_free(play_uri);
+    g_free(play_path);
+
+    return ret;
+}
@@ -0,0 +1,397 @@
+// Replays a trace recorded with mpris-trace-file through the plugin, with
+// a stub mpv and a private bus, and reports call latencies and the
+// signals the plugin emitted.
+#include "../mpris.c"
+#include "stub-mpv.h"
+
+#define MPRIS_PATH "/org/mpris/MediaPlayer2"
+#define PROPERTIES_IFACE "org.freedesktop.DBus.Properties"
+#define CLIENT_NAME "replay"
+#define TIMEOUT_MS 5000
+
+typedef struct Replay
+{
+    GDBusConnection *bus;
+    gchar *bus_name;
+    guint pending;
+    GArray *latencies; // gint64 microseconds
+    guint64 errors;
+    GHashTable *signal_counts; // member -> count
+    FILE *signal_log;
+} Replay;
+
+typedef struct PendingCall
+{
+    Replay *replay;
+    gint64 start;
+} PendingCall;
+
+static GPtrArray *read_trace(const char *path)
+{
+    GError *error = NULL;
+    gchar *contents;
+    gsize length;
+    gsize offset = 10;
+    gboolean swap;
+    GPtrArray *records;
+
+    if (!g_file_get_contents(path, &contents, &length, &error)) {
+        g_printerr("%s\n", error->message);
+        g_error_free(error);
+        return NULL;
+    }
+
+    if (length < offset || memcmp(contents, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0 ||
+        (guint8)contents[8] == 0 || (guint8)contents[8] > TRACE_VERSION) {
+        g_printerr("%s is not a trace of a supported version\n", path);
+        g_free(contents);
+        return NULL;
+    }
+    swap = contents[9] != (G_BYTE_ORDER == G_LITTLE_ENDIAN ? 'l' : 'B');
+
+    records = g_ptr_array_new_with_free_func((GDestroyNotify)g_variant_unref);
+    while (offset + 4 <= length) {
+        guint32 size;
+        GBytes *bytes;
+        GVariant *record;
+
+        memcpy(&size, contents + offset, 4);
+        size = GUINT32_FROM_LE(size);
+        offset += 4;
+        if (size > length - offset) {
+            // Cut off by a crash, keep what is complete
+            break;
+        }
+
+        bytes = g_bytes_new(contents + offset, size);
+        record = g_variant_new_from_bytes(G_VARIANT_TYPE(TRACE_RECORD_TYPE), bytes, FALSE);
+        g_bytes_unref(bytes);
+        if (swap) {
+            GVariant *swapped = g_variant_byteswap(record);
+            g_variant_unref(record);
+            record = swapped;
+        }
+        g_ptr_array_add(records, g_variant_ref_sink(record));
+        offset += size;
+    }
+
+    g_free(contents);
+    return records;
+}
+
+static gpointer run_plugin(gpointer mpv)
+{
+    return GINT_TO_POINTER(mpv_open_cplugin(mpv));
+}
+
+static void on_signal(G_GNUC_UNUSED GDBusConnection *connection,
+                      G_GNUC_UNUSED const char *sender,
+                      G_GNUC_UNUSED const char *object_path,
+                      const char *interface_name,
+                      const char *signal_name,
+                      GVariant *parameters,
+                      gpointer user_data)
+{
+    Replay *replay = user_data;
+    gpointer count = g_hash_table_lookup(replay->signal_counts, signal_name);
+
+    g_hash_table_insert(replay->signal_counts, g_strdup(signal_name),
+                        GUINT_TO_POINTER(GPOINTER_TO_UINT(count) + 1));
+
+    if (replay->signal_log) {
+        gchar *params = g_variant_print(parameters, TRUE);
+        fprintf(replay->signal_log, "%s.%s %s\n", interface_name, signal_name, params);
+        g_free(params);
+    }
+}
+
+static void on_reply(GObject *source, GAsyncResult *res, gpointer data)
+{
+    PendingCall *call = data;
+    Replay *replay = call->replay;
+    GError *error = NULL;
+    gint64 latency = g_get_monotonic_time() - call->start;
+    GVariant *reply = g_dbus_connection_call_finish(G_DBUS_CONNECTION(source), res, &error);
+
+    g_array_append_val(replay->latencies, latency);
+    if (reply) {
+        g_variant_unref(reply);
+    } else {
+        // Calls which failed when recorded fail again, only count them
+        replay->errors++;
+        g_error_free(error);
+    }
+
+    replay->pending--;
+    g_free(call);
+}
+
+static void call(Replay *replay, const char *interface_name, const char *method,
+                 GVariant *params)
+{
+    PendingCall *pending = g_new0(PendingCall, 1);
+
+    pending->replay = replay;
+    pending->start = g_get_monotonic_time();
+    replay->pending++;
+    g_dbus_connection_call(replay->bus, replay->bus_name, MPRIS_PATH,
+                           interface_name, method, params, NULL,
+                           G_DBUS_CALL_FLAGS_NO_AUTO_START, TIMEOUT_MS, NULL,
+                           on_reply, pending);
+}
+
+// The plugin reads properties while handling a record, so the values it
+// read, which follow the record, have to be in place before it is replayed
+static void preload_reads(mpv_handle *mpv, GPtrArray *records, guint next)
+{
+    for (; next < records->len; next++) {
+        guchar kind;
+        const char *name;
+        GVariant *payload;
+
+        g_variant_get(g_ptr_array_index(records, next), "(xy&sv)",
+                      NULL, &kind, &name, &payload);
+        if (kind != 'r') {
+            g_variant_unref(payload);
+            break;
+        }
+
+        // () if mpv failed to read it
+        stub_mpv_set(mpv, name,
+                     g_variant_is_of_type(payload, G_VARIANT_TYPE_UNIT) ? NULL : payload);
+        g_variant_unref(payload);
+    }
+}
+
+static void replay_record(Replay *replay, mpv_handle *mpv, GVariant *record)
+{
+    guchar kind;
+    const char *name;
+    GVariant *payload;
+
+    g_variant_get(record, "(xy&sv)", NULL, &kind, &name, &payload);
+
+    if (kind == 'p') {
+        stub_mpv_push_property_change(mpv, name, g_variant_ref(payload));
+
+    } else if (kind == 'e') {
+        guint32 event_id;
+        guint64 reply_userdata;
+        gint32 error;
+        g_variant_get(payload, "(uti)", &event_id, &reply_userdata, &error);
+        stub_mpv_push_event(mpv, event_id, reply_userdata, error);
+
+    } else {
+        const char *interface_name;
+        GVariant *args;
+        g_variant_get(payload, "(&sv)", &interface_name, &args);
+
+        if (kind == 'c') {
+            call(replay, interface_name, name, g_variant_ref(args));
+        } else if (kind == 'g') {
+            call(replay, PROPERTIES_IFACE, "Get",
+                 g_variant_new("(ss)", interface_name, name));
+        } else if (kind == 's') {
+            call(replay, PROPERTIES_IFACE, "Set",
+                 g_variant_new("(ssv)", interface_name, name, args));
+        }
+        g_variant_unref(args);
+    }
+
+    g_variant_unref(payload);
+}
+
+static gboolean deadline_reached(gpointer data)
+{
+    *(gboolean*)data = TRUE;
+    return G_SOURCE_REMOVE;
+}
+
+// Handles replies and signals until the deadline
+static void run_until(gint64 deadline)
+{
+    gint64 remaining = deadline - g_get_monotonic_time();
+    gboolean done = FALSE;
+    GSource *timeout;
+
+    if (remaining <= 0) {
+        while (g_main_context_iteration(NULL, FALSE));
+        return;
+    }
+
+    timeout = g_timeout_source_new(remaining / 1000);
+    g_source_set_callback(timeout, deadline_reached, &done, NULL);
+    g_source_attach(timeout, NULL);
+    while (!done) {
+        g_main_context_iteration(NULL, TRUE);
+    }
+    g_source_destroy(timeout);
+    g_source_unref(timeout);
+}
+
+static gboolean wait_for_name(Replay *replay)
+{
+    gint64 deadline = g_get_monotonic_time() + TIMEOUT_MS * 1000;
+
+    while (g_get_monotonic_time() < deadline) {
+        gboolean has_owner = FALSE;
+        GVariant *reply =
+            g_dbus_connection_call_sync(replay->bus, "org.freedesktop.DBus",
+                                        "/org/freedesktop/DBus", "org.freedesktop.DBus",
+                                        "NameHasOwner",
+                                        g_variant_new("(s)", replay->bus_name),
+                                        G_VARIANT_TYPE("(b)"), G_DBUS_CALL_FLAGS_NONE,
+                                        -1, NULL, NULL);
+        if (reply) {
+            g_variant_get(reply, "(b)", &has_owner);
+            g_variant_unref(reply);
+        }
+        if (has_owner) {
+            return TRUE;
+        }
+        run_until(g_get_monotonic_time() + 10 * 1000);
+    }
+
+    return FALSE;
+}
+
+static int compare_int64(gconstpointer a, gconstpointer b)
+{
+    gint64 x = *(const gint64*)a;
+    gint64 y = *(const gint64*)b;
+    return (x > y) - (x < y);
+}
+
+static gint64 percentile(GArray *samples, guint percent)
+{
+    if (samples->len == 0) {
+        return 0;
+    }
+    return g_array_index(samples, gint64, (samples->len - 1) * percent / 100);
+}
+
+int main(int argc, char **argv)
+{
+    gboolean fast = FALSE;
+    gchar *signal_log = NULL;
+    GOptionEntry entries[] = {
+        {"fast", 'f', 0, G_OPTION_ARG_NONE, &fast,
+         "Replay as fast as possible instead of with the recorded timing", NULL},
+        {"signals", 's', 0, G_OPTION_ARG_FILENAME, &signal_log,
+         "Write the emitted signals to FILE", "FILE"},
+        {NULL, 0, 0, 0, NULL, NULL, NULL},
+    };
+    GOptionContext *options = g_option_context_new("TRACE");
+    GError *error = NULL;
+    GPtrArray *records;
+    GTestDBus *test_bus;
+    mpv_handle *mpv;
+    GThread *plugin;
+    Replay replay = {0};
+    GHashTableIter iter;
+    gpointer name, count;
+    gboolean shutdown = FALSE;
+    gint64 start;
+    gint64 elapsed;
+
+    g_option_context_add_main_entries(options, entries, NULL);
+    if (!g_option_context_parse(options, &argc, &argv, &error) || argc != 2) {
+        g_printerr("%s\n", error ? error->message : "Expected one trace file");
+        return 2;
+    }
+    g_option_context_free(options);
+
+    records = read_trace(argv[1]);
+    if (!records) {
+        return 1;
+    }
+
+    test_bus = g_test_dbus_new(G_TEST_DBUS_NONE);
+    g_test_dbus_up(test_bus);
+
+    mpv = stub_mpv_new();
+    stub_mpv_set(mpv, "audio-client-name", g_variant_new_string(CLIENT_NAME));
+    stub_mpv_set(mpv, "playlist-count", g_variant_new_int64(0));
+    stub_mpv_set(mpv, "playlist-pos", g_variant_new_int64(-1));
+    plugin = g_thread_new("plugin", run_plugin, mpv);
+
+    replay.bus = g_bus_get_sync(G_BUS_TYPE_SESSION, NULL, &error);
+    g_assert_no_error(error);
+    replay.bus_name = g_strconcat("org.mpris.MediaPlayer2.mpv.", CLIENT_NAME, NULL);
+    replay.latencies = g_array_new(FALSE, FALSE, sizeof(gint64));
+    replay.signal_counts = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    if (signal_log) {
+        replay.signal_log = fopen(signal_log, "w");
+        if (!replay.signal_log) {
+            g_printerr("Failed to open %s: %s\n", signal_log, g_strerror(errno));
+            return 1;
+        }
+    }
+    g_dbus_connection_signal_subscribe(replay.bus, NULL, NULL, NULL, MPRIS_PATH, NULL,
+                                       G_DBUS_SIGNAL_FLAGS_NONE, on_signal, &replay, NULL);
+
+    if (!wait_for_name(&replay)) {
+        g_printerr("Timed out waiting for %s\n", replay.bus_name);
+        return 1;
+    }
+
+    start = g_get_monotonic_time();
+    preload_reads(mpv, records, 0);
+    for (guint i = 0; i < records->len; i++) {
+        GVariant *record = g_ptr_array_index(records, i);
+        gint64 timestamp;
+        guchar kind;
+        const char *record_name;
+
+        g_variant_get(record, "(xy&sv)", &timestamp, &kind, &record_name, NULL);
+        if (kind == 'r') {
+            continue;
+        }
+        run_until(fast ? 0 : start + timestamp);
+
+        if (kind == 'e' && g_strcmp0(record_name, mpv_event_name(MPV_EVENT_SHUTDOWN)) == 0) {
+            // Let outstanding calls finish before the plugin goes away
+            break;
+        }
+        preload_reads(mpv, records, i + 1);
+        replay_record(&replay, mpv, record);
+    }
+
+    while (replay.pending > 0) {
+        g_main_context_iteration(NULL, TRUE);
+    }
+    elapsed = g_get_monotonic_time() - start;
+    // Signals emitted at the end may still be on their way
+    run_until(g_get_monotonic_time() + 100 * 1000);
+
+    stub_mpv_push_event(mpv, MPV_EVENT_SHUTDOWN, 0, 0);
+    shutdown = g_thread_join(plugin) == GINT_TO_POINTER(0);
+
+    g_array_sort(replay.latencies, compare_int64);
+    printf("records: %u\n", records->len);
+    printf("elapsed: %" G_GINT64_FORMAT " us\n", elapsed);
+    printf("calls: %u, %" G_GUINT64_FORMAT " failed\n", replay.latencies->len, replay.errors);
+    printf("latency p50: %" G_GINT64_FORMAT " us\n", percentile(replay.latencies, 50));
+    printf("latency p99: %" G_GINT64_FORMAT " us\n", percentile(replay.latencies, 99));
+    printf("latency max: %" G_GINT64_FORMAT " us\n", percentile(replay.latencies, 100));
+    printf("mpv commands: %" G_GUINT64_FORMAT "\n", stub_mpv_commands(mpv));
+    g_hash_table_iter_init(&iter, replay.signal_counts);
+    while (g_hash_table_iter_next(&iter, &name, &count)) {
+        printf("signal %s: %u\n", (const char*)name, GPOINTER_TO_UINT(count));
+    }
+
+    if (replay.signal_log) {
+        fclose(replay.signal_log);
+    }
+    g_free(signal_log);
+    g_hash_table_unref(replay.signal_counts);
+    g_array_unref(replay.latencies);
+    g_free(replay.bus_name);
+    g_object_unref(replay.bus);
+    stub_mpv_free(mpv);
+    g_test_dbus_down(test_bus);
+    g_object_unref(test_bus);
+    g_ptr_array_unref(records);
+
+    return shutdown ? 0 : 1;
+}
@@ -0,0 +1,338 @@
+#include <gio/gio.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MPRIS_PATH "/org/mpris/MediaPlayer2"
+#define PLAYER_IFACE "org.mpris.MediaPlayer2.Player"
+#define EXT_IFACE "io.mpv.Mpris"
+#define PROPERTIES_IFACE "org.freedesktop.DBus.Properties"
+#define BUS_NAME "org.mpris.MediaPlayer2.mpv.stress"
+
+#define CALL_TIMEOUT_MS 10000
+
+// Number of properties on the Player interface, changed_properties can
+// never legitimately hold more than this
+#define MAX_CHANGED_PROPERTIES 16
+
+typedef struct Latencies
+{
+    GMutex lock;
+    GArray *samples; // gint64 microseconds
+} Latencies;
+
+typedef struct Poller
+{
+    GThread *thread;
+    GDBusConnection *bus;
+    Latencies *latencies;
+    guint64 calls;
+} Poller;
+
+static volatile gint stop_polling;
+
+static gint64 env_int(const char *name, gint64 def)
+{
+    const char *value = g_getenv(name);
+    return value ? g_ascii_strtoll(value, NULL, 10) : def;
+}
+
+static void latencies_add(Latencies *latencies, gint64 start)
+{
+    gint64 elapsed = g_get_monotonic_time() - start;
+    g_mutex_lock(&latencies->lock);
+    g_array_append_val(latencies->samples, elapsed);
+    g_mutex_unlock(&latencies->lock);
+}
+
+static int compare_int64(gconstpointer a, gconstpointer b)
+{
+    gint64 x = *(const gint64*)a;
+    gint64 y = *(const gint64*)b;
+    return (x > y) - (x < y);
+}
+
+static gint64 latencies_p99(Latencies *latencies)
+{
+    GArray *samples = latencies->samples;
+    if (samples->len == 0) {
+        return 0;
+    }
+    g_array_sort(samples, compare_int64);
+    return g_array_index(samples, gint64, (samples->len * 99) / 100);
+}
+
+static GDBusConnection *connect_private(void)
+{
+    GError *error = NULL;
+    gchar *address = g_dbus_address_get_for_bus_sync(G_BUS_TYPE_SESSION, NULL, &error);
+    g_assert_no_error(error);
+    GDBusConnection *bus = g_dbus_connection_new_for_address_sync(
+        address,
+        G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT |
+        G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION,
+        NULL, NULL, &error);
+    g_assert_no_error(error);
+    g_free(address);
+    return bus;
+}
+
+static GVariant *call(GDBusConnection *bus, const char *iface, const char *method,
+                      GVariant *params, Latencies *latencies)
+{
+    GError *error = NULL;
+    gint64 start = g_get_monotonic_time();
+    GVariant *reply = g_dbus_connection_call_sync(bus, BUS_NAME, MPRIS_PATH,
+                                                  iface, method, params, NULL,
+                                                  G_DBUS_CALL_FLAGS_NONE,
+                                                  CALL_TIMEOUT_MS, NULL, &error);
+    if (latencies) {
+        latencies_add(latencies, start);
+    }
+    if (!reply) {
+        g_error("%s.%s failed: %s", iface, method, error->message);
+    }
+    return reply;
+}
+
+static void set(GDBusConnection *bus, const char *name, GVariant *value,
+                Latencies *latencies)
+{
+    g_variant_unref(call(bus, PROPERTIES_IFACE, "Set",
+                         g_variant_new("(ssv)", PLAYER_IFACE, name, value),
+                         latencies));
+}
+
+static gpointer poll_get_all(gpointer data)
+{
+    Poller *poller = data;
+
+    while (!g_atomic_int_get(&stop_polling)) {
+        g_variant_unref(call(poller->bus, PROPERTIES_IFACE, "GetAll",
+                             g_variant_new("(s)", PLAYER_IFACE),
+                             poller->latencies));
+        poller->calls++;
+    }
+
+    return NULL;
+}
+
+static gint64 read_rss_kib(GSubprocess *mpv)
+{
+    gchar *path = g_strdup_printf("/proc/%s/status", g_subprocess_get_identifier(mpv));
+    gchar *contents = NULL;
+    gint64 rss = -1;
+
+    if (g_file_get_contents(path, &contents, NULL, NULL)) {
+        const char *line = strstr(contents, "VmRSS:");
+        if (line) {
+            rss = g_ascii_strtoll(line + strlen("VmRSS:"), NULL, 10);
+        }
+    }
+
+    g_free(contents);
+    g_free(path);
+    return rss;
+}
+
+static void check_stats(GDBusConnection *bus, guint op)
+{
+    GVariant *reply = call(bus, EXT_IFACE, "GetStats", NULL, NULL);
+    GVariant *stats = g_variant_get_child_value(reply, 0);
+    guint32 changed = 0;
+    guint64 art_size = 0;
+    guint64 art_budget = 0;
+
+    g_variant_lookup(stats, "changed-properties", "u", &changed);
+    g_variant_lookup(stats, "art-cache-size", "t", &art_size);
+    g_variant_lookup(stats, "art-cache-budget", "t", &art_budget);
+
+    if (changed > MAX_CHANGED_PROPERTIES) {
+        g_error("after %u operations changed_properties holds %u entries", op, changed);
+    }
+    // The current track's art may exceed the budget on its own
+    if (art_size > art_budget + 2 * 1024 * 1024) {
+        g_error("after %u operations the art cache holds %" G_GUINT64_FORMAT
+                " bytes with a budget of %" G_GUINT64_FORMAT,
+                op, art_size, art_budget);
+    }
+
+    g_variant_unref(stats);
+    g_variant_unref(reply);
+}
+
+int main(int argc, char **argv)
+{
+    const char *plugin = g_getenv("MPV_MPRIS_TEST_PLUGIN");
+    const char *playlist = argc > 1 ? argv[1] : "stress-corpus/playlist.m3u";
+    gint64 ops = env_int("MPV_MPRIS_STRESS_OPS", 5000);
+    gint64 pollers_count = env_int("MPV_MPRIS_STRESS_POLLERS", 4);
+    gint64 rss_growth_limit_kib = env_int("MPV_MPRIS_STRESS_RSS_GROWTH_MB", 64) * 1024;
+    gint64 p99_limit_us = env_int("MPV_MPRIS_STRESS_P99_MS", 50) * 1000;
+    Latencies control = {0};
+    Latencies polling = {0};
+    Poller *pollers;
+    GTestDBus *test_bus;
+    GDBusConnection *bus;
+    GSubprocess *mpv;
+    GPtrArray *args;
+    GError *error = NULL;
+    gint64 rss_start;
+    gint64 rss_max;
+    gint64 start;
+    guint64 poll_calls = 0;
+    gboolean shuffle = FALSE;
+    int ret = 0;
+
+    if (!plugin) {
+        plugin = "../mpris.so";
+    }
+
+    control.samples = g_array_new(FALSE, FALSE, sizeof(gint64));
+    polling.samples = g_array_new(FALSE, FALSE, sizeof(gint64));
+    g_mutex_init(&control.lock);
+    g_mutex_init(&polling.lock);
+
+    test_bus = g_test_dbus_new(G_TEST_DBUS_NONE);
+    g_test_dbus_up(test_bus);
+
+    args = g_ptr_array_new();
+    g_ptr_array_add(args, "mpv");
+    g_ptr_array_add(args, "--no-config");
+    g_ptr_array_add(args, "--no-terminal");
+    g_ptr_array_add(args, "--vo=null");
+    g_ptr_array_add(args, "--ao=null");
+    g_ptr_array_add(args, "--pause");
+    g_ptr_array_add(args, "--keep-open=yes");
+    g_ptr_array_add(args, "--audio-client-name=stress");
+    g_ptr_array_add(args, "--script-opts=mpris-extensions=yes");
+    g_ptr_array_add(args, "--log-file=stress.mpv.log");
+    if (plugin[0] != '\0') {
+        g_ptr_array_add(args, "--load-scripts=no");
+        g_ptr_array_add(args, "--script");
+        g_ptr_array_add(args, (gpointer)plugin);
+    }
+    g_ptr_array_add(args, "--playlist");
+    g_ptr_array_add(args, (gpointer)playlist);
+    g_ptr_array_add(args, NULL);
+
+    mpv = g_subprocess_newv((const char *const *)args->pdata, G_SUBPROCESS_FLAGS_NONE, &error);
+    g_assert_no_error(error);
+    g_ptr_array_unref(args);
+
+    bus = connect_private();
+
+    // Wait for the plugin to show up
+    start = g_get_monotonic_time();
+    for (;;) {
+        GVariant *reply = g_dbus_connection_call_sync(bus, "org.freedesktop.DBus",
+                                                      "/org/freedesktop/DBus",
+                                                      "org.freedesktop.DBus",
+                                                      "NameHasOwner",
+                                                      g_variant_new("(s)", BUS_NAME),
+                                                      G_VARIANT_TYPE("(b)"),
+                                                      G_DBUS_CALL_FLAGS_NONE,
+                                                      -1, NULL, NULL);
+        gboolean owned = FALSE;
+        if (reply) {
+            g_variant_get(reply, "(b)", &owned);
+            g_variant_unref(reply);
+        }
+        if (owned) {
+            break;
+        }
+        if (g_get_monotonic_time() - start > CALL_TIMEOUT_MS * 1000) {
+            g_error("timed out waiting for %s", BUS_NAME);
+        }
+        g_usleep(10000);
+    }
+
+    rss_start = rss_max = read_rss_kib(mpv);
+
+    pollers = g_new0(Poller, pollers_count);
+    for (gint64 i = 0; i < pollers_count; i++) {
+        pollers[i].bus = connect_private();
+        pollers[i].latencies = &polling;
+        pollers[i].thread = g_thread_new("poller", poll_get_all, &pollers[i]);
+    }
+
+    start = g_get_monotonic_time();
+    for (guint op = 0; op < ops; op++) {
+        guint32 r = g_random_int();
+        GVariant *reply;
+
+        if (r % 3 == 0) {
+            reply = call(bus, PLAYER_IFACE, "Previous", NULL, &control);
+        } else {
+            reply = call(bus, PLAYER_IFACE, "Next", NULL, &control);
+        }
+        g_variant_unref(reply);
+
+        if (op % 5 == 0) {
+            // Bursts of small seeks, like a scroll wheel
+            for (int i = 0; i < 5; i++) {
+                g_variant_unref(call(bus, PLAYER_IFACE, "Seek",
+                                     g_variant_new("(x)", (gint64)200000), &control));
+            }
+        }
+
+        if (op % 7 == 0) {
+            // A volume slider drag
+            for (int i = 0; i <= 20; i++) {
+                set(bus, "Volume", g_variant_new_double(i / 20.0), &control);
+            }
+        }
+
+        if (op % 50 == 0) {
+            shuffle = !shuffle;
+            set(bus, "Shuffle", g_variant_new_boolean(shuffle), &control);
+        }
+
+        if (op % 100 == 0) {
+            gint64 rss = read_rss_kib(mpv);
+            rss_max = MAX(rss_max, rss);
+            if (rss - rss_start > rss_growth_limit_kib) {
+                g_error("after %u operations mpv RSS grew from %" G_GINT64_FORMAT
+                        " KiB to %" G_GINT64_FORMAT " KiB", op, rss_start, rss);
+            }
+            check_stats(bus, op);
+        }
+    }
+
+    g_atomic_int_set(&stop_polling, 1);
+    for (gint64 i = 0; i < pollers_count; i++) {
+        g_thread_join(pollers[i].thread);
+        poll_calls += pollers[i].calls;
+        g_object_unref(pollers[i].bus);
+    }
+    g_free(pollers);
+
+    g_print("%" G_GINT64_FORMAT " operations in %.1fs, %" G_GUINT64_FORMAT " GetAll calls\n",
+            ops, (g_get_monotonic_time() - start) / 1000000.0, poll_calls);
+    g_print("RSS: %" G_GINT64_FORMAT " KiB at start, %" G_GINT64_FORMAT " KiB peak\n",
+            rss_start, rss_max);
+    g_print("p99 latency: control %.2fms, GetAll %.2fms\n",
+            latencies_p99(&control) / 1000.0, latencies_p99(&polling) / 1000.0);
+
+    if (latencies_p99(&control) > p99_limit_us) {
+        g_printerr("control p99 latency above %" G_GINT64_FORMAT "ms\n", p99_limit_us / 1000);
+        ret = 1;
+    }
+    if (latencies_p99(&polling) > p99_limit_us) {
+        g_printerr("GetAll p99 latency above %" G_GINT64_FORMAT "ms\n", p99_limit_us / 1000);
+        ret = 1;
+    }
+
+    g_subprocess_send_signal(mpv, SIGTERM);
+    g_subprocess_wait(mpv, NULL, NULL);
+    g_object_unref(mpv);
+    g_object_unref(bus);
+
+    g_test_dbus_down(test_bus);
+    g_object_unref(test_bus);
+
+    g_array_unref(control.samples);
+    g_array_unref(polling.samples);
+
+    return ret;
+}
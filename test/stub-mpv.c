@@ -0,0 +1,420 @@
+#include "stub-mpv.h"
+
+#include <string.h>
+
+typedef struct StubEvent
+{
+    mpv_event_id event_id;
+    uint64_t reply_userdata;
+    int error;
+    gchar *name; // property changes only
+    GVariant *value;
+} StubEvent;
+
+struct mpv_handle
+{
+    GMutex lock;
+    GHashTable *properties; // name -> GVariant
+    GQueue events;
+    void (*wakeup)(void *data);
+    void *wakeup_data;
+    guint64 commands;
+
+    // Returned by mpv_wait_event(), valid until the next call
+    mpv_event event;
+    mpv_event_property property;
+    mpv_event_command command;
+    StubEvent *current;
+    union {
+        int flag;
+        int64_t int64;
+        double dbl;
+        char *string;
+    } value;
+};
+
+static void stub_event_free(StubEvent *event)
+{
+    if (!event) {
+        return;
+    }
+    g_free(event->name);
+    if (event->value) {
+        g_variant_unref(event->value);
+    }
+    g_free(event);
+}
+
+mpv_handle *stub_mpv_new(void)
+{
+    mpv_handle *mpv = g_new0(mpv_handle, 1);
+    g_mutex_init(&mpv->lock);
+    mpv->properties = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                            (GDestroyNotify)g_variant_unref);
+    g_queue_init(&mpv->events);
+    return mpv;
+}
+
+void stub_mpv_free(mpv_handle *mpv)
+{
+    g_queue_clear_full(&mpv->events, (GDestroyNotify)stub_event_free);
+    stub_event_free(mpv->current);
+    g_free(mpv->value.string);
+    g_hash_table_unref(mpv->properties);
+    g_mutex_clear(&mpv->lock);
+    g_free(mpv);
+}
+
+void stub_mpv_set(mpv_handle *mpv, const char *name, GVariant *value)
+{
+    g_mutex_lock(&mpv->lock);
+    if (value) {
+        g_hash_table_insert(mpv->properties, g_strdup(name), g_variant_ref_sink(value));
+    } else {
+        g_hash_table_remove(mpv->properties, name);
+    }
+    g_mutex_unlock(&mpv->lock);
+}
+
+static void push(mpv_handle *mpv, StubEvent *event)
+{
+    void (*wakeup)(void *data);
+    void *wakeup_data;
+
+    g_mutex_lock(&mpv->lock);
+    g_queue_push_tail(&mpv->events, event);
+    wakeup = mpv->wakeup;
+    wakeup_data = mpv->wakeup_data;
+    g_mutex_unlock(&mpv->lock);
+
+    if (wakeup) {
+        wakeup(wakeup_data);
+    }
+}
+
+void stub_mpv_push_property_change(mpv_handle *mpv, const char *name, GVariant *value)
+{
+    StubEvent *event = g_new0(StubEvent, 1);
+
+    value = g_variant_ref_sink(value);
+    stub_mpv_set(mpv, name,
+                 g_variant_is_of_type(value, G_VARIANT_TYPE_UNIT) ? NULL : value);
+
+    event->event_id = MPV_EVENT_PROPERTY_CHANGE;
+    event->name = g_strdup(name);
+    event->value = value;
+    push(mpv, event);
+}
+
+void stub_mpv_push_event(mpv_handle *mpv, mpv_event_id event_id,
+                         uint64_t reply_userdata, int error)
+{
+    StubEvent *event = g_new0(StubEvent, 1);
+    event->event_id = event_id;
+    event->reply_userdata = reply_userdata;
+    event->error = error;
+    push(mpv, event);
+}
+
+guint64 stub_mpv_commands(mpv_handle *mpv)
+{
+    guint64 commands;
+    g_mutex_lock(&mpv->lock);
+    commands = mpv->commands;
+    g_mutex_unlock(&mpv->lock);
+    return commands;
+}
+
+static const char *string_of(GVariant *value)
+{
+    if (g_variant_is_of_type(value, G_VARIANT_TYPE_STRING)) {
+        return g_variant_get_string(value, NULL);
+    }
+    if (g_variant_is_of_type(value, G_VARIANT_TYPE_BYTESTRING)) {
+        return g_variant_get_bytestring(value);
+    }
+    return NULL;
+}
+
+static int to_node(GVariant *value, mpv_node *node)
+{
+    const char *string = string_of(value);
+
+    if (string) {
+        node->format = MPV_FORMAT_STRING;
+        node->u.string = g_strdup(string);
+    } else if (g_variant_is_of_type(value, G_VARIANT_TYPE_BOOLEAN)) {
+        node->format = MPV_FORMAT_FLAG;
+        node->u.flag = g_variant_get_boolean(value);
+    } else if (g_variant_is_of_type(value, G_VARIANT_TYPE_INT64)) {
+        node->format = MPV_FORMAT_INT64;
+        node->u.int64 = g_variant_get_int64(value);
+    } else if (g_variant_is_of_type(value, G_VARIANT_TYPE_DOUBLE)) {
+        node->format = MPV_FORMAT_DOUBLE;
+        node->u.double_ = g_variant_get_double(value);
+    } else if (g_variant_is_of_type(value, G_VARIANT_TYPE("a{ss}"))) {
+        GVariantIter iter;
+        const char *key;
+        const char *item;
+        int i = 0;
+        mpv_node_list *list = g_new0(mpv_node_list, 1);
+
+        list->num = g_variant_n_children(value);
+        list->keys = g_new0(char *, list->num);
+        list->values = g_new0(mpv_node, list->num);
+        g_variant_iter_init(&iter, value);
+        while (g_variant_iter_next(&iter, "{&s&s}", &key, &item)) {
+            list->keys[i] = g_strdup(key);
+            list->values[i].format = MPV_FORMAT_STRING;
+            list->values[i].u.string = g_strdup(item);
+            i++;
+        }
+        node->format = MPV_FORMAT_NODE_MAP;
+        node->u.list = list;
+    } else {
+        return MPV_ERROR_PROPERTY_FORMAT;
+    }
+
+    return MPV_ERROR_SUCCESS;
+}
+
+// Converts like mpv does between numbers, every type can be read as a string
+static int get_value(GVariant *value, mpv_format format, void *data)
+{
+    const char *string = string_of(value);
+    gboolean is_int = g_variant_is_of_type(value, G_VARIANT_TYPE_INT64);
+    gboolean is_double = g_variant_is_of_type(value, G_VARIANT_TYPE_DOUBLE);
+    gboolean is_flag = g_variant_is_of_type(value, G_VARIANT_TYPE_BOOLEAN);
+
+    switch (format) {
+    case MPV_FORMAT_STRING:
+        if (string) {
+            *(char **)data = g_strdup(string);
+        } else if (is_flag) {
+            *(char **)data = g_strdup(g_variant_get_boolean(value) ? "yes" : "no");
+        } else if (is_int) {
+            *(char **)data = g_strdup_printf("%" G_GINT64_FORMAT, g_variant_get_int64(value));
+        } else if (is_double) {
+            *(char **)data = g_strdup_printf("%f", g_variant_get_double(value));
+        } else {
+            return MPV_ERROR_PROPERTY_FORMAT;
+        }
+        return MPV_ERROR_SUCCESS;
+    case MPV_FORMAT_FLAG:
+        if (!is_flag) {
+            return MPV_ERROR_PROPERTY_FORMAT;
+        }
+        *(int *)data = g_variant_get_boolean(value);
+        return MPV_ERROR_SUCCESS;
+    case MPV_FORMAT_INT64:
+        if (is_int) {
+            *(int64_t *)data = g_variant_get_int64(value);
+        } else if (is_double) {
+            *(int64_t *)data = g_variant_get_double(value);
+        } else {
+            return MPV_ERROR_PROPERTY_FORMAT;
+        }
+        return MPV_ERROR_SUCCESS;
+    case MPV_FORMAT_DOUBLE:
+        if (is_double) {
+            *(double *)data = g_variant_get_double(value);
+        } else if (is_int) {
+            *(double *)data = g_variant_get_int64(value);
+        } else {
+            return MPV_ERROR_PROPERTY_FORMAT;
+        }
+        return MPV_ERROR_SUCCESS;
+    case MPV_FORMAT_NODE:
+        return to_node(value, data);
+    default:
+        return MPV_ERROR_PROPERTY_FORMAT;
+    }
+}
+
+static GVariant *from_data(mpv_format format, void *data)
+{
+    switch (format) {
+    case MPV_FORMAT_STRING:
+        return g_variant_new_bytestring(*(char **)data);
+    case MPV_FORMAT_FLAG:
+        return g_variant_new_boolean(*(int *)data);
+    case MPV_FORMAT_INT64:
+        return g_variant_new_int64(*(int64_t *)data);
+    case MPV_FORMAT_DOUBLE:
+        return g_variant_new_double(*(double *)data);
+    default:
+        return NULL;
+    }
+}
+
+int mpv_get_property(mpv_handle *ctx, const char *name, mpv_format format, void *data)
+{
+    GVariant *value;
+    int res = MPV_ERROR_PROPERTY_UNAVAILABLE;
+
+    g_mutex_lock(&ctx->lock);
+    value = g_hash_table_lookup(ctx->properties, name);
+    if (value) {
+        res = get_value(value, format, data);
+    }
+    g_mutex_unlock(&ctx->lock);
+
+    return res;
+}
+
+char *mpv_get_property_string(mpv_handle *ctx, const char *name)
+{
+    char *value = NULL;
+    mpv_get_property(ctx, name, MPV_FORMAT_STRING, &value);
+    return value;
+}
+
+int mpv_set_property(mpv_handle *ctx, const char *name, mpv_format format, void *data)
+{
+    GVariant *value = from_data(format, data);
+
+    if (!value) {
+        return MPV_ERROR_PROPERTY_FORMAT;
+    }
+
+    stub_mpv_set(ctx, name, value);
+    g_mutex_lock(&ctx->lock);
+    ctx->commands++;
+    g_mutex_unlock(&ctx->lock);
+    return MPV_ERROR_SUCCESS;
+}
+
+int mpv_set_property_async(mpv_handle *ctx, G_GNUC_UNUSED uint64_t reply_userdata,
+                           const char *name, mpv_format format, void *data)
+{
+    return mpv_set_property(ctx, name, format, data);
+}
+
+int mpv_command_async(mpv_handle *ctx, G_GNUC_UNUSED uint64_t reply_userdata,
+                      G_GNUC_UNUSED const char **args)
+{
+    g_mutex_lock(&ctx->lock);
+    ctx->commands++;
+    g_mutex_unlock(&ctx->lock);
+    return MPV_ERROR_SUCCESS;
+}
+
+int mpv_command_node_async(mpv_handle *ctx, G_GNUC_UNUSED uint64_t reply_userdata,
+                           G_GNUC_UNUSED mpv_node *args)
+{
+    g_mutex_lock(&ctx->lock);
+    ctx->commands++;
+    g_mutex_unlock(&ctx->lock);
+    return MPV_ERROR_SUCCESS;
+}
+
+const char *mpv_error_string(int error)
+{
+    return error < 0 ? "error" : "success";
+}
+
+int mpv_observe_property(G_GNUC_UNUSED mpv_handle *mpv, G_GNUC_UNUSED uint64_t reply_userdata,
+                         G_GNUC_UNUSED const char *name, G_GNUC_UNUSED mpv_format format)
+{
+    return MPV_ERROR_SUCCESS;
+}
+
+void mpv_set_wakeup_callback(mpv_handle *ctx, void (*cb)(void *d), void *d)
+{
+    g_mutex_lock(&ctx->lock);
+    ctx->wakeup = cb;
+    ctx->wakeup_data = d;
+    g_mutex_unlock(&ctx->lock);
+}
+
+mpv_event *mpv_wait_event(mpv_handle *ctx, G_GNUC_UNUSED double timeout)
+{
+    StubEvent *event;
+
+    g_clear_pointer(&ctx->current, stub_event_free);
+    g_clear_pointer(&ctx->value.string, g_free);
+    memset(&ctx->event, 0, sizeof(ctx->event));
+
+    g_mutex_lock(&ctx->lock);
+    event = g_queue_pop_head(&ctx->events);
+    g_mutex_unlock(&ctx->lock);
+
+    if (!event) {
+        ctx->event.event_id = MPV_EVENT_NONE;
+        return &ctx->event;
+    }
+
+    ctx->current = event;
+    ctx->event.event_id = event->event_id;
+    ctx->event.reply_userdata = event->reply_userdata;
+    ctx->event.error = event->error;
+
+    if (event->event_id == MPV_EVENT_PROPERTY_CHANGE) {
+        const char *string = string_of(event->value);
+
+        ctx->property.name = event->name;
+        ctx->property.data = &ctx->value;
+        if (string) {
+            ctx->property.format = MPV_FORMAT_STRING;
+            ctx->value.string = g_strdup(string);
+        } else if (get_value(event->value, MPV_FORMAT_FLAG, &ctx->value.flag) == 0) {
+            ctx->property.format = MPV_FORMAT_FLAG;
+        } else if (g_variant_is_of_type(event->value, G_VARIANT_TYPE_INT64)) {
+            ctx->property.format = MPV_FORMAT_INT64;
+            ctx->value.int64 = g_variant_get_int64(event->value);
+        } else if (g_variant_is_of_type(event->value, G_VARIANT_TYPE_DOUBLE)) {
+            ctx->property.format = MPV_FORMAT_DOUBLE;
+            ctx->value.dbl = g_variant_get_double(event->value);
+        } else {
+            ctx->property.format = MPV_FORMAT_NONE;
+            ctx->property.data = NULL;
+        }
+        ctx->event.data = &ctx->property;
+    } else if (event->event_id == MPV_EVENT_COMMAND_REPLY) {
+        // Commands never return a result
+        memset(&ctx->command, 0, sizeof(ctx->command));
+        ctx->event.data = &ctx->command;
+    }
+
+    return &ctx->event;
+}
+
+void mpv_free(void *data)
+{
+    g_free(data);
+}
+
+void mpv_free_node_contents(mpv_node *node)
+{
+    if (node->format == MPV_FORMAT_STRING) {
+        g_free(node->u.string);
+    } else if (node->format == MPV_FORMAT_NODE_MAP || node->format == MPV_FORMAT_NODE_ARRAY) {
+        mpv_node_list *list = node->u.list;
+        for (int i = 0; i < list->num; i++) {
+            if (list->keys) {
+                g_free(list->keys[i]);
+            }
+            mpv_free_node_contents(&list->values[i]);
+        }
+        g_free(list->keys);
+        g_free(list->values);
+        g_free(list);
+    }
+    node->format = MPV_FORMAT_NONE;
+}
+
+const char *mpv_event_name(mpv_event_id event)
+{
+    switch (event) {
+    case MPV_EVENT_SHUTDOWN: return "shutdown";
+    case MPV_EVENT_START_FILE: return "start-file";
+    case MPV_EVENT_END_FILE: return "end-file";
+    case MPV_EVENT_FILE_LOADED: return "file-loaded";
+    case MPV_EVENT_SEEK: return "seek";
+    case MPV_EVENT_PLAYBACK_RESTART: return "playback-restart";
+    case MPV_EVENT_PROPERTY_CHANGE: return "property-change";
+    case MPV_EVENT_SET_PROPERTY_REPLY: return "set-property-reply";
+    case MPV_EVENT_COMMAND_REPLY: return "command-reply";
+    default: return NULL;
+    }
+}
@@ -0,0 +1,25 @@
+#ifndef STUB_MPV_H
+#define STUB_MPV_H
+
+#include <glib.h>
+#include <mpv/client.h>
+
+// A stand-in for libmpv that the plugin can be linked against. Properties
+// are GVariants: b for flags, x for integers, d for doubles, s or ay for
+// strings and a{ss} for string maps. Events are only generated when pushed.
+
+mpv_handle *stub_mpv_new(void);
+void stub_mpv_free(mpv_handle *mpv);
+
+// value is consumed if floating, NULL removes the property
+void stub_mpv_set(mpv_handle *mpv, const char *name, GVariant *value);
+
+// Also updates the property, a value of () reports it as unavailable
+void stub_mpv_push_property_change(mpv_handle *mpv, const char *name, GVariant *value);
+void stub_mpv_push_event(mpv_handle *mpv, mpv_event_id event_id,
+                         uint64_t reply_userdata, int error);
+
+// Number of commands and property writes the plugin has sent
+guint64 stub_mpv_commands(mpv_handle *mpv);
+
+#endif